@@ -3,6 +3,8 @@
 #include <cstring>
 #include <unistd.h> //open and close
 #include <fcntl.h>
+#include <thread>
+#include <vector>
 #include "graph.h"
 
 class BadStreamException : public std::exception {
@@ -88,6 +90,43 @@ public:
   }
   inline uint32_t nodes() {return num_nodes;}
   inline uint64_t edges() {return num_edges;}
+
+  /**
+   * Count the updates of each node with one pass over the whole stream, split
+   * between num_threads threads. Independent of the MT_StreamReaders of the
+   * stream, so may be called before they start. See Graph::reserve_updates.
+   * @param num_threads  the number of threads reading the stream.
+   * @returns the number of updates (edges inserted or deleted) of each node,
+   *          which bounds its degree at any point of the stream.
+   */
+  std::vector<node_id_t> update_counts(int num_threads = 1) {
+    std::vector<node_id_t> counts(num_nodes);
+    std::atomic<uint64_t> scan_off(12);
+    auto task = [&]() {
+      char *buf = (char *) malloc(buf_size * sizeof(char));
+      uint32_t data_read;
+      while ((data_read = read_data(buf, scan_off)) != 0) {
+        for (char *edge = buf; edge < buf + data_read; edge += edge_size) {
+          uint32_t a;
+          uint32_t b;
+          std::memcpy(&a, edge + 1, sizeof(uint32_t));
+          std::memcpy(&b, edge + 5, sizeof(uint32_t));
+          __atomic_fetch_add(&counts[a], 1, __ATOMIC_RELAXED);
+          __atomic_fetch_add(&counts[b], 1, __ATOMIC_RELAXED);
+        }
+      }
+      free(buf);
+    };
+
+    std::vector<std::thread> threads;
+    for (int i = 1; i < num_threads; i++)
+      threads.emplace_back(task);
+    task();
+    for (auto &thr : threads)
+      thr.join();
+    return counts;
+  }
+
   BinaryGraphStream_MT(const BinaryGraphStream_MT &) = delete;
   BinaryGraphStream_MT & operator=(const BinaryGraphStream_MT &) = delete;
   friend class MT_StreamReader;
@@ -100,14 +139,16 @@ private:
   uint32_t buf_size;      // how big is the data buffer
   const uint32_t edge_size = sizeof(uint8_t) + 2 * sizeof(uint32_t); // size of a binary encoded edge
   uint64_t end_of_file;
-  inline uint32_t read_data(char *buf) {
-    uint64_t read_off = stream_off.fetch_add(buf_size, std::memory_order_relaxed);
+  inline uint32_t read_data(char *buf) { return read_data(buf, stream_off); }
+  // read the next buf_size bytes of the stream from the given offset, which is advanced past them
+  inline uint32_t read_data(char *buf, std::atomic<uint64_t> &off) {
+    uint64_t read_off = off.fetch_add(buf_size, std::memory_order_relaxed);
     if (read_off >= end_of_file) return 0;
     
     // perform read using pread
     size_t data_read = 0;
     while (data_read < buf_size && read_off + data_read < end_of_file) {
-      data_read += pread(stream_fd, buf, buf_size, read_off + data_read); // perform the read
+      data_read += pread(stream_fd, buf + data_read, buf_size - data_read, read_off + data_read); // perform the read
     }
     return data_read;
   }
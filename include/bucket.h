@@ -23,6 +23,44 @@ namespace Bucket_Boruvka {
    */
   inline static vec_hash_t index_hash(const vec_t& index, long seed);
 
+  /**
+   * Hashes the update index once for use by every column and sketch (see WIDE_HASHING).
+   * @param update_idx Update index.
+   * @return A 128 bit hash of the update index from which all other hashes are derived.
+   */
+  inline static wide_hash_t wide_index_hash(const vec_t& update_idx);
+
+  /**
+   * Derives the key used by wide_col_index_hash from a seed. Computing the key
+   * once per column lets it be shared by a batch of updates.
+   * @param seed_and_col The seed of the Sketch plus the column index, as in col_index_hash.
+   *                     Pass checksum_seed(sketch_seed) for the key of the checksum.
+   * @return The key of this (seed, column) pair.
+   */
+  inline static uint64_t wide_key(const long seed_and_col);
+
+  /**
+   * The seed passed to wide_key to derive the checksum of a Sketch.
+   */
+  inline static long wide_checksum_seed(const long sketch_seed);
+
+  /**
+   * Expands a wide hash into the hash of one column (or the checksum) of one sketch.
+   * Replaces col_index_hash when using WIDE_HASHING.
+   * @param wide The return value of wide_index_hash.
+   * @param key  The return value of wide_key.
+   * @return The hash of the update index for this key.
+   */
+  inline static col_hash_t wide_col_index_hash(const wide_hash_t& wide, const uint64_t key);
+
+  /**
+   * Replaces index_hash when using WIDE_HASHING.
+   * @param wide The return value of wide_index_hash.
+   * @param key  The return value of wide_key(wide_checksum_seed(sketch_seed)).
+   * @return The checksum of the update index.
+   */
+  inline static vec_hash_t wide_checksum(const wide_hash_t& wide, const uint64_t key);
+
   /**
    * Checks whether the hash associated with the Bucket hashes the index to 0.
    * @param col_index_hash The return value to Bucket::col_index_hash
@@ -31,6 +69,15 @@ namespace Bucket_Boruvka {
    */
   inline static bool contains(const col_hash_t& col_index_hash, const vec_t& guess_nonzero);
 
+  /**
+   * Computes how many buckets of a column contain the index. This is the number
+   * of consecutive guesses j = 0, 1, ... for which contains(col_index_hash, 1 << j) holds.
+   * @param col_index_hash The return value to Bucket::col_index_hash
+   * @param num_guesses    The number of buckets in the column. Must be less than 64.
+   * @return the number of buckets, starting from guess 0, that contain the index.
+   */
+  inline static unsigned get_depth(const col_hash_t& col_index_hash, const unsigned num_guesses);
+
   /**
    * Checks whether a Bucket is good, assuming the Bucket contains all elements.
    * @param a The bucket's a value.
@@ -69,10 +116,59 @@ inline vec_hash_t Bucket_Boruvka::index_hash(const vec_t& index, long sketch_see
   return vec_hash(&index, sizeof(index), sketch_seed);
 }
 
+/*
+ * The wide hash is a single XXH3-128 of the update index, independent of any
+ * seed. The hash of every (sketch, column) pair is then
+ * fmix64(low + key * high) where key is an odd number derived from the seed of
+ * the pair; all randomness between sketches comes from the keys. Because key is
+ * odd, low + key * high is uniform for every key, and the values of two distinct
+ * indices are independent (up to the quality of XXH3). This is the double
+ * hashing scheme of Kirsch and Mitzenmacher. Across the keys of one index the
+ * values are related linearly; the murmur3 finalizer (a bijection) breaks this
+ * relation so the depths of different columns behave independently. The scheme
+ * is not provably k-wise independent, tools/statistical_testing checks that
+ * the failure rate of connected components is unchanged.
+ */
+namespace Bucket_Boruvka {
+  inline static uint64_t fmix64(uint64_t k) {
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+  }
+} // namespace Bucket_Boruvka
+
+inline wide_hash_t Bucket_Boruvka::wide_index_hash(const vec_t& update_idx) {
+  return wide_hash(&update_idx, sizeof(update_idx), 0);
+}
+
+inline uint64_t Bucket_Boruvka::wide_key(const long seed_and_col) {
+  return fmix64(seed_and_col) | 1;
+}
+
+inline long Bucket_Boruvka::wide_checksum_seed(const long sketch_seed) {
+  return ~sketch_seed;
+}
+
+inline col_hash_t Bucket_Boruvka::wide_col_index_hash(const wide_hash_t& wide, const uint64_t key) {
+  return fmix64(wide.low64 + key * wide.high64);
+}
+
+inline vec_hash_t Bucket_Boruvka::wide_checksum(const wide_hash_t& wide, const uint64_t key) {
+  return wide_col_index_hash(wide, key) >> 32;
+}
+
 inline bool Bucket_Boruvka::contains(const col_hash_t& col_index_hash, const col_hash_t& guess_nonzero) {
   return (col_index_hash & guess_nonzero) == 0; // use guess_nonzero (power of 2) to check ith bit
 }
 
+inline unsigned Bucket_Boruvka::get_depth(const col_hash_t& col_index_hash, const unsigned num_guesses) {
+  // the bit at num_guesses caps the depth of an index that is contained in every bucket
+  return __builtin_ctzll(col_index_hash | (((col_hash_t)1) << num_guesses));
+}
+
 inline bool Bucket_Boruvka::is_good(const vec_t& a, const vec_hash_t& c, const long& sketch_seed) {
   return c == index_hash(a, sketch_seed);
 }
@@ -0,0 +1,63 @@
+#pragma once
+#include <atomic>
+#include <mutex>
+#include "types.h"
+
+/**
+ * Every edge update is applied to the supernodes of both of its endpoints and
+ * all supernodes of a graph share a seed, so both applications compute exactly
+ * the same hashes. This cache holds the hashes (the bundle, see
+ * Supernode::hash_updates) computed for the first endpoint of an edge until
+ * the second endpoint is processed and takes them.
+ *
+ * The cache is direct mapped and bounded: an entry is overwritten by any later
+ * edge that maps to the same slot. Losing an entry only means its hashes are
+ * recomputed.
+ */
+class EdgeHashCache {
+private:
+  static size_t cache_bytes; // configured size of the cache, 0 = disabled
+  static constexpr size_t num_locks = 1024;
+
+  size_t bundle_size;
+  size_t num_slots;
+  vec_t *keys;   // the edge stored in each slot, 0 if empty (edge 0 is a self edge)
+  char *bundles; // num_slots bundles of bundle_size bytes
+  std::mutex locks[num_locks];
+
+  std::atomic<uint64_t> hits;
+  std::atomic<uint64_t> misses;
+
+  inline size_t slot_of(vec_t edge) const {
+    // fibonacci hashing to spread the regular edge indices over the slots
+    return (edge * 0x9E3779B97F4A7C15ULL) % num_slots;
+  }
+public:
+  /**
+   * @param bundle_size  the size of each bundle in bytes.
+   * @param bytes        the (approximate) amount of memory the cache may use.
+   */
+  EdgeHashCache(size_t bundle_size, size_t bytes);
+  ~EdgeHashCache();
+
+  /**
+   * Remove the bundle of an edge from the cache.
+   * @param edge    the edge index.
+   * @param bundle  where to copy the bundle to.
+   * @return        true if the edge was in the cache, false otherwise.
+   */
+  bool take(vec_t edge, char *bundle);
+
+  /**
+   * Place the bundle of an edge in the cache, replacing whatever was in its slot.
+   */
+  void put(vec_t edge, const char *bundle);
+
+  uint64_t get_hits() const { return hits; }
+  uint64_t get_misses() const { return misses; }
+
+  // manage configuration
+  // configuration should be set before creating the graph
+  static size_t get_config() { return cache_bytes; }
+  static void set_config(size_t bytes) { cache_bytes = bytes; }
+};
@@ -3,10 +3,15 @@
 #include <exception>
 #include <set>
 #include <fstream>
+#include <mutex>
 #include <atomic>  // REMOVE LATER
+#include <memory>
+#include <unordered_map>
 
 #include <guttering_system.h>
 #include "supernode.h"
+#include "supernode_arena.h"
+#include "edge_hash_cache.h"
 
 #ifdef VERIFY_SAMPLES_F
 #include "test/graph_verifier.h"
@@ -31,19 +36,167 @@ class MultipleGraphsException : public std::exception {
   }
 };
 
+// The file given to the Graph constructor cannot be read as a graph
+class BadCheckpointException : public std::exception {
+  std::string msg;
+public:
+  explicit BadCheckpointException(std::string msg) : msg(std::move(msg)) {}
+  virtual const char* what() const throw() {
+    return msg.c_str();
+  }
+};
+
+/**
+ * The configuration and interface shared by the Graphs of every l0 sampler.
+ * GraphWorkers update a graph through this interface.
+ */
+class GraphBase {
+protected:
+  static bool open_graph;
+  // whether every edge a sketch holds is sampled in each round rather than only the first
+  static bool sample_all;
+  // number of supernodes sampled together by sample_supernodes, see Supernode::sample_batch
+  static constexpr size_t sample_group_size = 64;
+  // nodes with at most this many edges hold them explicitly rather than in a supernode
+  // 0 disables the explicit (exact) form
+  static size_t exact_degree;
+  // nodes with more updates than this get partial supernodes per graph worker, see
+  // GraphT::hot_partial. 0 disables them
+  static size_t hot_updates;
+
+public:
+  virtual ~GraphBase() {}
+
+  // update the supernode of src with a batch of edges, see GraphT::batch_update
+  virtual void batch_update(node_id_t src, const std::vector<node_id_t> &edges,
+                            void *delta_loc) = 0;
+  // update the supernodes of a pack of small batches at once, see GraphT::batch_updates
+  virtual void batch_updates(const std::pair<node_id_t, std::vector<node_id_t>> *batches,
+                             size_t num, void *delta_loc) = 0;
+  // the smallest batch applied through a delta supernode by the graph's supernodes,
+  // see SupernodeT::get_in_place_threshold
+  virtual size_t get_in_place_threshold() const = 0;
+
+  // manage configuration
+  // configuration should be set before running connected components
+  static bool get_sample_all() { return sample_all; }
+  static void set_sample_all(bool all) { sample_all = all; }
+  static size_t get_exact_degree() { return exact_degree; }
+  static void set_exact_degree(size_t degree) { exact_degree = degree; }
+  static size_t get_hot_updates() { return hot_updates; }
+  static void set_hot_updates(size_t updates) { hot_updates = updates; }
+};
+
 /**
  * Undirected graph object with n nodes labelled 0 to n-1, no self-edges,
  * multiple edges, or weights.
+ * The supernodes of the graph are built upon l0 samplers of type SamplerT, see SupernodeT.
  */
-class Graph {
+template <class SamplerT>
+class GraphT : public GraphBase {
 protected:
+  typedef SupernodeT<SamplerT> Supernode;
+
   node_id_t num_nodes;
   uint64_t seed;
   bool update_locked = false;
   bool modified = false;
-  // a set containing one "representative" from each supernode
-  std::set<node_id_t>* representatives;
+  // number of updates that cancelled within a batch and were never applied
+  std::atomic<uint64_t> num_cancelled{0};
+  size_t num_rounds = 0;
+  // the supernode of each node, placed in slot i of the arena for node i
+  // nullptr until the node is first updated, see materialize
   Supernode** supernodes;
+  SupernodeArena* arena;
+  static constexpr size_t num_materialize_locks = 1024;
+  std::mutex materialize_locks[num_materialize_locks];
+
+  // the header of the files of write_binary: the magic number and the format version
+  static constexpr uint32_t checkpoint_magic = 0x43434753; // "SGCC"
+  static constexpr uint32_t checkpoint_version = 1;
+
+  /**
+   * Get the supernode of a node, constructing it in its arena slot if the node
+   * has not been updated before. A node that is never updated has no edges, so
+   * it is a singleton component and its slot (and the arena pages it spans)
+   * are never touched. Safe to call concurrently.
+   */
+  Supernode* materialize(node_id_t node);
+
+  // construct the supernode of a node without one in its (never written) arena slot
+  Supernode* construct_supernode(node_id_t node);
+
+  /*
+   * With exact_degree > 0 a node without a supernode holds its edges explicitly:
+   * the exact_size[i] (<= exact_degree) edges of node i are kept sorted in slot i
+   * of exact_edges. A node is promoted to a supernode once it has more edges.
+   * nullptr if exact_degree is 0.
+   */
+  SupernodeArena* exact_edges = nullptr;
+  node_id_t* exact_size = nullptr;
+  inline vec_t* get_exact(node_id_t node) {
+    return reinterpret_cast<vec_t*>(exact_edges->slot(node));
+  }
+
+  /**
+   * Apply a batch of updates to the explicit edges of a node without a supernode.
+   * @param updates  the batch, sorted and free of duplicates (see cancel_updates).
+   * @return         true if the node still holds its edges explicitly. Otherwise
+   *                 its supernode has been constructed (empty) and updates is
+   *                 replaced by every edge of the node, to be applied to it.
+   */
+  bool update_exact(node_id_t node, std::vector<vec_t> &updates);
+
+  // give a node without a supernode one holding its explicit edges, only while updates are paused
+  Supernode* promote(node_id_t node);
+
+  // the sample of a node without a supernode, see sample_supernodes
+  std::pair<Edge, SampleSketchRet> sample_exact(node_id_t node, std::vector<Edge> *samples);
+
+  /**
+   * Merge the explicit edges of the nodes of to_merge into those of a, as the
+   * supernodes of the nodes would be merged. a and the nodes of to_merge must be
+   * without supernodes.
+   * @return  false, changing nothing, if the result would have too many edges.
+   */
+  bool merge_exact(node_id_t a, const std::vector<node_id_t> &to_merge);
+
+  /**
+   * Restore a node that had no supernode when it was backed up (see
+   * boruvka_emulation) to the explicit edges it had.
+   */
+  void restore_exact(node_id_t node, const std::vector<vec_t> &edges);
+
+  /*
+   * With hot_updates > 0 the updates applied to each node are counted (up to
+   * hot_updates) in node_updates. Once a node has more it is hot: each graph
+   * worker adds the batches of the node to a partial supernode of its own
+   * rather than contending for the supernode of the node with the others.
+   * Sketches are linear, so the partials are XORed into the supernodes of their
+   * nodes once the graph workers are paused (see merge_partials).
+   * nullptr if hot_updates is 0, or there is only one graph worker.
+   */
+  node_id_t* node_updates = nullptr;
+  typedef std::unordered_map<node_id_t, Supernode*> Partials; // by node
+  std::mutex partials_lock; // guards partials
+  std::vector<std::unique_ptr<Partials>> partials; // of each thread that has any
+  uint64_t graph_id; // tells the partials of this graph from those of earlier ones
+  static std::atomic<uint64_t> num_graphs;
+
+  /**
+   * Count a batch of updates of a node and get the partial supernode of the
+   * calling thread to apply it to if the node is hot. Safe to call concurrently.
+   * @return  nullptr if the node is not hot.
+   */
+  Supernode* hot_partial(node_id_t node, size_t num_updates);
+
+  // set the graph_id and allocate node_updates if hot nodes are enabled
+  void init_hot_nodes();
+
+  // XOR the partial supernodes into the supernodes of their nodes and free them.
+  // The graph workers are paused.
+  void merge_partials();
+
   // DSU representation of supernode relationship
   node_id_t* parent;
   node_id_t* size;
@@ -52,34 +205,65 @@ protected:
   // Guttering system for batching updates
   GutteringSystem *gts;
 
+  // Hashes of edges computed for one endpoint and not yet used by the other
+  // nullptr if the cache is disabled
+  EdgeHashCache *edge_cache = nullptr;
+
+  /**
+   * Compute the hashes of a batch of updates (see Supernode::hash_updates).
+   * If the edge_cache is enabled the hashes are taken from it where possible
+   * and the hashes computed are left there for the other endpoint.
+   * @param updates  the updates to hash. May be reordered to match the bundles.
+   * @param bundles  filled with the hashes of the updates.
+   */
+  void hash_updates(std::vector<vec_t> &updates, std::vector<char> &bundles);
+
+  // the encoded updates of a batch of edges of src
+  static void edges_to_updates(node_id_t src, const std::vector<node_id_t> &edges,
+                               std::vector<vec_t> &updates);
+
+  /**
+   * Remove the updates of a batch that cancel each other. Updates are XORed
+   * into the sketches so an edge inserted and deleted within one batch (or
+   * toggled any even number of times) has no effect.
+   * @param updates  the batch, left sorted with every update appearing at most once.
+   * @return         the number of updates removed.
+   */
+  static size_t cancel_updates(std::vector<vec_t> &updates);
+
   void backup_to_disk(const std::vector<node_id_t>& ids_to_backup);
   void restore_from_disk(const std::vector<node_id_t>& ids_to_restore);
 
   /**
    * Update the query array with new samples
-   * @param query  an array of supernode query results
-   * @param reps   an array containing node indices for the representative of each supernode
+   * @param query    an array of supernode query results
+   * @param reps     an array containing node indices for the representative of each supernode
+   * @param samples  if not nullptr (sample_all), filled with every edge sampled from each
+   *                 representative, see Supernode::sample_all_batch
    */
   virtual void sample_supernodes(std::pair<Edge, SampleSketchRet> *query,
-                          std::vector<node_id_t> &reps);
+                          std::vector<node_id_t> &reps, std::vector<Edge> *samples);
 
   /**
    * @param copy_supernodes  an array to be filled with supernodes
+   * @param copy_arena       where to place the copies, slot i for node i
    * @param to_merge         an list of lists of supernodes to be merged
    *
    */
   void merge_supernodes(Supernode** copy_supernodes, std::vector<node_id_t> &new_reps,
-                        std::vector<std::vector<node_id_t>> &to_merge, bool make_copy);
+                        SupernodeArena *copy_arena, std::vector<std::vector<node_id_t>> &to_merge,
+                        bool make_copy);
 
   /**
    * Run the disjoint set union to determine what supernodes
    * Should be merged together.
    * Map from nodes to a vector of nodes to merge with them
-   * @param query  an array of supernode query results
-   * @param reps   an array containing node indices for the representative of each supernode
+   * @param query    an array of supernode query results
+   * @param reps     an array containing node indices for the representative of each supernode
+   * @param samples  the edges sampled from each representative, nullptr unless sample_all
    */
   std::vector<std::vector<node_id_t>> supernodes_to_merge(std::pair<Edge, SampleSketchRet> *query,
-                        std::vector<node_id_t> &reps);
+                        std::vector<node_id_t> &reps, std::vector<Edge> *samples);
 
   /**
    * Main parallel algorithm utilizing Boruvka and L_0 sampling.
@@ -93,13 +277,18 @@ protected:
 
   FRIEND_TEST(GraphTestSuite, TestCorrectnessOfReheating);
   FRIEND_TEST(GraphTest, TestSupernodeRestoreAfterCCFailure);
+  FRIEND_TEST(GraphTest, TestUntouchedSupernodes);
 
-  static bool open_graph;
 public:
-  explicit Graph(node_id_t num_nodes, int num_inserters=1);
-  explicit Graph(const std::string &input_file, int num_inserters=1);
+  explicit GraphT(node_id_t num_nodes, int num_inserters=1);
+  /**
+   * Read a graph written by write_binary, or by its versions before the file header.
+   * @throws BadCheckpointException if the file cannot be opened, has an unknown version,
+   *         or was written under other sketch settings than those configured.
+   */
+  explicit GraphT(const std::string &input_file, int num_inserters=1);
 
-  virtual ~Graph();
+  virtual ~GraphT();
 
   inline void update(GraphUpdate upd, int thr_id = 0) {
     if (update_locked) throw UpdateLockedException();
@@ -117,7 +306,37 @@ public:
    * @param delta_loc  Memory location where we should initialize the delta
    *                   supernode.
    */
-  void batch_update(node_id_t src, const std::vector<node_id_t> &edges, Supernode *delta_loc);
+  void batch_update(node_id_t src, const std::vector<node_id_t> &edges, void *delta_loc) override;
+
+  /**
+   * Update the supernodes of a pack of batches, as batch_update does each in
+   * turn. The updates of every batch small enough to be applied in place are
+   * hashed together in one pass (see Supernode::hash_updates) and then applied
+   * to the supernode of their batch, so that packing many tiny batches saves
+   * the fixed cost of hashing each apart.
+   * @param batches    the source node and destinations of each batch.
+   * @param num        the number of batches.
+   * @param delta_loc  memory for the delta supernodes of any large batches.
+   */
+  void batch_updates(const std::pair<node_id_t, std::vector<node_id_t>> *batches, size_t num,
+                     void *delta_loc) override;
+
+  size_t get_in_place_threshold() const override {
+    return Supernode::get_in_place_threshold();
+  }
+
+  /**
+   * Prepare the nodes for the number of updates each will receive, known up
+   * front for a file backed stream (see BinaryGraphStream_MT::update_counts).
+   * Nodes with more updates than exact_degree are given their supernode at once
+   * rather than holding their edges explicitly until promoted, and with
+   * adaptive depth their sketches are grown to the depths their updates are
+   * expected to reach (see Supernode::reserve_updates). With owner_computes the
+   * nodes are dealt to the GraphWorkers to balance their updates (see
+   * GraphWorker::balance_owners). Must be called before any update.
+   * @param update_counts  the number of updates of each of the num_nodes nodes.
+   */
+  void reserve_updates(const std::vector<node_id_t> &update_counts);
 
   /**
    * Main parallel algorithm utilizing Boruvka and L_0 sampling.
@@ -140,6 +359,18 @@ public:
 
   // temp to verify number of updates -- REMOVE later
   std::atomic<uint64_t> num_updates;
+  // number of updates that cancelled within a batch and were never applied, see cancel_updates
+  uint64_t get_num_cancelled() const { return num_cancelled; }
+  // number of Boruvka rounds of the last connected components computation
+  size_t get_num_rounds() const { return num_rounds; }
+
+  /* the bytes held by the supernodes of the graph, less than Supernode::get_size() each
+   * with adaptive depth. Walks every node, so not for use while updates are applied.
+   */
+  size_t get_supernode_bytes() const;
+
+  // the edge hash cache in use, nullptr if disabled
+  const EdgeHashCache *get_edge_cache() const { return edge_cache; }
 
   /**
    * Generate a delta node for the purposes of updating a node sketch
@@ -151,13 +382,21 @@ public:
    * @param delta_loc  the preallocated memory where the delta_node should be
    *                   placed. this allows memory to be reused by the same
    *                   calling thread.
-   * @returns nothing (supernode delta is in delta_loc).
+   * @returns the number of updates that cancelled within the batch
+   *          (supernode delta is in delta_loc).
    */
-  static void generate_delta_node(node_id_t node_n, uint64_t node_seed, node_id_t src,
+  static size_t generate_delta_node(node_id_t node_n, uint64_t node_seed, node_id_t src,
                                   const std::vector<node_id_t> &edges, Supernode *delta_loc);
 
   /**
    * Serialize the graph data to a binary file.
+   * The file starts with checkpoint_magic, checkpoint_version and the sketch settings
+   * the file can only be read back under (hashing, hash family, geometry and adaptive
+   * depth). Files written before this header (version 0) hold every supernode and
+   * no explicit edges, under the default settings.
+   * Only the supernodes of nodes that have been updated are written, following
+   * a bitmap of which nodes they are, and then the edges of the nodes holding
+   * them explicitly (see exact_degree).
    * @param filename the name of the file to (over)write data to.
    */
   void write_binary(const std::string &filename);
@@ -168,3 +407,7 @@ public:
   std::chrono::steady_clock::time_point cc_alg_start;
   std::chrono::steady_clock::time_point cc_alg_end;
 };
+
+extern template class GraphT<Sketch>;
+extern template class GraphT<OneSparseSampler>;
+typedef GraphT<Sketch> Graph;
@@ -2,10 +2,13 @@
 #include <mutex>
 #include <condition_variable>
 #include <thread>
+#include <atomic>
+#include <deque>
+#include <vector>
+#include <graph_zeppelin_common.h>
 
 // forward declarations
-class Graph;
-class Supernode;
+class GraphBase;
 class GutteringSystem;
 
 class GraphWorker {
@@ -18,7 +21,7 @@ public:
    * @param _supernode_size  the size of a supernode so that we can allocate
    *                         space for a delta_node.
    */
-  static void start_workers(Graph *_graph, GutteringSystem *_gts, long _supernode_size);
+  static void start_workers(GraphBase *_graph, GutteringSystem *_gts, long _supernode_size);
   static void stop_workers();    // shutdown and delete GraphWorkers
   static void pause_workers();   // pause the GraphWorkers before CC
   static void unpause_workers(); // unpause the GraphWorkers to resume updates
@@ -32,8 +35,45 @@ public:
   // manage configuration
   // configuration should be set before calling start_workers
   static int get_num_groups() {return num_groups;} // return the number of GraphWorkers
-  static int get_group_size() {return group_size;} // return the number of threads in each worker
-  static void set_config(int g, int s) { num_groups = g; group_size = s; }
+  static void set_config(int g) { num_groups = g; }
+
+  /* set whether each node is owned by one GraphWorker, which applies every batch of
+   * the node, rather than by whichever GraphWorker pulls the batch from the guttering
+   * system. A GraphWorker forwards the batches of nodes it does not own to their owner,
+   * so the supernode of a node is only ever updated by one thread (and stays in the
+   * cache of its core). Nodes are dealt to the GraphWorkers in shards of the nodes
+   * equal modulo num_groups * shards_per_worker, see balance_owners.
+   */
+  static void set_owner_computes(bool owned) { owner_computes = owned; }
+  static bool get_owner_computes() { return owner_computes; }
+
+  /**
+   * Deal the shards of nodes to the GraphWorkers so that each is to apply about as
+   * many updates, given the number of updates of each node (see
+   * Graph::reserve_updates). Otherwise the shards are dealt round robin. Must be
+   * called while no batches are being applied. Does nothing unless owner_computes.
+   * @param update_counts  the number of updates of each node.
+   */
+  static void balance_owners(const std::vector<node_id_t> &update_counts);
+
+  /* set the most batches a GraphWorker packs together before applying them (see
+   * GraphT::batch_updates). Batches too small to be worth a delta supernode are copied
+   * into the pack and handed back to the guttering system at once; the pack is applied
+   * when full or when the guttering system has no more batches. 1 disables packing.
+   */
+  static void set_pack_size(int size) { pack_size = size; }
+  static int get_pack_size() { return pack_size; }
+
+  // the number of updates forwarded to the GraphWorker owning their node
+  static uint64_t get_num_forwarded() { return num_forwarded; }
+
+  /* set the most batches forwarded to a GraphWorker that may wait for it at once. A
+   * GraphWorker forwarding to a full mailbox applies its own mail until there is room.
+   */
+  static void set_mail_capacity(size_t capacity) { mail_capacity = capacity; }
+  static size_t get_mail_capacity() { return mail_capacity; }
+  // the most batches any mailbox has held since the GraphWorkers started
+  static size_t get_max_mail() { return max_mail; }
 private:
   /**
    * Create a GraphWorker object by setting metadata and spinning up a thread.
@@ -41,7 +81,7 @@ private:
    * @param _graph  the graph which this GraphWorker will be updating.
    * @param _gts    the database data will be extracted from.
    */
-  GraphWorker(int _id, Graph *_graph, GutteringSystem *_gts);
+  GraphWorker(int _id, GraphBase *_graph, GutteringSystem *_gts);
   ~GraphWorker();
 
   /**
@@ -55,26 +95,54 @@ private:
   }
 
   void do_work(); // function which runs the GraphWorker process
+
+  // the GraphWorker owning a node when owner_computes
+  static inline int owner(node_id_t node) { return shard_owner[node % shard_owner.size()]; }
+  // hand a batch to the GraphWorker owning its node
+  void forward(node_id_t node, const std::vector<node_id_t> &edges);
+  // apply the batches forwarded to this GraphWorker, returns whether there were any
+  bool apply_mail();
+  bool has_mail();
+  // add a batch to the pack, applying the pack if it is then full
+  void pack_batch(node_id_t node, const std::vector<node_id_t> &edges);
+  void apply_pack();
   int id;
-  Graph *graph;
+  GraphBase *graph;
   GutteringSystem *gts;
   std::thread thr;
   bool thr_paused; // indicates if this individual thread is paused
 
   // thread status and status management
-  static bool shutdown;
-  static bool paused;
+  static std::atomic<bool> shutdown;
+  static std::atomic<bool> paused; // read without pause_lock by do_work and forward
   static std::condition_variable pause_condition;
   static std::mutex pause_lock;
 
   // configuration
   static int num_groups;
-  static int group_size;
   static long supernode_size;
+  static bool owner_computes;
+  static int pack_size;
+  static constexpr int shards_per_worker = 64;
+  static std::vector<int> shard_owner; // the GraphWorker owning each shard of nodes
+  static std::atomic<uint64_t> num_forwarded;
+  static size_t mail_capacity;
+  static std::atomic<size_t> max_mail;
 
   // list of all GraphWorkers
   static GraphWorker **workers;
 
-  // the supernode object this GraphWorker will use for generating deltas
-  Supernode *delta_node;
+  // the memory this GraphWorker will use for generating delta supernodes
+  void *delta_node;
+
+  // the small batches waiting to be applied together, see set_pack_size. Only the
+  // first pack_len are in use, the vectors of the others are kept for reuse
+  std::vector<std::pair<node_id_t, std::vector<node_id_t>>> pack;
+  size_t pack_len = 0;
+
+  // the batches forwarded to this GraphWorker by the others, see owner_computes. Mail
+  // arriving while the GraphWorker waits upon the guttering system is applied once it
+  // is handed a batch, or the GraphWorkers pause
+  std::mutex mail_lock;
+  std::deque<std::pair<node_id_t, std::vector<node_id_t>>> mail;
 };
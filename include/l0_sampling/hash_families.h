@@ -0,0 +1,141 @@
+#pragma once
+#include <cstddef>
+#include <memory>
+#include <vector>
+#include <xxhash.h>
+#include "../types.h"
+
+/**
+ * The families of hash functions a Sketch may use to hash its columns and checksums
+ * (with COLUMN_HASHING). Stronger families cost more per hash:
+ * XXH64_HASH           XXH64 per column, XXH32 checksum (the original scheme)
+ * XXH3_HASH            XXH3-64 for both
+ * MULTIPLY_SHIFT_HASH  multiply-add-shift, 2-independent
+ * TABULATION_HASH      simple tabulation, 3-independent
+ * l0 sampling only needs the depths of an index in different columns to be
+ * (roughly) independent and the checksum to rarely collide so the cheaper
+ * families are sufficient in practice.
+ */
+enum HashFamily {
+  XXH64_HASH,
+  XXH3_HASH,
+  MULTIPLY_SHIFT_HASH,
+  TABULATION_HASH
+};
+
+// the name of a HashFamily as written in streaming.conf
+const char *hash_family_name(HashFamily family);
+
+/*
+ * Hash policies. Each provides
+ *   Keys                          the hash functions of one sketch: one per column and
+ *                                 one for the checksum
+ *   keys(seed, num_cols)          the Keys of the sketch with seed
+ *   col_hash(keys, idx, col)      the hash of an index for one column
+ *   checksum(keys, idx)           the checksum of an index for the sketch
+ * and batched versions of both that hash many indices with one column.
+ * Sketches fetch the Keys of their seed once per operation and pass them to every hash.
+ * Column col of a sketch is keyed by seed + col. Policies other than XXH64Hash derive
+ * the checksum from ~seed so that it is independent of the hash of the first column.
+ */
+struct XXH64Hash {
+  struct Keys {
+    uint64_t seed;
+  };
+  static inline Keys keys(uint64_t seed, size_t) { return {seed}; }
+  static inline col_hash_t col_hash(const Keys &k, vec_t idx, unsigned col) {
+    return ::col_hash(&idx, sizeof(idx), k.seed + col);
+  }
+  static inline vec_hash_t checksum(const Keys &k, vec_t idx) {
+    return vec_hash(&idx, sizeof(idx), k.seed);
+  }
+  // vectorized, see SketchKernels
+  static void col_hash_batch(const Keys &k, const vec_t *idx, size_t num, unsigned col,
+                             col_hash_t *out);
+  static void checksum_batch(const Keys &k, const vec_t *idx, size_t num, vec_hash_t *out);
+};
+
+struct XXH3Hash {
+  struct Keys {
+    uint64_t seed;
+  };
+  static inline Keys keys(uint64_t seed, size_t) { return {seed}; }
+  static inline col_hash_t col_hash(const Keys &k, vec_t idx, unsigned col) {
+    return XXH3_64bits_withSeed(&idx, sizeof(idx), k.seed + col);
+  }
+  static inline vec_hash_t checksum(const Keys &k, vec_t idx) {
+    return XXH3_64bits_withSeed(&idx, sizeof(idx), ~k.seed);
+  }
+  static void col_hash_batch(const Keys &k, const vec_t *idx, size_t num, unsigned col,
+                             col_hash_t *out);
+  static void checksum_batch(const Keys &k, const vec_t *idx, size_t num, vec_hash_t *out);
+};
+
+/**
+ * Dietzfelbinger's multiply-add-shift: h(x) = ((a * x + b) mod 2^128) >> 64
+ * with a, b 128 bit values generated from the seed. Strongly universal so every
+ * bit of the output (including the low bits used to compute depths) is uniform.
+ */
+struct MultiplyShiftHash {
+  struct Params {
+    uint64_t a_lo, a_hi, b_lo, b_hi;
+    explicit Params(uint64_t seed);
+    inline uint64_t operator()(vec_t x) const {
+      __uint128_t ax = (__uint128_t) a_lo * x + ((__uint128_t) (a_hi * x) << 64);
+      return (ax + (((__uint128_t) b_hi << 64) | b_lo)) >> 64;
+    }
+  };
+  struct Keys {
+    std::vector<Params> cols;
+    Params check;
+    Keys(uint64_t seed, size_t num_cols);
+  };
+  // built upon the first call for a seed and kept until released
+  static const Keys &keys(uint64_t seed, size_t num_cols);
+  // free the keys of seed, which no sketch may be using
+  static void release_keys(uint64_t seed);
+  static size_t num_keys(); // the number of seeds with keys built
+  static inline col_hash_t col_hash(const Keys &k, vec_t idx, unsigned col) {
+    return k.cols[col](idx);
+  }
+  static inline vec_hash_t checksum(const Keys &k, vec_t idx) {
+    return k.check(idx) >> 32;
+  }
+  static void col_hash_batch(const Keys &k, const vec_t *idx, size_t num, unsigned col,
+                             col_hash_t *out);
+  static void checksum_batch(const Keys &k, const vec_t *idx, size_t num, vec_hash_t *out);
+};
+
+/**
+ * Simple tabulation: h(x) = T_0[x_0] ^ ... ^ T_7[x_7] where x_i is the ith byte
+ * of x and the tables of random values (16KiB) are generated from the seed.
+ */
+struct TabulationHash {
+  typedef uint64_t Tables[sizeof(vec_t)][256];
+  static void fill_tables(Tables &t, uint64_t seed);
+  static inline uint64_t hash(const Tables &t, vec_t x) {
+    uint64_t h = 0;
+    for (size_t i = 0; i < sizeof(vec_t); ++i, x >>= 8)
+      h ^= t[i][x & 0xFF];
+    return h;
+  }
+  struct Keys {
+    std::unique_ptr<Tables[]> cols;
+    Tables check;
+    Keys(uint64_t seed, size_t num_cols);
+  };
+  // built upon the first call for a seed and kept until released
+  static const Keys &keys(uint64_t seed, size_t num_cols);
+  // free the keys of seed, which no sketch may be using
+  static void release_keys(uint64_t seed);
+  static size_t num_keys(); // the number of seeds with keys built
+  static inline col_hash_t col_hash(const Keys &k, vec_t idx, unsigned col) {
+    return hash(k.cols[col], idx);
+  }
+  static inline vec_hash_t checksum(const Keys &k, vec_t idx) {
+    return hash(k.check, idx) >> 32;
+  }
+  static void col_hash_batch(const Keys &k, const vec_t *idx, size_t num, unsigned col,
+                             col_hash_t *out);
+  static void checksum_batch(const Keys &k, const vec_t *idx, size_t num, vec_hash_t *out);
+};
@@ -0,0 +1,62 @@
+#pragma once
+#include <fstream>
+#include <utility>
+#include <vector>
+#include "../bucket.h"
+#include "../types.h"
+#include "sketch.h"
+
+/**
+ * The smallest l0 sampler of the SupernodeT sampler concept: the deterministic bucket
+ * of a Sketch alone, the XOR of the indices and of their checksums. It recovers a
+ * vector with exactly one nonzero index (1-sparse recovery) and fails on any other
+ * nonzero vector, so Boruvka only succeeds upon graphs whose cuts are at most one edge
+ * wide in every round, such as matchings. It only uses the generic SamplerTraits and
+ * checks that SupernodeT and GraphT need nothing more of a sampler than the concept.
+ */
+class OneSparseSampler {
+  static vec_t failure_factor;
+
+  const uint64_t seed;
+  bool already_queried = false;
+  vec_t a = 0;
+  vec_hash_t c = 0;
+
+  explicit OneSparseSampler(uint64_t seed) : seed(seed) {}
+  OneSparseSampler(uint64_t seed, std::istream &binary_in);
+  OneSparseSampler(const OneSparseSampler &s) : seed(s.seed), a(s.a), c(s.c) {}
+
+public:
+  // the failure factor only determines the seeds of the samplers of a supernode
+  inline static void configure(vec_t, vec_t _factor) {
+    failure_factor = _factor;
+  }
+  inline static vec_t get_failure_factor() {
+    return failure_factor;
+  }
+  inline static size_t sketchSizeof() {
+    return sizeof(OneSparseSampler);
+  }
+
+  static OneSparseSampler* makeSketch(void* loc, uint64_t seed);
+  static OneSparseSampler* makeSketch(void* loc, uint64_t seed, std::istream &binary_in);
+  static OneSparseSampler* makeSketch(void* loc, const OneSparseSampler& s);
+
+  void update(vec_t update_idx);
+  void batch_update(const std::vector<vec_t>& updates);
+
+  /**
+   * @return  the nonzero index if there is exactly one, ZERO if there are none and
+   *          FAIL (almost always) otherwise.
+   * @throws MultipleQueryException if the sampler has been queried since it was reset.
+   */
+  std::pair<vec_t, SampleSketchRet> query();
+
+  inline void reset_queried() {
+    already_queried = false;
+  }
+
+  friend OneSparseSampler &operator+= (OneSparseSampler &s1, const OneSparseSampler &s2);
+
+  void write_binary(std::ostream& binary_out);
+};
@@ -1,5 +1,7 @@
 #pragma once
+#include <algorithm>
 #include <cmath>
+#include <cstddef>
 #include <exception>
 #include <fstream>
 #include <functional>
@@ -9,6 +11,7 @@
 #include <utility>
 #include "../bucket.h"
 #include "../types.h"
+#include "hash_families.h"
 #include "../util.h"
 #include <gtest/gtest_prod.h>
 
@@ -22,6 +25,52 @@ enum SampleSketchRet {
   FAIL   // querying this sketch failed to produce a single non-zero value
 };
 
+/**
+ * Arrangement of the buckets within a sketch.
+ * COLUMN_MAJOR stores every a value followed by every c value, each indexed [column][guess].
+ * DEPTH_MAJOR stores the a and c of a bucket together and places the same guess (depth)
+ * of every column next to each other. Because an update reaches depth j with
+ * probability 1/2^j, most updates then only touch the first one or two cache lines.
+ * Both layouts use the same amount of memory and serialize to the same format.
+ */
+enum SketchLayout {
+  COLUMN_MAJOR,
+  DEPTH_MAJOR
+};
+
+/**
+ * How the hashes of an update are computed.
+ * COLUMN_HASHING computes an XXH64 per column and an XXH32 checksum per sketch.
+ * WIDE_HASHING computes a single XXH3-128 per update which is expanded into the
+ * hash of every column and the checksum of every sketch (see Bucket_Boruvka::wide_key).
+ * Supernodes compute the wide hash once and share it between all of their sketches.
+ * The HashFamily only applies to COLUMN_HASHING.
+ * Sketches built with different hashing (or hash families) are not compatible.
+ */
+enum SketchHashing {
+  COLUMN_HASHING,
+  WIDE_HASHING
+};
+
+/**
+ * How the number of columns and guesses (depth) of sketches is fixed.
+ * The update, query and batch kernels are compiled for a few common geometry
+ * classes: 7 columns (failure factor 100) with the depth of a graph of
+ * 2^16, 2^20, 2^24 or 2^28 nodes. The trip counts of their loops are then known
+ * at compile time. Other geometries use loops bounded by the static variables.
+ * DYNAMIC_GEOMETRY  always use the runtime geometry kernels
+ * EXACT_GEOMETRY    use a compiled class when the depth of the graph matches it exactly
+ * CLASS_GEOMETRY    round the depth up to the smallest class that fits (more memory
+ *                   for graphs between classes) so that compiled kernels are always used
+ *                   for graphs of at most 2^28 nodes
+ * Graphs written to disk with CLASS_GEOMETRY must be read back with it.
+ */
+enum SketchGeometry {
+  DYNAMIC_GEOMETRY,
+  EXACT_GEOMETRY,
+  CLASS_GEOMETRY
+};
+
 /**
  * An implementation of a "sketch" as defined in the L0 algorithm.
  * Note a sketch may only be queried once. Attempting to query multiple times will
@@ -34,31 +83,120 @@ private:
   static size_t num_elems;         // length of our actual arrays in number of elements
   static size_t num_buckets;       // Portion of array length, number of buckets
   static size_t num_guesses;       // Portion of array length, number of guesses
+  static SketchLayout layout;      // Arrangement of the buckets in memory
+  static SketchHashing hashing;    // How updates are hashed
+  static HashFamily hash_family;   // The hash functions used by COLUMN_HASHING
+  static size_t suffix_xor_threshold; // Batches at least this large are applied with suffix_xor_column
+  static SketchGeometry geometry;  // Whether the compiled geometry classes are used
+  static bool adaptive_depth;      // Whether supernodes start their sketches without depths
+
+  // the columns and depths of the compiled geometry classes, see SketchGeometry
+  static constexpr size_t class_buckets = 7;
+  static constexpr size_t class_guesses[] = {30, 38, 46, 54};
 
   // Seed used for hashing operations in this sketch.
   const uint64_t seed;
-  // pointers to buckets
-  vec_t*      bucket_a;
-  vec_hash_t* bucket_c;
 
   // Flag to keep track if this sketch has already been queried.
   bool already_queried = false;
 
+  // Number of guesses (depths) of each column held by this sketch, see set_adaptive_depth.
+  // Updates must not reach deeper than the depths held.
+  uint8_t rows;
+
   FRIEND_TEST(SketchTestSuite, TestExceptions);
   FRIEND_TEST(EXPR_Parallelism, N10kU100k);
 
   
   // Buckets of this sketch.
-  // Length is bucket_gen(failure_factor) * guess_gen(n).
+  // Length is bucket_gen(failure_factor) * guess_gen(n) (+ 1 for the deterministic bucket),
+  // or bucket_gen(failure_factor) * rows + 1 with the DEPTH_MAJOR layout.
   // For buckets[i * guess_gen(n) + j], the bucket has a 1/2^j probability
-  // of containing an index. The first two are pointers into the buckets array.
-  char buckets[1];
+  // of containing an index. With the COLUMN_MAJOR layout the a values of every
+  // bucket are followed by the c values, see bucket_a and bucket_c.
+  // With the DEPTH_MAJOR layout the a and c of each bucket are together, see Sketch::DepthMajor.
+  alignas(vec_t) char buckets[1];
+
+  // the a and c values of the buckets with the COLUMN_MAJOR layout
+  inline vec_t* bucket_a() { return reinterpret_cast<vec_t*>(buckets); }
+  inline vec_hash_t* bucket_c() {
+    return reinterpret_cast<vec_hash_t*>(buckets + num_elems * sizeof(vec_t));
+  }
+
+  // bytes of the buckets of a sketch that holds rows depths
+  static inline size_t bucket_bytes(size_t rows) {
+    return (rows * num_buckets + 1) * (sizeof(vec_t) + sizeof(vec_hash_t));
+  }
 
   // private constructors -- use makeSketch
-  Sketch(uint64_t seed);
+  Sketch(uint64_t seed, size_t rows, bool zero_buckets = true);
   Sketch(uint64_t seed, std::istream &binary_in);
   Sketch(const Sketch& s);
 
+  // number of columns and guesses, either the static variables or compile time constants
+  struct DynamicGeometry;
+  template <size_t Buckets, size_t Guesses> struct FixedGeometry;
+
+  // bucket addressing for each SketchLayout
+  template <class Geometry> struct ColumnMajor;
+  template <class Geometry> struct DepthMajor;
+
+  // call f with an instance of the hash policy for hash_family, see hash_families.h
+  template <class F> static void with_hash_family(F&& f);
+  template <class Hash> using HashKeys = typename Hash::Keys;
+  // build the keys of the hash functions of the sketch with seed ahead of its updates
+  static void build_hash_keys(uint64_t seed);
+
+  // call f with an instance of the Layout for layout and the geometry in use
+  template <class F> static void with_layout(F&& f);
+  template <class Geometry, class F> static void with_layout_geometry(F&& f);
+
+  template <class Layout, class Hash> void update_impl(const vec_t& update_idx);
+  template <class Layout, class Hash> void batch_update_impl(const std::vector<vec_t>& updates);
+  template <class Hash> static void hash_updates_impl(uint64_t seed, const vec_t* updates,
+                                                      size_t num, char* out, size_t stride);
+  template <class Layout> void apply_hashed_impl(const vec_t* updates, size_t num,
+                                                 const char* hashes, size_t stride);
+  template <class Layout> void apply_wide_impl(const vec_t* updates, const wide_hash_t* wide,
+                                               size_t num);
+  template <class Layout, class Hash> std::pair<vec_t, SampleSketchRet> query_impl();
+  // when samples is not nullptr every column is scanned for the samples of each sketch
+  template <class Layout, class Hash> static void query_batch_impl(Sketch* const* sketches,
+                     size_t num, std::pair<vec_t, SampleSketchRet>* out,
+                     std::vector<vec_t>* samples);
+  // marks the sketches as queried and dispatches query_batch_impl
+  static void query_sketches(Sketch* const* sketches, size_t num,
+                             std::pair<vec_t, SampleSketchRet>* out, std::vector<vec_t>* samples);
+
+  // the checksums of many indices for the hashing in use, see Bucket_Boruvka::index_hash
+  template <class Hash> static void checksum_batch(const HashKeys<Hash> &keys, const vec_t* idx,
+                                                   size_t num, uint64_t seed, vec_hash_t* out);
+
+  /*
+   * Write once per bucket application of a batch, used for batches of at least
+   * suffix_xor_threshold updates. An update of depth d is XORed into buckets
+   * 0..d-1 of a column, so the updates are first XORed into one accumulator per
+   * depth and bucket j then receives the XOR of the accumulators deeper than j
+   * (a suffix XOR). This replaces the unpredictable per update loop over depths
+   * with one pass over the batch and one write per bucket.
+   */
+  template <class Layout> void xor_det(const vec_t* updates, const vec_hash_t* hashes, size_t num);
+  template <class Layout> void suffix_xor_column(unsigned col, const vec_t* updates,
+                                                 const vec_hash_t* hashes, const uint8_t* depths,
+                                                 size_t depth_stride, size_t num);
+
+  // is_good for the hashing in use, see Bucket_Boruvka::is_good
+  template <class Hash> bool is_good(const HashKeys<Hash> &keys, vec_t a, vec_hash_t c) const;
+  template <class Hash> bool is_good(const HashKeys<Hash> &keys, vec_t a, vec_hash_t c,
+                                     unsigned bucket_col, col_hash_t guess_nonzero) const;
+
+  // map a column major bucket position to its position in the DEPTH_MAJOR layout
+  static size_t col_major_to_depth_major(size_t col_major_pos);
+
+  // layout independent bucket access, given the column major position of a bucket
+  vec_t get_bucket_a(size_t col_major_pos) const;
+  vec_hash_t get_bucket_c(size_t col_major_pos) const;
+
 public:
   /**
    * Construct a sketch of a vector of size n
@@ -70,6 +208,19 @@ public:
    */
   static Sketch* makeSketch(void* loc, uint64_t seed);
   static Sketch* makeSketch(void* loc, uint64_t seed, std::istream &binary_in);
+
+  /**
+   * Construct a sketch that holds only the first rows depths of each column,
+   * see set_adaptive_depth. The caller provides sketchSizeof(rows) bytes.
+   */
+  static Sketch* makeSketch(void* loc, uint64_t seed, size_t rows);
+
+  /**
+   * Construct a sketch in memory that is already zero filled (such as fresh
+   * anonymous memory), without writing its buckets.
+   */
+  static Sketch* makeZeroedSketch(void* loc, uint64_t seed);
+  static Sketch* makeZeroedSketch(void* loc, uint64_t seed, size_t rows);
   
   /**
    * Copy constructor to create a sketch from another
@@ -89,11 +240,146 @@ public:
     failure_factor = _factor;
     num_buckets = bucket_gen(failure_factor);
     num_guesses = guess_gen(n);
+    if (geometry == CLASS_GEOMETRY && num_buckets == class_buckets) {
+      for (size_t guesses : class_guesses) {
+        if (num_guesses <= guesses) {
+          num_guesses = guesses;
+          break;
+        }
+      }
+    }
     num_elems = num_buckets * num_guesses + 1;
   }
 
+  /* set whether sketches use the compiled geometry classes
+   * Must be called before configure.
+   * @param _geometry  the SketchGeometry to use. (static variable)
+   */
+  inline static void set_geometry(SketchGeometry _geometry) {
+    geometry = _geometry;
+  }
+
+  inline static SketchGeometry get_geometry()
+  { return geometry; }
+
+  // true if the current configuration uses the kernels of a compiled geometry class
+  static bool uses_fixed_geometry();
+
+  /* set the arrangement of the buckets of all sketches
+   * Must be called before any sketches are created.
+   * @param _layout  the SketchLayout to use. (static variable)
+   */
+  inline static void set_layout(SketchLayout _layout) {
+    layout = _layout;
+  }
+
+  inline static SketchLayout get_layout()
+  { return layout; }
+
+  /* set how all sketches hash their updates
+   * Must be called before any sketches are created.
+   * @param _hashing  the SketchHashing to use. (static variable)
+   */
+  inline static void set_hashing(SketchHashing _hashing) {
+    hashing = _hashing;
+  }
+
+  inline static SketchHashing get_hashing()
+  { return hashing; }
+
+  /* set the family of hash functions used by all sketches
+   * Must be called before any sketches are created.
+   * @param _family  the HashFamily to use. (static variable)
+   */
+  inline static void set_hash_family(HashFamily _family) {
+    hash_family = _family;
+  }
+
+  inline static HashFamily get_hash_family()
+  { return hash_family; }
+
+  /* set the smallest batch applied one bucket write at a time (see suffix_xor_column)
+   * The default was chosen with BM_Sketch_Suffix_XOR. Intended for testing and benchmarking.
+   */
+  inline static void set_suffix_xor_threshold(size_t threshold) {
+    suffix_xor_threshold = threshold;
+  }
+
+  inline static size_t get_suffix_xor_threshold()
+  { return suffix_xor_threshold; }
+
+  /* set whether the sketches of supernodes hold only the depths their updates reach
+   * A supernode then starts its sketches with no depths (only the deterministic
+   * bucket) and grows them when an update or merge reaches deeper, see SupernodeT.
+   * A sketch of a vertex of degree d needs about log(d) of the 2 log(n) depths.
+   * The depths not held are empty in a full sketch of the same updates, so queries,
+   * comparisons and serialization are unchanged. Requires the DEPTH_MAJOR layout,
+   * in which the first depths of a sketch are a prefix of its buckets.
+   * Must be called before any sketches are created.
+   */
+  inline static void set_adaptive_depth(bool adaptive) {
+    adaptive_depth = adaptive;
+  }
+
+  inline static bool get_adaptive_depth()
+  { return adaptive_depth; }
+
+  /* free the keys of the hash functions of the sketches with seed, built when they were
+   * created (rebuilt if used again). No sketch may be in use while they are freed.
+   */
+  static void release_hash_keys(uint64_t seed);
+  // the number of sketch seeds with hash keys built, over every hash family
+  static size_t num_hash_keys();
+
+  // the depths of a sketch that holds every depth
+  inline static size_t max_rows()
+  { return num_guesses; }
+
+  // the depths supernodes construct their sketches with
+  inline static size_t initial_rows()
+  { return adaptive_depth && layout == DEPTH_MAJOR ? 0 : num_guesses; }
+
+  // the depths num_updates distinct updates reach in a sketch with probability over 1/2,
+  // each column of an update reaches depth r with probability 2^-r
+  inline static size_t expected_rows(uint64_t num_updates) {
+    uint64_t samples = num_updates * num_buckets;
+    return samples == 0 ? 0 : std::min<size_t>(num_guesses, 63 - __builtin_clzll(samples));
+  }
+
+  inline static size_t sketchSizeof(size_t rows) {
+    // the size is a multiple of the alignment so that the sketches of a supernode are aligned
+    size_t bytes = offsetof(Sketch, buckets) + bucket_bytes(rows);
+    return (bytes + alignof(Sketch) - 1) / alignof(Sketch) * alignof(Sketch);
+  }
+
   inline static size_t sketchSizeof()
-  { return sizeof(Sketch) + num_elems * (sizeof(vec_t) + sizeof(vec_hash_t)) - sizeof(char); }
+  { return sketchSizeof(num_guesses); }
+
+  inline size_t get_rows() const
+  { return rows; }
+
+  // the depths up to and including the deepest that has a nonzero bucket
+  size_t used_rows() const;
+
+  /**
+   * The depths a batch of updates reaches, from the output of hash_updates.
+   * @param hashes  the hashes of the updates, see hash_updates.
+   * @param num     the number of updates.
+   * @param stride  see hash_updates.
+   */
+  static size_t hashed_rows(const char* hashes, size_t num, size_t stride);
+
+  /**
+   * Change the depths held by num sketches that are placed sketchSizeof() of
+   * the depths they hold apart (as within a Supernode), after which they are
+   * sketchSizeof(rows) apart. The sketches are moved in place, from the last
+   * when they grow, and the depths added are zero. The caller ensures there is
+   * room for num * sketchSizeof(rows) bytes and that no depth removed is nonzero.
+   * @param sketches  the first sketch, which does not move.
+   * @param num       the number of sketches.
+   * @param rows      the depths the sketches are to hold.
+   */
+  static void resize_sketches(Sketch* sketches, size_t num, size_t rows);
   
   inline static vec_t get_failure_factor() 
   { return failure_factor; }
@@ -109,16 +395,85 @@ public:
 
   /**
    * Update a sketch given a batch of updates.
+   * Hashing is performed in batches (by the vectorized SketchKernels for
+   * XXH64_HASH); the result is identical to calling update() on each element.
    * @param updates A vector of updates
    */
   void batch_update(const std::vector<vec_t>& updates);
 
+  /**
+   * Update a sketch given a batch of updates and their wide hashes
+   * (see Bucket_Boruvka::wide_index_hash). Only valid with WIDE_HASHING.
+   * @param updates  the updates.
+   * @param wide     the wide hash of each update.
+   * @param num      the number of updates.
+   */
+  void batch_update(const vec_t* updates, const wide_hash_t* wide, size_t num);
+
+  /**
+   * The number of bytes hash_updates produces per update: the checksum of the
+   * update followed by one depth per column (see Bucket_Boruvka::get_depth).
+   */
+  inline static size_t hashed_update_size() {
+    return sizeof(vec_hash_t) + (num_buckets + sizeof(vec_hash_t) - 1) / sizeof(vec_hash_t) * sizeof(vec_hash_t);
+  }
+
+  /**
+   * Compute the hashes that a batch of updates applies to a sketch. The result
+   * only depends upon the seed, so it may be computed once and applied to any
+   * number of sketches that share the seed with apply_hashed.
+   * @param seed     the seed of the sketch(es) the hashes are for.
+   * @param updates  the updates to hash.
+   * @param num      the number of updates.
+   * @param out      where to place the hashes. The hashes of update k are placed at
+   *                 out + k * stride and occupy hashed_update_size() bytes.
+   * @param stride   distance in bytes between the hashes of consecutive updates.
+   */
+  static void hash_updates(uint64_t seed, const vec_t* updates, size_t num, char* out, size_t stride);
+
+  /**
+   * hash_updates given the wide hashes of the updates. Only valid with WIDE_HASHING.
+   */
+  static void hash_updates(uint64_t seed, const wide_hash_t* wide, size_t num, char* out, size_t stride);
+
+  /**
+   * Update a sketch given a batch of updates and their precomputed hashes.
+   * Equivalent to batch_update but performs no hashing.
+   * @param updates  the updates.
+   * @param num      the number of updates.
+   * @param hashes   the output of hash_updates for these updates and this sketch's seed.
+   * @param stride   see hash_updates.
+   */
+  void apply_hashed(const vec_t* updates, size_t num, const char* hashes, size_t stride);
+
   /**
    * Function to query a sketch.
    * @return   A pair with the result index and a code indicating if the type of result.
    */
   std::pair<vec_t, SampleSketchRet> query();
 
+  /**
+   * Query many sketches at once, equivalent to out[k] = sketches[k]->query().
+   * The checksums of the non-empty buckets of all sketches that share a seed
+   * (such as the ith sketch of every supernode of a graph) are computed together
+   * with the batched hash kernels rather than one bucket at a time.
+   * @param sketches  the sketches to query, none of which may have been queried.
+   * @param num       the number of sketches.
+   * @param out       where to place the result of each query.
+   */
+  static void query_batch(Sketch* const* sketches, size_t num,
+                          std::pair<vec_t, SampleSketchRet>* out);
+
+  /**
+   * query_batch that also returns every distinct GOOD sample of each sketch
+   * rather than only the first. Every column of the sketches is scanned.
+   * @param samples  samples[k] is replaced with the samples of sketches[k],
+   *                 the first of which is out[k].first. Empty unless out[k] is GOOD.
+   */
+  static void query_all_batch(Sketch* const* sketches, size_t num,
+                              std::pair<vec_t, SampleSketchRet>* out,
+                              std::vector<vec_t>* samples);
+
   inline uint64_t get_seed() const {
     return seed;
   }
@@ -132,6 +487,27 @@ public:
    * @return a reference to the combined sketch.
    */
   friend Sketch &operator+= (Sketch &sketch1, const Sketch &sketch2);
+
+  /**
+   * Add num sketches to num others in-place, equivalent to dst[i] += src[i] for
+   * i < num where the sketches of each array are stride bytes apart (as within
+   * a Supernode). The buckets of every pair are XORed with one call to
+   * SketchKernels::xor_blocks. Only the depths both sketches hold are added, so dst
+   * must hold every nonzero depth of src. The sketches of each array hold the
+   * same number of depths.
+   * @param dst     the first sketch being added to.
+   * @param src     the first sketch being added.
+   * @param num     the number of sketches.
+   * @param stride  the distance in bytes between consecutive sketches.
+   */
+  static void add_sketches(Sketch *dst, const Sketch *src, size_t num, size_t stride);
+
+  /**
+   * add_sketches with atomic XORs (see SketchKernels::atomic_xor_blocks), so that
+   * many threads may add to the same sketches at once. Nothing else may
+   * access dst meanwhile.
+   */
+  static void atomic_add_sketches(Sketch *dst, const Sketch *src, size_t num, size_t stride);
   friend bool operator== (const Sketch &sketch1, const Sketch &sketch2);
   friend std::ostream& operator<< (std::ostream &os, const Sketch &sketch);
 
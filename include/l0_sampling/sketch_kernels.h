@@ -0,0 +1,71 @@
+#pragma once
+#include <cstddef>
+#include "../types.h"
+
+/**
+ * Batched hashing kernels used by Sketch::batch_update and the XOR kernel used
+ * to add sketches together.
+ * Each kernel produces exactly the same values as the scalar functions in
+ * Bucket_Boruvka so the contents of a sketch do not depend upon which kernel
+ * is used. The fastest kernel supported by the CPU is selected once at startup.
+ */
+namespace SketchKernels {
+  enum KernelISA {
+    SCALAR = 0, // portable fallback, one update at a time
+    AVX2   = 1, // 4 column hashes / 8 checksums at once
+    AVX512 = 2  // 8 column hashes / 16 checksums at once (requires AVX512F and AVX512DQ)
+  };
+
+  // number of updates Sketch::batch_update hashes per call to a kernel
+  constexpr size_t batch_size = 64;
+
+  /**
+   * @return the best instruction set supported by this CPU.
+   */
+  KernelISA detect_isa();
+
+  /**
+   * @return the instruction set of the kernels currently in use.
+   */
+  KernelISA get_isa();
+
+  /**
+   * Switch the kernels in use. Intended for testing and benchmarking.
+   * @param isa  the instruction set to use.
+   * @return     true if the switch happened, false if the CPU does not support isa.
+   */
+  bool set_isa(KernelISA isa);
+
+  const char *isa_name(KernelISA isa);
+
+  /**
+   * Equivalent to out[k] = Bucket_Boruvka::col_index_hash(idx[k], seed_and_col) for k < num.
+   */
+  void col_index_hash_batch(const vec_t *idx, size_t num, long seed_and_col, col_hash_t *out);
+
+  /**
+   * Equivalent to out[k] = Bucket_Boruvka::index_hash(idx[k], seed) for k < num.
+   */
+  void index_hash_batch(const vec_t *idx, size_t num, long seed, vec_hash_t *out);
+
+  /**
+   * Equivalent to out[k] = Bucket_Boruvka::wide_col_index_hash(wide[k], key) for k < num.
+   */
+  void wide_col_index_hash_batch(const wide_hash_t *wide, size_t num, uint64_t key, col_hash_t *out);
+
+  /**
+   * XOR num_blocks blocks of block_bytes bytes from src into dst. Block i starts
+   * at dst + i * stride and src + i * stride. Used to add the buckets of many
+   * sketches laid out one after another (as within a Supernode) in one call.
+   */
+  void xor_blocks(char *dst, const char *src, size_t block_bytes, size_t num_blocks, size_t stride);
+
+  /**
+   * xor_blocks with atomic XORs of each nonzero 8 byte word of src (and a
+   * final 4 byte word), so that many threads may XOR into the same dst at
+   * once. dst, src and stride are 8 byte aligned and block_bytes is a
+   * multiple of 4.
+   */
+  void atomic_xor_blocks(char *dst, const char *src, size_t block_bytes, size_t num_blocks,
+                         size_t stride);
+} // namespace SketchKernels
@@ -0,0 +1,149 @@
+#pragma once
+#include <utility>
+#include <vector>
+
+#include "l0_sampling/sketch.h"
+
+/**
+ * The operations of SupernodeT upon its samplers beyond the sampler concept (see
+ * SupernodeT). The versions here are built from the concept alone: queries one sampler
+ * at a time, no precomputed hashes (hashed_update_size() is 0 and apply_hashed is
+ * batch_update) and samplers of one fixed size. A sampler with faster versions
+ * specializes SamplerTraits, as Sketch does below.
+ */
+template <class SamplerT>
+struct SamplerTraits {
+  // state computed once per batch of updates and shared by every sampler of a supernode
+  struct Batch {
+    Batch(const vec_t*, size_t) {}
+  };
+  static void batch_update(SamplerT *sampler, const Batch &, const std::vector<vec_t> &updates) {
+    sampler->batch_update(updates);
+  }
+
+  static void query_batch(SamplerT* const* samplers, size_t num,
+                          std::pair<vec_t, SampleSketchRet>* out) {
+    for (size_t k = 0; k < num; ++k) out[k] = samplers[k]->query();
+  }
+  // only the sample of query is known
+  static void query_all_batch(SamplerT* const* samplers, size_t num,
+                              std::pair<vec_t, SampleSketchRet>* out,
+                              std::vector<vec_t>* samples) {
+    query_batch(samplers, num, out);
+    for (size_t k = 0; k < num; ++k) {
+      samples[k].clear();
+      if (out[k].second == GOOD) samples[k].push_back(out[k].first);
+    }
+  }
+
+  // dst[i] += src[i] for i < num, the samplers of each array stride bytes apart
+  static void add_sketches(SamplerT *dst, const SamplerT *src, size_t num, size_t stride) {
+    char *d = reinterpret_cast<char *>(dst);
+    const char *s = reinterpret_cast<const char *>(src);
+    for (size_t i = 0; i < num; ++i, d += stride, s += stride)
+      *reinterpret_cast<SamplerT *>(d) += *reinterpret_cast<const SamplerT *>(s);
+  }
+  // whether atomic_add_sketches may add to the same samplers from many threads at once
+  static constexpr bool atomic_add = false;
+  static void atomic_add_sketches(SamplerT *dst, const SamplerT *src, size_t num, size_t stride) {
+    add_sketches(dst, src, num, stride);
+  }
+
+  // free the state shared by the samplers with seed, see Sketch::release_hash_keys
+  static void release_keys(uint64_t) {}
+
+  static size_t hashed_update_size() { return 0; }
+  static void hash_updates(uint64_t, const Batch &, const vec_t*, size_t, char*, size_t) {}
+  static void apply_hashed(SamplerT *sampler, const vec_t *updates, size_t num, const char*,
+                           size_t) {
+    sampler->batch_update(std::vector<vec_t>(updates, updates + num));
+  }
+
+  // samplers that grow, see Sketch::set_adaptive_depth
+  static size_t initial_rows() { return 0; }
+  static size_t max_rows() { return 0; }
+  static size_t sketch_size(size_t) { return SamplerT::sketchSizeof(); }
+  static SamplerT* make(void *loc, uint64_t seed, size_t) {
+    return SamplerT::makeSketch(loc, seed);
+  }
+  static SamplerT* make_zeroed(void *loc, uint64_t seed, size_t) {
+    return SamplerT::makeSketch(loc, seed);
+  }
+  static size_t get_rows(const SamplerT *) { return 0; }
+  static size_t used_rows(const SamplerT *) { return 0; }
+  static size_t hashed_rows(const char*, size_t, size_t) { return 0; }
+  static size_t expected_rows(uint64_t) { return 0; }
+  static void resize_sketches(SamplerT*, size_t, size_t) {}
+};
+
+/**
+ * Sketch queries sketches that share a seed together, applies precomputed hashes,
+ * grows its depths and, with WIDE_HASHING, shares one wide hash per update between
+ * every sketch of a supernode.
+ */
+template <>
+struct SamplerTraits<Sketch> {
+  struct Batch {
+    std::vector<wide_hash_t> wide; // empty unless WIDE_HASHING
+    Batch(const vec_t *updates, size_t num) {
+      if (Sketch::get_hashing() != WIDE_HASHING) return;
+      wide.resize(num);
+      for (size_t k = 0; k < num; ++k)
+        wide[k] = Bucket_Boruvka::wide_index_hash(updates[k]);
+    }
+  };
+  static void batch_update(Sketch *sketch, const Batch &batch, const std::vector<vec_t> &updates) {
+    if (batch.wide.empty()) sketch->batch_update(updates);
+    else sketch->batch_update(updates.data(), batch.wide.data(), updates.size());
+  }
+
+  static void query_batch(Sketch* const* sketches, size_t num,
+                          std::pair<vec_t, SampleSketchRet>* out) {
+    Sketch::query_batch(sketches, num, out);
+  }
+  static void query_all_batch(Sketch* const* sketches, size_t num,
+                              std::pair<vec_t, SampleSketchRet>* out,
+                              std::vector<vec_t>* samples) {
+    Sketch::query_all_batch(sketches, num, out, samples);
+  }
+
+  static void add_sketches(Sketch *dst, const Sketch *src, size_t num, size_t stride) {
+    Sketch::add_sketches(dst, src, num, stride);
+  }
+  static constexpr bool atomic_add = true;
+  static void atomic_add_sketches(Sketch *dst, const Sketch *src, size_t num, size_t stride) {
+    Sketch::atomic_add_sketches(dst, src, num, stride);
+  }
+
+  static void release_keys(uint64_t seed) { Sketch::release_hash_keys(seed); }
+
+  static size_t hashed_update_size() { return Sketch::hashed_update_size(); }
+  static void hash_updates(uint64_t seed, const Batch &batch, const vec_t *updates, size_t num,
+                           char *out, size_t stride) {
+    if (batch.wide.empty()) Sketch::hash_updates(seed, updates, num, out, stride);
+    else Sketch::hash_updates(seed, batch.wide.data(), num, out, stride);
+  }
+  static void apply_hashed(Sketch *sketch, const vec_t *updates, size_t num, const char *hashes,
+                           size_t stride) {
+    sketch->apply_hashed(updates, num, hashes, stride);
+  }
+
+  static size_t initial_rows() { return Sketch::initial_rows(); }
+  static size_t max_rows() { return Sketch::max_rows(); }
+  static size_t sketch_size(size_t rows) { return Sketch::sketchSizeof(rows); }
+  static Sketch* make(void *loc, uint64_t seed, size_t rows) {
+    return Sketch::makeSketch(loc, seed, rows);
+  }
+  static Sketch* make_zeroed(void *loc, uint64_t seed, size_t rows) {
+    return Sketch::makeZeroedSketch(loc, seed, rows);
+  }
+  static size_t get_rows(const Sketch *sketch) { return sketch->get_rows(); }
+  static size_t used_rows(const Sketch *sketch) { return sketch->used_rows(); }
+  static size_t hashed_rows(const char *hashes, size_t num, size_t stride) {
+    return Sketch::hashed_rows(hashes, num, stride);
+  }
+  static size_t expected_rows(uint64_t num_updates) { return Sketch::expected_rows(num_updates); }
+  static void resize_sketches(Sketch *sketches, size_t num, size_t rows) {
+    Sketch::resize_sketches(sketches, num, rows);
+  }
+};
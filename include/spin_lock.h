@@ -0,0 +1,63 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <thread>
+
+/**
+ * A reader-writer spin lock in one 32 bit word, used in place of a std::mutex
+ * (40 bytes) within each supernode. Satisfies Lockable and SharedLockable so
+ * may be held with std::lock_guard, std::unique_lock and std::shared_lock.
+ *
+ * Holders are expected to be brief, so waiters spin and yield rather than
+ * sleep. A waiting writer stops new readers from entering so that a steady
+ * stream of readers does not starve it. A zero filled lock is unlocked.
+ */
+class SpinLock {
+private:
+  static constexpr uint32_t writer = 1u << 31;   // held exclusively
+  static constexpr uint32_t waiting = 1u << 30;  // a writer waits for the readers to leave
+  static constexpr int spins_per_yield = 64;
+
+  // writer and waiting bits followed by the number of readers
+  std::atomic<uint32_t> word{0};
+
+  static inline void backoff(int &spins) {
+    if (++spins % spins_per_yield == 0) std::this_thread::yield();
+  }
+public:
+  void lock() {
+    int spins = 0;
+    uint32_t w = word.load(std::memory_order_relaxed);
+    while (true) {
+      // clears the waiting bit, which any other waiting writer sets again
+      if ((w & ~waiting) == 0
+          && word.compare_exchange_weak(w, writer, std::memory_order_acquire,
+                                        std::memory_order_relaxed))
+        return;
+      if (!(w & waiting)) word.fetch_or(waiting, std::memory_order_relaxed);
+      backoff(spins);
+      w = word.load(std::memory_order_relaxed);
+    }
+  }
+
+  void unlock() {
+    word.fetch_and(~writer, std::memory_order_release);
+  }
+
+  void lock_shared() {
+    int spins = 0;
+    uint32_t w = word.load(std::memory_order_relaxed);
+    while (true) {
+      if (!(w & (writer | waiting))
+          && word.compare_exchange_weak(w, w + 1, std::memory_order_acquire,
+                                        std::memory_order_relaxed))
+        return;
+      backoff(spins);
+      w = word.load(std::memory_order_relaxed);
+    }
+  }
+
+  void unlock_shared() {
+    word.fetch_sub(1, std::memory_order_release);
+  }
+};
@@ -3,23 +3,55 @@
 #include <sys/mman.h>
 #include <graph_zeppelin_common.h>
 
+#include "l0_sampling/one_sparse_sampler.h"
 #include "l0_sampling/sketch.h"
+#include "sampler_traits.h"
+#include "spin_lock.h"
 
 typedef std::pair<node_id_t, node_id_t> Edge;
 
 /**
  * This interface implements the "supernode" so Boruvka can use it as a black
  * box without needing to worry about implementing l_0.
+ *
+ * A supernode holds O(log n) l_0 samplers of type SamplerT (Sketch unless
+ * otherwise specified), one per Boruvka round. A sampler is placed in a
+ * buffer of sketchSizeof() bytes and must provide
+ *   static configure(n, fail_factor), get_failure_factor(), sketchSizeof()
+ *   static makeSketch(loc, seed), makeSketch(loc, seed, binary_in), makeSketch(loc, other)
+ *   update(idx), batch_update(updates), query(), reset_queried(), write_binary(binary_out)
+ *   sampler += other                               XOR other into sampler
+ * with the semantics of the Sketch functions of the same name. Samplers must
+ * be linear over XOR: the sampler of the XOR of two vectors is the XOR of
+ * their samplers. Faster batched queries, merges and precomputed hashes are
+ * optional, see SamplerTraits. OneSparseSampler is the smallest such sampler.
+ * With adaptive depth (see Sketch::set_adaptive_depth) the samplers start
+ * without depths and are grown, in place within the get_size() bytes of the
+ * supernode, when an update or merge reaches deeper than they hold.
+ * The supernodes (and Graphs) of each sampler are explicitly instantiated at
+ * the end of supernode.cpp (and graph.cpp), add new samplers there.
  */
-class Supernode {
+template <class SamplerT>
+class SupernodeT {
   // the size of a super-node in bytes including the all sketches off the end
   static size_t bytes_size; 
+  // the size in bytes of the hashes of one update for every sketch, see hash_updates
+  static size_t bundle_size;
+  // batches smaller than this are applied in place rather than through a delta supernode
+  static size_t in_place_threshold;
+  typedef SamplerTraits<SamplerT> Traits;
   int idx;
   int num_sketches;
-  std::mutex node_mt;
+  // held exclusively while the sketches are updated or grown in place, and shared
+  // by the deltas added with atomic XORs (see apply_delta_update)
+  SpinLock node_lock;
 
+  FRIEND_TEST(SupernodeTestSuite, TestAdaptiveDepth);
   FRIEND_TEST(SupernodeTestSuite, TestBatchUpdate);
+  FRIEND_TEST(SupernodeTestSuite, TestHashedDelta);
+  FRIEND_TEST(SupernodeTestSuite, TestInPlaceUpdate);
   FRIEND_TEST(SupernodeTestSuite, TestConcurrency);
+  FRIEND_TEST(SupernodeTestSuite, TestConcurrentDeltas);
   FRIEND_TEST(SupernodeTestSuite, TestSerialization);
   FRIEND_TEST(GraphTestSuite, TestCorrectnessOfReheating);
   FRIEND_TEST(GraphTest, TestSupernodeRestoreAfterCCFailure);
@@ -30,38 +62,56 @@ public:
   const uint64_t seed; // for creating a copy
   
 private:
-  size_t sketch_size;
+  size_t sketch_size; // grows with the depths the sketches hold
 
   /* collection of logn sketches to query from, since we can't query from one
      sketch more than once */
   // The sketches, off the end.
-  alignas(Sketch) char sketch_buffer[1];
+  alignas(SamplerT) char sketch_buffer[1];
   
   /**
    * @param n     the total number of nodes in the graph.
    * @param seed  the (fixed) seed value passed to each supernode.
+   * @param zero_buckets  false if the memory of the supernode is already zero filled.
+   * @param rows  the depths the sketches start with.
    */
-  Supernode(uint64_t n, uint64_t seed);
+  SupernodeT(uint64_t n, uint64_t seed, bool zero_buckets = true,
+             size_t rows = Traits::initial_rows());
 
   /**
    * @param n         the total number of nodes in the graph.
    * @param seed      the (fixed) seed value passed to each supernode.
    * @param binary_in A stream to read the data from.
    */
-  Supernode(uint64_t n, uint64_t seed, std::istream &binary_in);
+  SupernodeT(uint64_t n, uint64_t seed, std::istream &binary_in);
 
-  Supernode(const Supernode& s);
+  SupernodeT(const SupernodeT& s);
 
   // get the ith sketch in the sketch array
-  inline Sketch* get_sketch(size_t i) {
-    return reinterpret_cast<Sketch*>(sketch_buffer + i * sketch_size);
+  inline SamplerT* get_sketch(size_t i) {
+    return reinterpret_cast<SamplerT*>(sketch_buffer + i * sketch_size);
   }
 
   // version of above for const supernode objects
-  inline const Sketch* get_sketch(size_t i) const {
-    return reinterpret_cast<const Sketch*>(sketch_buffer + i * sketch_size);
+  inline const SamplerT* get_sketch(size_t i) const {
+    return reinterpret_cast<const SamplerT*>(sketch_buffer + i * sketch_size);
   }
 
+  // the depths a batch of hashed updates reaches in any sketch, see hash_updates
+  size_t bundle_rows(const char *bundles, size_t num) const;
+
+  // grow the sketches to hold at least rows depths. The caller holds node_lock exclusively
+  // (or the supernode).
+  void reserve_rows(size_t rows);
+
+  // add the sketches of other from the first to those of this supernode, which
+  // holds every nonzero depth of other. With atomic XORs if atomic.
+  void add_sketches(const SupernodeT &other, size_t first, bool atomic = false);
+
+  // sample_batch, and sample_all_batch if samples is not nullptr
+  static void sample_nodes(SupernodeT* const* nodes, size_t num,
+                           std::pair<Edge, SampleSketchRet>* out, std::vector<Edge>* samples);
+
 public:
   /**
    * Supernode construtors
@@ -70,29 +120,58 @@ public:
    * @param loc     (Optional) the memory location to put the supernode.
    * @return        a pointer to the newly created supernode object
    */
-  static Supernode* makeSupernode(uint64_t n, long seed, void *loc = malloc(bytes_size));
+  static SupernodeT* makeSupernode(uint64_t n, long seed, void *loc = malloc(bytes_size));
   
+  // create supernode in zero filled memory (such as fresh anonymous memory)
+  static SupernodeT* makeZeroedSupernode(uint64_t n, long seed, void *loc);
+
   // create supernode from file
-  static Supernode* makeSupernode(uint64_t n, long seed, std::istream &binary_in, 
+  static SupernodeT* makeSupernode(uint64_t n, long seed, std::istream &binary_in, 
                                   void *loc = malloc(bytes_size));
   // copy 'constructor'
-  static Supernode* makeSupernode(const Supernode& s, void *loc = malloc(bytes_size));
+  static SupernodeT* makeSupernode(const SupernodeT& s, void *loc = malloc(bytes_size));
 
-  ~Supernode();
+  ~SupernodeT();
 
   static inline void configure(uint64_t n, vec_t sketch_fail_factor=100) {
-    Sketch::configure(n*n, sketch_fail_factor);
-    bytes_size = sizeof(Supernode) + log2(n)/(log2(3)-1) * Sketch::sketchSizeof() - sizeof(char);
+    SamplerT::configure(n*n, sketch_fail_factor);
+    bytes_size = sizeof(SupernodeT) + log2(n)/(log2(3)-1) * SamplerT::sketchSizeof() - sizeof(char);
+    bundle_size = (size_t)(log2(n)/(log2(3)-1)) * Traits::hashed_update_size();
   }
 
   static inline size_t get_size() {
     return bytes_size;
   }
 
+  static inline size_t get_bundle_size() {
+    return bundle_size;
+  }
+
+  // true if the sketches start without depths and grow, see Sketch::set_adaptive_depth
+  static inline bool adaptive_rows() {
+    return Traits::initial_rows() < Traits::max_rows();
+  }
+
+  /* set the smallest batch applied through a delta supernode (see apply_hashed_updates)
+   * The default was chosen with BM_Supernode_In_Place. Intended for testing and benchmarking.
+   */
+  static inline void set_in_place_threshold(size_t threshold) {
+    in_place_threshold = threshold;
+  }
+
+  static inline size_t get_in_place_threshold() {
+    return in_place_threshold;
+  }
+
   inline size_t get_sketch_size() {
     return sketch_size;
   }
 
+  // the bytes of this supernode in use, at most get_size()
+  inline size_t get_bytes() const {
+    return sizeof(SupernodeT) - sizeof(char) + num_sketches * sketch_size;
+  }
+
   // return the number of sketches held in this supernode
   int get_num_sktch() { return num_sketches; };
 
@@ -118,8 +197,8 @@ public:
   }
 
   // get the ith sketch in the sketch array as a const object
-  inline const Sketch* get_const_sketch(size_t i) {
-    return reinterpret_cast<Sketch*>(sketch_buffer + i * sketch_size);
+  inline const SamplerT* get_const_sketch(size_t i) {
+    return reinterpret_cast<SamplerT*>(sketch_buffer + i * sketch_size);
   }
 
   /**
@@ -130,10 +209,31 @@ public:
    */
   std::pair<Edge, SampleSketchRet> sample();
 
+  /**
+   * Sample many supernodes at once, equivalent to out[k] = nodes[k]->sample().
+   * Supernodes that are at the same query index share the seed of the sketch
+   * they query so the sketches are queried together, see Sketch::query_batch.
+   * @param nodes  the supernodes to sample.
+   * @param num    the number of supernodes.
+   * @param out    where to place the sample of each supernode.
+   */
+  static void sample_batch(SupernodeT* const* nodes, size_t num,
+                           std::pair<Edge, SampleSketchRet>* out);
+
+  /**
+   * sample_batch that also returns every distinct edge each supernode's
+   * sketch holds rather than only the first, see Sketch::query_all_batch.
+   * @param samples  samples[k] is replaced with the edges sampled from nodes[k],
+   *                 the first of which is out[k].first. Empty unless out[k] is GOOD.
+   */
+  static void sample_all_batch(SupernodeT* const* nodes, size_t num,
+                               std::pair<Edge, SampleSketchRet>* out,
+                               std::vector<Edge>* samples);
+
   /**
    * In-place merge function. Guaranteed to update the caller Supernode.
    */
-  void merge(Supernode& other);
+  void merge(SupernodeT& other);
 
   /**
    * Insert or delete an (encoded) edge into the supernode. Guaranteed to be
@@ -143,10 +243,15 @@ public:
 
   /**
    * Update all the sketches in a supernode, given a batch of updates.
+   * Built with SUPERNODE_ATOMIC_XOR the delta is added with atomic XORs of its
+   * nonzero words, concurrently with the deltas of other threads, otherwise
+   * under the supernode lock.
    * @param delta_node  a delta supernode created through calling
    *                    Supernode::delta_supernode.
+   * @param exclusive   whether the caller is the only thread updating this
+   *                    supernode (see owner_computes), so no lock is needed.
    */
-  void apply_delta_update(const Supernode* delta_node);
+  void apply_delta_update(const SupernodeT* delta_node, bool exclusive = false);
 
   /**
    * Create new delta supernode with given initial parmameters and batch of
@@ -159,6 +264,62 @@ public:
   static void delta_supernode(uint64_t n, uint64_t seed, const
   std::vector<vec_t>& updates, void *loc);
 
+  /**
+   * Compute the hashes of a batch of updates for every sketch of a supernode.
+   * The hashes only depend upon the supernode seed, which is shared by every
+   * supernode of a graph, so they may be reused for any supernode.
+   * @param n        see declared constructor.
+   * @param seed     see declared constructor.
+   * @param updates  the updates to hash.
+   * @param num      the number of updates.
+   * @param bundles  where to place the hashes. The hashes (bundle) of update k
+   *                 occupy get_bundle_size() bytes starting at bundles + k * get_bundle_size().
+   */
+  static void hash_updates(uint64_t n, uint64_t seed, const vec_t* updates, size_t num, char *bundles);
+
+  /**
+   * Free the hash keys of the sketches of the supernodes with seed, which are
+   * otherwise kept until the program exits. No such supernode may be in use.
+   * @param n     see declared constructor.
+   * @param seed  see declared constructor.
+   */
+  static void release_hash_keys(uint64_t n, uint64_t seed);
+
+  /**
+   * Create new delta supernode from a batch of updates whose hashes have
+   * already been computed with hash_updates.
+   * @param n        see declared constructor.
+   * @param seed     see declared constructor.
+   * @param updates  the batch of updates to apply.
+   * @param bundles  the hashes of the updates.
+   * @param loc      the location to place the delta in
+   */
+  static void delta_supernode(uint64_t n, uint64_t seed, const
+  std::vector<vec_t>& updates, const char *bundles, void *loc);
+
+  /**
+   * Apply a batch of updates whose hashes have already been computed with
+   * hash_updates directly to the sketches of this supernode.
+   * Unlike delta_supernode + apply_delta_update, which zero and XOR every bucket
+   * of a whole supernode, this only touches the buckets the updates hit so its
+   * cost scales with the size of the batch. It holds the supernode lock while
+   * applying the updates so is preferable only for small batches.
+   * @param updates  the batch of updates to apply.
+   * @param num      the number of updates.
+   * @param bundles  the hashes of the updates.
+   * @param exclusive  see apply_delta_update.
+   */
+  void apply_hashed_updates(const vec_t* updates, size_t num, const char *bundles,
+                            bool exclusive = false);
+
+  /**
+   * With adaptive depth, grow the sketches up front to the depths the given
+   * number of updates is expected to reach (see Sketch::expected_rows) rather
+   * than a few depths at a time as the updates arrive. Does nothing otherwise.
+   * @param num_updates  the number of updates the supernode will receive.
+   */
+  void reserve_updates(uint64_t num_updates);
+
   /**
    * Serialize the supernode to a binary output stream.
    * @param out the stream to write to.
@@ -172,3 +333,7 @@ class OutOfQueriesException : public std::exception {
     return "This supernode cannot be sampled more times!";
   }
 };
+
+extern template class SupernodeT<Sketch>;
+extern template class SupernodeT<OneSparseSampler>;
+typedef SupernodeT<Sketch> Supernode;
@@ -0,0 +1,53 @@
+#pragma once
+#include <cstddef>
+
+/**
+ * One region of memory holding a fixed number of equally sized slots, used to
+ * place all the supernodes of a graph together (slot i holds the supernode of
+ * node i) rather than in a separate allocation each.
+ *
+ * The region is mapped anonymously, so it starts out as zero pages, and is
+ * backed by the largest huge pages available: 1GB pages if the region is at
+ * least 1GB, else 2MB pages, else normal pages marked for transparent huge
+ * pages with madvise. Explicit huge pages are only available if the system has
+ * reserved them (vm.nr_hugepages), otherwise the madvise fallback is used.
+ *
+ * Slots are 64 byte aligned so that no two supernodes share a cache line.
+ *
+ * Huge pages may be turned off for slots that are only partly used, such as
+ * those of supernodes with adaptive depth sketches. The pages beyond the part
+ * of a slot in use are then never touched, whereas a huge page is backed as a
+ * whole once any of its bytes are.
+ */
+class SupernodeArena {
+private:
+  static constexpr size_t slot_align = 64;
+
+  char *base;
+  size_t map_bytes;  // size of the mapping
+  size_t page_bytes; // size of the pages backing the mapping
+  size_t slot_bytes;
+  size_t num_slots;
+
+  // try to map bytes of anonymous memory with the given mmap flags, nullptr on failure
+  static char *map(size_t bytes, int flags);
+public:
+  /**
+   * @param slot_size  the size of each slot in bytes, rounded up to the slot alignment.
+   * @param num_slots  the number of slots.
+   * @param huge_pages false to back the region with normal pages only.
+   * @throws std::bad_alloc if the region cannot be mapped.
+   */
+  SupernodeArena(size_t slot_size, size_t num_slots, bool huge_pages = true);
+  ~SupernodeArena();
+
+  SupernodeArena(const SupernodeArena &) = delete;
+  SupernodeArena &operator=(const SupernodeArena &) = delete;
+
+  inline char *slot(size_t i) const { return base + i * slot_bytes; }
+
+  size_t get_slot_size() const { return slot_bytes; }
+  size_t get_num_slots() const { return num_slots; }
+  // the size of the pages backing the arena (the base page size with the madvise fallback)
+  size_t get_page_size() const { return page_bytes; }
+};
@@ -0,0 +1,49 @@
+#pragma once
+#include <cstddef>
+#include <functional>
+
+/**
+ * One pool of persistent threads running every parallel loop of the library: building
+ * and applying delta supernodes, sampling and merging supernodes in boruvka_emulation,
+ * and initializing graphs. Unlike OpenMP parallel regions, which fork and join a team
+ * of threads per region (per batch within each GraphWorker) and oversubscribe the
+ * cores when nested, the pool never has more threads than configured.
+ *
+ * A loop is split into chunks that are claimed in turn by the thread calling
+ * parallel_for and by any idle thread of the pool, so idle threads join whichever loops
+ * are open (those of any GraphWorker) and a loop opened while every thread is busy, or
+ * from within another loop, is run by its caller rather than waiting for the pool.
+ * While the GraphWorkers are paused for connected components the pool has every core.
+ */
+class TaskPool {
+public:
+  // the work of one chunk [begin, end) of a loop
+  typedef std::function<void(size_t, size_t)> RangeFunc;
+
+  /**
+   * Run body over the chunks of grain iterations each of [begin, end), returning once
+   * every chunk has run. The calling thread runs chunks too, and runs the whole loop
+   * if it is a single chunk. If any chunk throws, the chunks not yet claimed are
+   * skipped and the first exception is rethrown to the caller.
+   * @param grain  the number of iterations in each chunk, at least 1.
+   */
+  static void parallel_for_range(size_t begin, size_t end, size_t grain, const RangeFunc &body);
+
+  // parallel_for_range applying f to each iteration
+  template <class F>
+  static void parallel_for(size_t begin, size_t end, size_t grain, F f) {
+    if (end <= begin + grain) {
+      for (size_t i = begin; i < end; ++i) f(i);
+      return;
+    }
+    parallel_for_range(begin, end, grain, [&f](size_t lo, size_t hi) {
+      for (size_t i = lo; i < hi; ++i) f(i);
+    });
+  }
+
+  /* set the number of threads running loops, counting the caller of each loop. 0 for one
+   * per hardware thread. Must not be called while any loop runs.
+   */
+  static void set_num_threads(int num);
+  static int get_num_threads();
+};
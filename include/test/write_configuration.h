@@ -1,7 +1,25 @@
 #include <fstream>
+#include <string>
 
-static void write_configuration(bool use_tree, bool backup_in_mem = false, int
-        groups = 1, int g_size = 1) {
+// the streaming.conf written by write_configuration, see example_streaming.conf
+struct TestConfiguration {
+  bool use_tree = false;
+  bool backup_in_mem = false;
+  int num_groups = 1;
+  int edge_cache_mb = 0;
+  bool wide_hashing = false;
+  std::string hash_family = "xxh64";
+  bool class_geometry = false;
+  bool sample_all = false;
+  int exact_degree = 0;
+  bool adaptive_depth = false;
+  bool owner_computes = false;
+  int hot_node_updates = 0;
+  int pack_size = 1;
+  int pool_threads = 0;
+};
+
+static void write_configuration(const TestConfiguration &config) {
   // read previous configuration to get GutterTree prefix
   // as this is system dependent and shouldn't be set by our code
   std::ifstream in("streaming.conf");
@@ -20,10 +38,28 @@ static void write_configuration(bool use_tree, bool backup_in_mem = false, int
   in.close();
 
   std::ofstream out("streaming.conf");
-  out << "buffering_system=" << (use_tree? "tree" : "standalone") << std::endl;
+  out << "buffering_system=" << (config.use_tree? "tree" : "standalone") << std::endl;
   out << "disk_dir=" << disk_dir << std::endl;
-  out << "backup_in_mem=" << (backup_in_mem? "ON" : "OFF") << std::endl;
-  out << "num_groups=" << groups << std::endl;
-  out << "group_size=" << g_size << std::endl;
+  out << "backup_in_mem=" << (config.backup_in_mem? "ON" : "OFF") << std::endl;
+  out << "num_groups=" << config.num_groups << std::endl;
+  out << "edge_hash_cache_mb=" << config.edge_cache_mb << std::endl;
+  out << "sketch_hashing=" << (config.wide_hashing? "wide" : "column") << std::endl;
+  out << "hash_family=" << config.hash_family << std::endl;
+  out << "sketch_geometry=" << (config.class_geometry? "class" : "exact") << std::endl;
+  out << "boruvka_samples=" << (config.sample_all? "all" : "one") << std::endl;
+  out << "exact_degree=" << config.exact_degree << std::endl;
+  out << "sketch_depth=" << (config.adaptive_depth? "adaptive" : "full") << std::endl;
+  out << "owner_computes=" << (config.owner_computes? "ON" : "OFF") << std::endl;
+  out << "hot_node_updates=" << config.hot_node_updates << std::endl;
+  out << "batch_pack_size=" << config.pack_size << std::endl;
+  out << "task_pool_threads=" << config.pool_threads << std::endl;
   out.close();
 }
+
+// the default configuration with the given buffering system
+static void write_configuration(bool use_tree, bool backup_in_mem = false) {
+  TestConfiguration config;
+  config.use_tree = use_tree;
+  config.backup_in_mem = backup_in_mem;
+  write_configuration(config);
+}
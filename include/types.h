@@ -5,6 +5,8 @@
 typedef uint64_t col_hash_t;
 static const auto& vec_hash = XXH32;
 static const auto& col_hash = XXH64;
+typedef XXH128_hash_t wide_hash_t;
+static const auto& wide_hash = XXH3_128bits_withSeed;
 
 enum UpdateType {
   INSERT = 0,
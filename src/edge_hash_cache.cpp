@@ -0,0 +1,38 @@
+#include <cstring>
+#include <stdexcept>
+#include "../include/edge_hash_cache.h"
+
+size_t EdgeHashCache::cache_bytes = 0;
+
+EdgeHashCache::EdgeHashCache(size_t bundle_size, size_t bytes) : bundle_size(bundle_size),
+               hits(0), misses(0) {
+  num_slots = bytes / (bundle_size + sizeof(vec_t));
+  if (num_slots == 0) throw std::invalid_argument("EdgeHashCache too small to hold a bundle");
+  keys = new vec_t[num_slots]();
+  bundles = new char[num_slots * bundle_size];
+}
+
+EdgeHashCache::~EdgeHashCache() {
+  delete[] keys;
+  delete[] bundles;
+}
+
+bool EdgeHashCache::take(vec_t edge, char *bundle) {
+  size_t slot = slot_of(edge);
+  std::lock_guard<std::mutex> lk(locks[slot % num_locks]);
+  if (keys[slot] != edge) {
+    ++misses;
+    return false;
+  }
+  memcpy(bundle, bundles + slot * bundle_size, bundle_size);
+  keys[slot] = 0;
+  ++hits;
+  return true;
+}
+
+void EdgeHashCache::put(vec_t edge, const char *bundle) {
+  size_t slot = slot_of(edge);
+  std::lock_guard<std::mutex> lk(locks[slot % num_locks]);
+  keys[slot] = edge;
+  memcpy(bundles + slot * bundle_size, bundle, bundle_size);
+}
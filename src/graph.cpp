@@ -8,34 +8,84 @@
 #include <standalone_gutters.h>
 #include "../include/graph.h"
 #include "../include/graph_worker.h"
+#include "../include/task_pool.h"
 
 // static variable for enforcing that only one graph is open at a time
-bool Graph::open_graph = false;
+bool GraphBase::open_graph = false;
+bool GraphBase::sample_all = false;
+size_t GraphBase::exact_degree = 0;
+size_t GraphBase::hot_updates = 0;
+constexpr size_t GraphBase::sample_group_size;
+template <class SamplerT>
+constexpr size_t GraphT<SamplerT>::num_materialize_locks;
+template <class SamplerT>
+std::atomic<uint64_t> GraphT<SamplerT>::num_graphs;
+
+// the nodes a thread of the task pool initializes at once in the constructors
+static constexpr node_id_t init_grain = 1 << 16;
+
+namespace {
+// the sketch settings a checkpoint must be read back under, see write_binary
+struct CheckpointSettings {
+  uint8_t hashing;
+  uint8_t hash_family;
+  uint8_t geometry;
+  uint8_t adaptive_depth;
+};
+
+CheckpointSettings current_settings() {
+  return {(uint8_t) Sketch::get_hashing(), (uint8_t) Sketch::get_hash_family(),
+          (uint8_t) Sketch::get_geometry(), (uint8_t) Sketch::get_adaptive_depth()};
+}
+
+// the files written before the header had none of these modes
+constexpr CheckpointSettings legacy_settings = {COLUMN_HASHING, XXH64_HASH, EXACT_GEOMETRY, 0};
+
+// the first setting that differs between the file and the configuration, nullptr if none
+const char *mismatched_setting(const CheckpointSettings &file) {
+  CheckpointSettings conf = current_settings();
+  if (file.hashing != conf.hashing) return "sketch_hashing";
+  if (file.hash_family != conf.hash_family) return "hash_family";
+  if (file.geometry != conf.geometry) return "sketch_geometry";
+  if (file.adaptive_depth != conf.adaptive_depth) return "sketch_depth";
+  return nullptr;
+}
+} // namespace
 
-Graph::Graph(node_id_t num_nodes, int num_inserters): num_nodes(num_nodes) {
+template <class SamplerT>
+GraphT<SamplerT>::GraphT(node_id_t num_nodes, int num_inserters): num_nodes(num_nodes) {
   if (open_graph) throw MultipleGraphsException();
 
 #ifdef VERIFY_SAMPLES_F
   std::cout << "Verifying samples..." << std::endl;
 #endif
+  // read the configuration file to configure the system (before creating any sketches)
+  std::tuple<bool, bool, std::string> conf = configure_system();
   Supernode::configure(num_nodes);
-  representatives = new std::set<node_id_t>();
   supernodes = new Supernode*[num_nodes];
+  // the sketches of adaptive depth supernodes only use the start of their slot
+  arena = new SupernodeArena(Supernode::get_size(), num_nodes, !Supernode::adaptive_rows());
   parent = new node_id_t[num_nodes];
   size = new node_id_t[num_nodes];
   seed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now().time_since_epoch()).count();
   std::mt19937_64 r(seed);
   seed = r();
 
-  std::fill(size, size + num_nodes, 1);
-  for (node_id_t i = 0; i < num_nodes; ++i) {
-    representatives->insert(i);
-    supernodes[i] = Supernode::makeSupernode(num_nodes,seed);
-    parent[i] = i;
+  if (exact_degree > 0) {
+    exact_edges = new SupernodeArena(exact_degree * sizeof(vec_t), num_nodes);
+    exact_size = new node_id_t[num_nodes];
   }
+  init_hot_nodes();
+
+  TaskPool::parallel_for(0, num_nodes, init_grain, [&](node_id_t i) {
+    supernodes[i] = nullptr; // see materialize
+    if (exact_size != nullptr) exact_size[i] = 0;
+    if (node_updates != nullptr) node_updates[i] = 0;
+    parent[i] = i;
+    size[i] = 1;
+  });
   num_updates = 0; // REMOVE this later
   
-  std::tuple<bool, bool, std::string> conf = configure_system(); // read the configuration file to configure the system
   copy_in_mem = std::get<1>(conf);
   std::string disk_loc = std::get<2>(conf);
   backup_file = disk_loc + "supernode_backup.data";
@@ -45,36 +95,99 @@ Graph::Graph(node_id_t num_nodes, int num_inserters): num_nodes(num_nodes) {
   else
     gts = new StandAloneGutters(num_nodes, GraphWorker::get_num_groups(), num_inserters);
 
+  if (EdgeHashCache::get_config() > 0)
+    edge_cache = new EdgeHashCache(Supernode::get_bundle_size(), EdgeHashCache::get_config());
+
   GraphWorker::start_workers(this, gts, Supernode::get_size());
   open_graph = true;
 }
 
-Graph::Graph(const std::string& input_file, int num_inserters) : num_updates(0) {
+template <class SamplerT>
+GraphT<SamplerT>::GraphT(const std::string& input_file, int num_inserters) : num_updates(0) {
   if (open_graph) throw MultipleGraphsException();
-  
+
+  // read the configuration file to configure the system (before creating any sketches)
+  std::tuple<bool, bool, std::string> conf = configure_system();
   vec_t sketch_fail_factor;
   auto binary_in = std::fstream(input_file, std::ios::in | std::ios::binary);
+  if (!binary_in.is_open())
+    throw BadCheckpointException("Could not open the graph file " + input_file);
+  // files written before the header have none and hold every supernode, see write_binary
+  uint32_t magic = 0, version = 0;
+  binary_in.read((char*)&magic, sizeof(magic));
+  if (magic == checkpoint_magic) {
+    binary_in.read((char*)&version, sizeof(version));
+    if (version != checkpoint_version)
+      throw BadCheckpointException("The graph file " + input_file + " has format version "
+                                   + std::to_string(version) + ", only versions 0 (no header) and "
+                                   + std::to_string(checkpoint_version) + " can be read");
+  } else {
+    binary_in.clear();
+    binary_in.seekg(0);
+  }
+  CheckpointSettings settings = legacy_settings;
+  if (version > 0) binary_in.read((char*)&settings, sizeof(settings));
+  if (binary_in) {
+    if (const char *setting = mismatched_setting(settings))
+      throw BadCheckpointException("The graph file " + input_file + " was written with another "
+                                   + setting + " than streaming.conf configures");
+  }
   binary_in.read((char*)&seed, sizeof(seed));
   binary_in.read((char*)&num_nodes, sizeof(num_nodes));
   binary_in.read((char*)&sketch_fail_factor, sizeof(sketch_fail_factor));
+  if (!binary_in)
+    throw BadCheckpointException("The graph file " + input_file + " is truncated");
   Supernode::configure(num_nodes, sketch_fail_factor);
 
 #ifdef VERIFY_SAMPLES_F
   std::cout << "Verifying samples..." << std::endl;
 #endif
-  representatives = new std::set<node_id_t>();
   supernodes = new Supernode*[num_nodes];
+  // the sketches of adaptive depth supernodes only use the start of their slot
+  arena = new SupernodeArena(Supernode::get_size(), num_nodes, !Supernode::adaptive_rows());
   parent = new node_id_t[num_nodes];
   size = new node_id_t[num_nodes];
-  std::fill(size, size+num_nodes, 1);
-  for (node_id_t i = 0; i < num_nodes; ++i) {
-    representatives->insert(i);
-    supernodes[i] = Supernode::makeSupernode(num_nodes, seed, binary_in);
+  if (exact_degree > 0) {
+    exact_edges = new SupernodeArena(exact_degree * sizeof(vec_t), num_nodes);
+    exact_size = new node_id_t[num_nodes];
+  }
+  init_hot_nodes();
+  TaskPool::parallel_for(0, num_nodes, init_grain, [&](node_id_t i) {
+    if (exact_size != nullptr) exact_size[i] = 0;
+    if (node_updates != nullptr) node_updates[i] = 0;
     parent[i] = i;
+    size[i] = 1;
+  });
+  // which nodes have a supernode in the file, see write_binary
+  std::vector<char> materialized((num_nodes + 7) / 8, (char) 0xFF);
+  if (version > 0) binary_in.read(materialized.data(), materialized.size());
+  for (node_id_t i = 0; i < num_nodes; ++i) {
+    if (materialized[i / 8] & (1 << (i % 8)))
+      supernodes[i] = Supernode::makeSupernode(num_nodes, seed, binary_in, arena->slot(i));
+    else
+      supernodes[i] = nullptr;
+  }
+  // the nodes holding their edges explicitly
+  node_id_t num_exact = 0;
+  if (version > 0) binary_in.read((char*)&num_exact, sizeof(num_exact));
+  std::vector<vec_t> edges;
+  for (node_id_t k = 0; k < num_exact; ++k) {
+    node_id_t node, num;
+    binary_in.read((char*)&node, sizeof(node));
+    binary_in.read((char*)&num, sizeof(num));
+    edges.resize(num);
+    binary_in.read((char*)edges.data(), num * sizeof(vec_t));
+    if (num <= exact_degree) {
+      std::copy(edges.begin(), edges.end(), get_exact(node));
+      exact_size[node] = num;
+    } else {
+      // too many edges for this configuration
+      Supernode *supernode = construct_supernode(node);
+      for (vec_t edge : edges) supernode->update(edge);
+    }
   }
   binary_in.close();
 
-  std::tuple<bool, bool, std::string> conf = configure_system(); // read the configuration file to configure the system
   copy_in_mem = std::get<1>(conf);
   std::string disk_loc = std::get<2>(conf);
   backup_file = disk_loc + "supernode_backup.data";
@@ -84,90 +197,400 @@ Graph::Graph(const std::string& input_file, int num_inserters) : num_updates(0)
   else
     gts = new StandAloneGutters(num_nodes, GraphWorker::get_num_groups(), num_inserters);
 
+  if (EdgeHashCache::get_config() > 0)
+    edge_cache = new EdgeHashCache(Supernode::get_bundle_size(), EdgeHashCache::get_config());
+
   GraphWorker::start_workers(this, gts, Supernode::get_size());
   open_graph = true;
 }
 
-Graph::~Graph() {
-  for (unsigned i=0;i<num_nodes;++i)
-    free(supernodes[i]); // free because memory is malloc'd in make_supernode
+template <class SamplerT>
+GraphT<SamplerT>::~GraphT() {
+  delete arena; // the supernodes are all placed in the arena
   delete[] supernodes;
+  delete exact_edges;
+  delete[] exact_size;
   delete[] parent;
   delete[] size;
-  delete representatives;
   GraphWorker::stop_workers(); // join the worker threads
+  for (auto &thread_partials : partials)
+    for (auto &partial : *thread_partials) free(partial.second);
+  delete[] node_updates;
   delete gts;
+  delete edge_cache;
+  Supernode::release_hash_keys(num_nodes, seed);
   open_graph = false;
 }
 
-void Graph::generate_delta_node(node_id_t node_n, uint64_t node_seed, node_id_t
-               src, const std::vector<node_id_t> &edges, Supernode *delta_loc) {
-  std::vector<vec_t> updates;
-  updates.reserve(edges.size());
-  for (const auto& edge : edges) {
-    if (src < edge) {
-      updates.push_back(static_cast<vec_t>(
-                            nondirectional_non_self_edge_pairing_fn(src, edge)));
-    } else {
-      updates.push_back(static_cast<vec_t>(
-                            nondirectional_non_self_edge_pairing_fn(edge, src)));
+template <class SamplerT>
+typename GraphT<SamplerT>::Supernode* GraphT<SamplerT>::materialize(node_id_t node) {
+  // the pointer is only ever set once, by the thread holding the node's lock
+  Supernode *supernode = __atomic_load_n(&supernodes[node], __ATOMIC_ACQUIRE);
+  if (supernode != nullptr) return supernode;
+
+  std::lock_guard<std::mutex> lk(materialize_locks[node % num_materialize_locks]);
+  supernode = supernodes[node];
+  if (supernode == nullptr) supernode = construct_supernode(node);
+  return supernode;
+}
+
+template <class SamplerT>
+typename GraphT<SamplerT>::Supernode* GraphT<SamplerT>::construct_supernode(node_id_t node) {
+  // the slot has never been written so it is still the zero pages it was mapped with
+  Supernode *supernode = Supernode::makeZeroedSupernode(num_nodes, seed, arena->slot(node));
+  __atomic_store_n(&supernodes[node], supernode, __ATOMIC_RELEASE);
+  return supernode;
+}
+
+template <class SamplerT>
+bool GraphT<SamplerT>::update_exact(node_id_t node, std::vector<vec_t> &updates) {
+  std::lock_guard<std::mutex> lk(materialize_locks[node % num_materialize_locks]);
+  if (supernodes[node] != nullptr) return false; // promoted by another graph worker
+
+  // reused across calls by the same graph worker
+  thread_local std::vector<vec_t> toggled;
+  toggled.clear();
+  // edges both held and updated are deleted
+  vec_t *edges = get_exact(node);
+  std::set_symmetric_difference(edges, edges + exact_size[node], updates.begin(), updates.end(),
+                                std::back_inserter(toggled));
+  if (toggled.size() <= exact_degree) {
+    std::copy(toggled.begin(), toggled.end(), edges);
+    exact_size[node] = toggled.size();
+    return true;
+  }
+
+  // promote, the supernode is built from every edge of the node
+  construct_supernode(node);
+  exact_size[node] = 0;
+  std::swap(updates, toggled);
+  return false;
+}
+
+template <class SamplerT>
+typename GraphT<SamplerT>::Supernode* GraphT<SamplerT>::promote(node_id_t node) {
+  Supernode *supernode = construct_supernode(node);
+  if (exact_size != nullptr) {
+    vec_t *edges = get_exact(node);
+    for (node_id_t k = 0; k < exact_size[node]; ++k) supernode->update(edges[k]);
+    exact_size[node] = 0;
+  }
+  return supernode;
+}
+
+template <class SamplerT>
+void GraphT<SamplerT>::init_hot_nodes() {
+  graph_id = ++num_graphs;
+  // with a single graph worker, or graph workers that own their nodes, there is no contention
+  if (hot_updates > 0 && GraphWorker::get_num_groups() > 1 && !GraphWorker::get_owner_computes())
+    node_updates = new node_id_t[num_nodes];
+}
+
+template <class SamplerT>
+typename GraphT<SamplerT>::Supernode* GraphT<SamplerT>::hot_partial(node_id_t node,
+               size_t num_updates) {
+  if (node_updates == nullptr) return nullptr;
+  // stop counting once hot, the counter of a hot node would be contended
+  if (__atomic_load_n(&node_updates[node], __ATOMIC_RELAXED) < hot_updates) {
+    __atomic_fetch_add(&node_updates[node], num_updates, __ATOMIC_RELAXED);
+    return nullptr;
+  }
+
+  // the partials of the calling thread, registered with the graph upon its first hot batch
+  thread_local uint64_t partials_graph = 0;
+  thread_local Partials *thread_partials = nullptr;
+  if (partials_graph != graph_id) {
+    std::lock_guard<std::mutex> lk(partials_lock);
+    partials.emplace_back(new Partials());
+    thread_partials = partials.back().get();
+    partials_graph = graph_id;
+  }
+  Supernode *&partial = (*thread_partials)[node];
+  if (partial == nullptr)
+    partial = Supernode::makeSupernode(num_nodes, seed, malloc(Supernode::get_size()));
+  return partial;
+}
+
+template <class SamplerT>
+void GraphT<SamplerT>::merge_partials() {
+  for (auto &thread_partials : partials) {
+    for (auto &partial : *thread_partials) {
+      supernodes[partial.first]->merge(*partial.second);
+      free(partial.second);
     }
+    thread_partials->clear();
   }
+}
+
+template <class SamplerT>
+std::pair<Edge, SampleSketchRet> GraphT<SamplerT>::sample_exact(node_id_t node,
+               std::vector<Edge> *samples) {
+  node_id_t num = exact_size == nullptr ? 0 : exact_size[node];
+  if (samples != nullptr) {
+    samples[node].clear();
+    for (node_id_t k = 0; k < num; ++k)
+      samples[node].push_back(inv_nondir_non_self_edge_pairing_fn(get_exact(node)[k]));
+  }
+  if (num == 0) return {{0, 0}, ZERO};
+  return {inv_nondir_non_self_edge_pairing_fn(get_exact(node)[0]), GOOD};
+}
+
+template <class SamplerT>
+bool GraphT<SamplerT>::merge_exact(node_id_t a, const std::vector<node_id_t> &to_merge) {
+  if (exact_size == nullptr) return false;
+  // reused across calls by the same thread
+  thread_local std::vector<vec_t> merged;
+  thread_local std::vector<vec_t> next;
+  vec_t *edges = get_exact(a);
+  merged.assign(edges, edges + exact_size[a]);
+  for (node_id_t b : to_merge) {
+    if (supernodes[b] != nullptr) return false;
+    // the edges between the nodes cancel, as in the XOR of their supernodes
+    next.clear();
+    std::set_symmetric_difference(merged.begin(), merged.end(), get_exact(b),
+                                  get_exact(b) + exact_size[b], std::back_inserter(next));
+    std::swap(merged, next);
+  }
+  if (merged.size() > exact_degree) return false;
+  std::copy(merged.begin(), merged.end(), edges);
+  exact_size[a] = merged.size();
+  return true;
+}
+
+template <class SamplerT>
+void GraphT<SamplerT>::restore_exact(node_id_t node, const std::vector<vec_t> &edges) {
+  if (supernodes[node] == nullptr) {
+    if (exact_size == nullptr) return; // no edges
+    std::copy(edges.begin(), edges.end(), get_exact(node));
+    exact_size[node] = edges.size();
+    return;
+  }
+  // the node was promoted while merging, rebuild its supernode from its edges
+  Supernode *supernode = Supernode::makeSupernode(num_nodes, seed, supernodes[node]);
+  for (vec_t edge : edges) supernode->update(edge);
+}
+
+template <class SamplerT>
+size_t GraphT<SamplerT>::cancel_updates(std::vector<vec_t> &updates) {
+  // an update applied twice is XORed out of every bucket so only updates that
+  // appear an odd number of times need to be applied
+  std::sort(updates.begin(), updates.end());
+  size_t num_kept = 0;
+  for (size_t i = 0; i < updates.size();) {
+    size_t j = i + 1;
+    while (j < updates.size() && updates[j] == updates[i]) ++j;
+    if ((j - i) % 2 == 1) updates[num_kept++] = updates[i];
+    i = j;
+  }
+  size_t num_cancelled = updates.size() - num_kept;
+  updates.resize(num_kept);
+  return num_cancelled;
+}
+
+template <class SamplerT>
+void GraphT<SamplerT>::edges_to_updates(node_id_t src, const std::vector<node_id_t> &edges,
+                             std::vector<vec_t> &updates) {
+  updates.clear();
+  updates.reserve(edges.size());
+  for (const auto& edge : edges)
+    updates.push_back(static_cast<vec_t>(nondirectional_non_self_edge_pairing_fn(src, edge)));
+}
+
+template <class SamplerT>
+size_t GraphT<SamplerT>::generate_delta_node(node_id_t node_n, uint64_t node_seed, node_id_t
+               src, const std::vector<node_id_t> &edges, Supernode *delta_loc) {
+  std::vector<vec_t> updates;
+  edges_to_updates(src, edges, updates);
+  size_t num_cancelled = cancel_updates(updates);
   Supernode::delta_supernode(node_n, node_seed, updates, delta_loc);
+  return num_cancelled;
 }
-void Graph::batch_update(node_id_t src, const std::vector<node_id_t> &edges, Supernode *delta_loc) {
+
+template <class SamplerT>
+void GraphT<SamplerT>::batch_update(node_id_t src, const std::vector<node_id_t> &edges,
+               void *delta_loc_mem) {
+  Supernode *delta_loc = static_cast<Supernode *>(delta_loc_mem);
   if (update_locked) throw UpdateLockedException();
 
   num_updates += edges.size();
-  generate_delta_node(supernodes[src]->n, supernodes[src]->seed, src, edges, delta_loc);
-  supernodes[src]->apply_delta_update(delta_loc);
-}
+  // reused across calls by the same graph worker
+  thread_local std::vector<vec_t> updates;
+  thread_local std::vector<char> bundles;
+  edges_to_updates(src, edges, updates);
+  num_cancelled += cancel_updates(updates);
+  if (updates.empty()) return;
+  if (exact_size != nullptr && __atomic_load_n(&supernodes[src], __ATOMIC_ACQUIRE) == nullptr
+      && update_exact(src, updates))
+    return;
+  Supernode *supernode = materialize(src);
+  Supernode *partial = hot_partial(src, updates.size());
+  if (partial != nullptr) supernode = partial;
+
+  // only the graph worker owning a node updates its supernode
+  bool exclusive = GraphWorker::get_owner_computes();
+  bool in_place = updates.size() < Supernode::get_in_place_threshold();
+  if (edge_cache == nullptr && !in_place) {
+    Supernode::delta_supernode(num_nodes, seed, updates, delta_loc);
+    supernode->apply_delta_update(delta_loc, exclusive);
+    return;
+  }
 
-inline void Graph::sample_supernodes(std::pair<Edge, SampleSketchRet> *query,
-               std::vector<node_id_t> &reps) {
-  bool except = false;
-  std::exception_ptr err;
-  #pragma omp parallel for default(none) shared(query, reps, except, err)
-  for (node_id_t i = 0; i < reps.size(); ++i) { // NOLINT(modernize-loop-convert)
-    // wrap in a try/catch because exiting through exception is undefined behavior in OMP
-    try {
-      query[reps[i]] = supernodes[reps[i]]->sample();
-
-    } catch (...) {
-      except = true;
-      err = std::current_exception();
-    }
+  hash_updates(updates, bundles);
+  if (in_place) {
+    // small batches touch few buckets, cheaper to apply them in place than to
+    // build and merge a whole delta supernode
+    supernode->apply_hashed_updates(updates.data(), updates.size(), bundles.data(), exclusive);
+    return;
   }
-  // Did one of our threads produce an exception?
-  if (except) std::rethrow_exception(err);
+  Supernode::delta_supernode(num_nodes, seed, updates, bundles.data(), delta_loc);
+  supernode->apply_delta_update(delta_loc, exclusive);
 }
 
-inline std::vector<std::vector<node_id_t>> Graph::supernodes_to_merge(std::pair<Edge, SampleSketchRet>
-               *query, std::vector<node_id_t> &reps) {
-  std::vector<std::vector<node_id_t>> to_merge(num_nodes);
-  std::vector<node_id_t> new_reps;
-  for (auto i : reps) {
-    // unpack query result
-    Edge edge = query[i].first;
-    SampleSketchRet ret_code = query[i].second;
+template <class SamplerT>
+void GraphT<SamplerT>::batch_updates(const std::pair<node_id_t, std::vector<node_id_t>>
+               *batches, size_t num, void *delta_loc) {
+  if (update_locked) throw UpdateLockedException();
+  // hits of the edge cache are reordered by hash_updates, so hash each batch apart
+  if (edge_cache != nullptr) {
+    for (size_t b = 0; b < num; ++b)
+      batch_update(batches[b].first, batches[b].second, delta_loc);
+    return;
+  }
 
-    // try this query again next round as it failed this round
-    if (ret_code == FAIL) {
-      modified = true;
-      new_reps.push_back(i);
+  // reused across calls by the same graph worker
+  thread_local std::vector<vec_t> updates;
+  thread_local std::vector<vec_t> packed;
+  thread_local std::vector<size_t> packed_batches; // the batch of each run of packed updates
+  thread_local std::vector<size_t> packed_begin;
+  thread_local std::vector<char> bundles;
+  packed.clear();
+  packed_batches.clear();
+  packed_begin.clear();
+  for (size_t b = 0; b < num; ++b) {
+    node_id_t src = batches[b].first;
+    const std::vector<node_id_t> &edges = batches[b].second;
+    if (edges.size() >= Supernode::get_in_place_threshold()) {
+      batch_update(src, edges, delta_loc);
       continue;
     }
-    if (ret_code == ZERO) {
-#ifdef VERIFY_SAMPLES_F
-      verifier->verify_cc(i);
-#endif
+    num_updates += edges.size();
+    edges_to_updates(src, edges, updates);
+    num_cancelled += cancel_updates(updates);
+    if (updates.empty()) continue;
+    if (exact_size != nullptr && __atomic_load_n(&supernodes[src], __ATOMIC_ACQUIRE) == nullptr
+        && update_exact(src, updates))
       continue;
+    packed_batches.push_back(b);
+    packed_begin.push_back(packed.size());
+    packed.insert(packed.end(), updates.begin(), updates.end());
+  }
+  if (packed.empty()) return;
+  packed_begin.push_back(packed.size());
+
+  size_t bundle_size = Supernode::get_bundle_size();
+  bundles.resize(packed.size() * bundle_size);
+  Supernode::hash_updates(num_nodes, seed, packed.data(), packed.size(), bundles.data());
+  for (size_t k = 0; k < packed_batches.size(); ++k) {
+    node_id_t src = batches[packed_batches[k]].first;
+    size_t begin = packed_begin[k];
+    size_t len = packed_begin[k + 1] - begin;
+    Supernode *supernode = materialize(src);
+    Supernode *partial = hot_partial(src, len);
+    if (partial != nullptr) supernode = partial;
+    supernode->apply_hashed_updates(packed.data() + begin, len,
+                                    bundles.data() + begin * bundle_size,
+                                    GraphWorker::get_owner_computes());
+  }
+}
+
+template <class SamplerT>
+void GraphT<SamplerT>::reserve_updates(const std::vector<node_id_t> &update_counts) {
+  GraphWorker::balance_owners(update_counts);
+
+  // without either a node's supernode is constructed the same upon its first update
+  if (exact_degree == 0 && !Supernode::adaptive_rows()) return;
+
+  TaskPool::parallel_for(0, num_nodes, 1024, [&](node_id_t i) {
+    // nodes with at most exact_degree updates never outgrow their explicit edges
+    if (update_counts[i] <= exact_degree) return;
+    materialize(i)->reserve_updates(update_counts[i]);
+  });
+}
+
+template <class SamplerT>
+void GraphT<SamplerT>::hash_updates(std::vector<vec_t> &updates, std::vector<char> &bundles) {
+  size_t bundle_size = Supernode::get_bundle_size();
+  bundles.resize(updates.size() * bundle_size);
+  if (edge_cache == nullptr) {
+    Supernode::hash_updates(num_nodes, seed, updates.data(), updates.size(), bundles.data());
+    return;
+  }
+
+  thread_local std::vector<vec_t> misses;
+  misses.clear();
+  // the bundles of cache hits go first, followed by those of the misses
+  size_t num_hits = 0;
+  for (vec_t idx : updates) {
+    if (edge_cache->take(idx, bundles.data() + num_hits * bundle_size))
+      updates[num_hits++] = idx;
+    else
+      misses.push_back(idx);
+  }
+  char *miss_bundles = bundles.data() + num_hits * bundle_size;
+  Supernode::hash_updates(num_nodes, seed, misses.data(), misses.size(), miss_bundles);
+  for (size_t k = 0; k < misses.size(); ++k)
+    edge_cache->put(misses[k], miss_bundles + k * bundle_size);
+
+  std::copy(misses.begin(), misses.end(), updates.begin() + num_hits);
+}
+
+template <class SamplerT>
+inline void GraphT<SamplerT>::sample_supernodes(std::pair<Edge, SampleSketchRet> *query,
+               std::vector<node_id_t> &reps, std::vector<Edge> *samples) {
+  // supernodes are sampled in groups so that their sketches are queried together
+  size_t num_groups = (reps.size() + sample_group_size - 1) / sample_group_size;
+  TaskPool::parallel_for(0, num_groups, 1, [&](size_t g) {
+    size_t begin = g * sample_group_size;
+    size_t num = std::min(sample_group_size, reps.size() - begin);
+    Supernode *nodes[sample_group_size];
+    node_id_t ids[sample_group_size];
+    std::pair<Edge, SampleSketchRet> group_query[sample_group_size];
+    // nodes holding their edges explicitly are sampled directly
+    size_t num_sketched = 0;
+    for (size_t k = 0; k < num; ++k) {
+      node_id_t node = reps[begin + k];
+      if (supernodes[node] == nullptr) {
+        query[node] = sample_exact(node, samples);
+      } else {
+        nodes[num_sketched] = supernodes[node];
+        ids[num_sketched++] = node;
+      }
+    }
+    if (samples == nullptr) {
+      Supernode::sample_batch(nodes, num_sketched, group_query);
+    } else {
+      std::vector<Edge> group_samples[sample_group_size];
+      Supernode::sample_all_batch(nodes, num_sketched, group_query, group_samples);
+      for (size_t k = 0; k < num_sketched; ++k)
+        std::swap(samples[ids[k]], group_samples[k]);
     }
+    for (size_t k = 0; k < num_sketched; ++k)
+      query[ids[k]] = group_query[k];
+  });
+}
 
+template <class SamplerT>
+inline std::vector<std::vector<node_id_t>> GraphT<SamplerT>::supernodes_to_merge(std::pair<Edge, SampleSketchRet>
+               *query, std::vector<node_id_t> &reps, std::vector<Edge> *samples) {
+  std::vector<std::vector<node_id_t>> to_merge(num_nodes);
+  std::vector<node_id_t> new_reps;
+
+  // merge the supernodes on either side of a sampled edge
+  auto merge_edge = [&](Edge edge) {
     // query dsu
     node_id_t a = get_parent(edge.first);
     node_id_t b = get_parent(edge.second);
-    if (a == b) continue;
+    if (a == b) return;
 
 #ifdef VERIFY_SAMPLES_F
     verifier->verify_edge(edge);
@@ -183,6 +606,31 @@ inline std::vector<std::vector<node_id_t>> Graph::supernodes_to_merge(std::pair<
     to_merge[a].insert(to_merge[a].end(), to_merge[b].begin(), to_merge[b].end());
     to_merge[b].clear();
     modified = true;
+  };
+
+  for (auto i : reps) {
+    // unpack query result
+    Edge edge = query[i].first;
+    SampleSketchRet ret_code = query[i].second;
+
+    // try this query again next round as it failed this round
+    if (ret_code == FAIL) {
+      modified = true;
+      new_reps.push_back(i);
+      continue;
+    }
+    if (ret_code == ZERO) {
+#ifdef VERIFY_SAMPLES_F
+      verifier->verify_cc(i);
+#endif
+      continue;
+    }
+
+    if (samples == nullptr) {
+      merge_edge(edge);
+    } else {
+      for (Edge sample : samples[i]) merge_edge(sample);
+    }
   }
 
   // remove nodes added to new_reps due to sketch failures that
@@ -200,62 +648,87 @@ inline std::vector<std::vector<node_id_t>> Graph::supernodes_to_merge(std::pair<
   return to_merge;
 }
 
-inline void Graph::merge_supernodes(Supernode** copy_supernodes, std::vector<node_id_t> &new_reps,
-               std::vector<std::vector<node_id_t>> &to_merge, bool make_copy) {
-  bool except = false;
-  std::exception_ptr err;
+template <class SamplerT>
+inline void GraphT<SamplerT>::merge_supernodes(Supernode** copy_supernodes, std::vector<node_id_t> &new_reps,
+               SupernodeArena *copy_arena, std::vector<std::vector<node_id_t>> &to_merge,
+               bool make_copy) {
   // loop over the to_merge vector and perform supernode merging
-  #pragma omp parallel for default(shared)
-  for (node_id_t i = 0; i < new_reps.size(); i++) { // NOLINT(modernize-loop-convert)
-    // OMP requires a traditional for-loop to work
+  TaskPool::parallel_for(0, new_reps.size(), 16, [&](size_t i) {
     node_id_t a = new_reps[i];
-    try {
-      if (make_copy && copy_in_mem) { // make a copy of a
-        copy_supernodes[a] = Supernode::makeSupernode(*supernodes[a]);
-      }
+    // nodes without supernodes are backed up by boruvka_emulation
+    if (make_copy && copy_in_mem && supernodes[a] != nullptr) { // make a copy of a
+      copy_supernodes[a] = Supernode::makeSupernode(*supernodes[a], copy_arena->slot(a));
+    }
 
-      // perform merging of nodes b into node a
-      for (node_id_t b : to_merge[a]) {
-        supernodes[a]->merge(*supernodes[b]);
+    // nodes holding their edges explicitly stay so while they have few enough
+    if (supernodes[a] == nullptr && merge_exact(a, to_merge[a])) return;
+
+    // perform merging of nodes b into node a
+    Supernode *supernode = supernodes[a] == nullptr ? promote(a) : supernodes[a];
+    for (node_id_t b : to_merge[a]) {
+      if (supernodes[b] != nullptr) {
+        supernode->merge(*supernodes[b]);
+      } else if (exact_size != nullptr) {
+        for (node_id_t k = 0; k < exact_size[b]; ++k) supernode->update(get_exact(b)[k]);
       }
-    } catch (...) {
-      except = true;
-      err = std::current_exception();
     }
-  }
+  });
+}
 
-  // Did one of our threads produce an exception?
-  if (except) std::rethrow_exception(err);
+template <class SamplerT>
+size_t GraphT<SamplerT>::get_supernode_bytes() const {
+  size_t bytes = 0;
+  for (node_id_t i = 0; i < num_nodes; ++i)
+    if (supernodes[i] != nullptr) bytes += supernodes[i]->get_bytes();
+  return bytes;
 }
 
-std::vector<std::set<node_id_t>> Graph::boruvka_emulation(bool make_copy) {
-  printf("Total number of updates to sketches before CC %lu\n", num_updates.load()); // REMOVE this later
+template <class SamplerT>
+std::vector<std::set<node_id_t>> GraphT<SamplerT>::boruvka_emulation(bool make_copy) {
   update_locked = true; // disallow updating the graph after we run the alg
 
   cc_alg_start = std::chrono::steady_clock::now();
   bool first_round = true;
-  Supernode** copy_supernodes;
-  if (make_copy && copy_in_mem) 
+  Supernode** copy_supernodes = nullptr;
+  SupernodeArena* copy_arena = nullptr;
+  if (make_copy && copy_in_mem) {
+    // only the pages of the supernodes copied are ever touched
     copy_supernodes = new Supernode*[num_nodes];
+    copy_arena = new SupernodeArena(Supernode::get_size(), num_nodes,
+                                    !Supernode::adaptive_rows());
+  }
   std::pair<Edge, SampleSketchRet> query[num_nodes];
-  std::vector<node_id_t> reps(num_nodes);
+  std::vector<node_id_t> reps;
   std::vector<node_id_t> backed_up;
+  // the explicit edges of the nodes without supernodes backed up
+  std::vector<std::pair<node_id_t, std::vector<vec_t>>> exact_backed_up;
   std::fill(size, size + num_nodes, 1);
   for (node_id_t i = 0; i < num_nodes; ++i) {
-    reps[i] = i;
+    // nodes without edges are singleton components, don't sample them
+    if (supernodes[i] != nullptr || (exact_size != nullptr && exact_size[i] > 0)) {
+      reps.push_back(i);
+    } else {
+#ifdef VERIFY_SAMPLES_F
+      verifier->verify_cc(i);
+#endif
+    }
     if (make_copy && copy_in_mem) 
       copy_supernodes[i] = nullptr;
   }
 
   // function to restore supernodes after CC if make_copy is specified
-  auto cleanup_copy = [&make_copy, this, &backed_up, &copy_supernodes]() {
+  auto cleanup_copy = [&make_copy, this, &backed_up, &exact_backed_up, &copy_supernodes,
+                       &copy_arena]() {
     if (make_copy) {
+      for (const auto &backup : exact_backed_up)
+        restore_exact(backup.first, backup.second);
       if(copy_in_mem) {
-        // restore original supernodes and free memory
+        // copy the original supernodes back into the arena and free memory
         for (node_id_t i : backed_up) {
-          if (supernodes[i] != nullptr) free(supernodes[i]);
-          supernodes[i] = copy_supernodes[i];
+          if (copy_supernodes[i] != nullptr)
+            Supernode::makeSupernode(*copy_supernodes[i], supernodes[i]);
         }
+        delete copy_arena;
         delete[] copy_supernodes;
       } else {
         restore_from_disk(backed_up);
@@ -263,18 +736,32 @@ std::vector<std::set<node_id_t>> Graph::boruvka_emulation(bool make_copy) {
     }
   };
 
+  // every edge sampled from each supernode, only with sample_all
+  std::vector<std::vector<Edge>> samples(sample_all ? num_nodes : 0);
+  std::vector<Edge> *samples_ptr = sample_all ? samples.data() : nullptr;
+  num_rounds = 0;
+
   try {
     do {
       modified = false;
-      sample_supernodes(query, reps);
-      std::vector<std::vector<node_id_t>> to_merge = supernodes_to_merge(query, reps);
+      ++num_rounds;
+      sample_supernodes(query, reps, samples_ptr);
+      std::vector<std::vector<node_id_t>> to_merge = supernodes_to_merge(query, reps, samples_ptr);
       // make a copy if necessary
       if (make_copy && first_round) {
-        backed_up = reps;
+        for (node_id_t i : reps) {
+          if (supernodes[i] != nullptr) {
+            backed_up.push_back(i);
+          } else {
+            vec_t *edges = exact_size == nullptr ? nullptr : get_exact(i);
+            size_t num = exact_size == nullptr ? 0 : exact_size[i];
+            exact_backed_up.emplace_back(i, std::vector<vec_t>(edges, edges + num));
+          }
+        }
         if (!copy_in_mem) backup_to_disk(backed_up);
       }
 
-      merge_supernodes(copy_supernodes, reps, to_merge, first_round && make_copy);
+      merge_supernodes(copy_supernodes, reps, copy_arena, to_merge, first_round && make_copy);
 
 #ifdef VERIFY_SAMPLES_F
       if (!first_round && fail_round_2) throw OutOfQueriesException();
@@ -286,6 +773,7 @@ std::vector<std::set<node_id_t>> Graph::boruvka_emulation(bool make_copy) {
     std::rethrow_exception(std::current_exception());
   }
 
+
   // calculate connected components using DSU structure
   std::map<node_id_t, std::set<node_id_t>> temp;
   for (node_id_t i = 0; i < num_nodes; ++i)
@@ -300,7 +788,8 @@ std::vector<std::set<node_id_t>> Graph::boruvka_emulation(bool make_copy) {
   return retval;
 }
 
-void Graph::backup_to_disk(const std::vector<node_id_t>& ids_to_backup) {
+template <class SamplerT>
+void GraphT<SamplerT>::backup_to_disk(const std::vector<node_id_t>& ids_to_backup) {
   // Make a copy on disk
   std::fstream binary_out(backup_file, std::ios::out | std::ios::binary);
   if (!binary_out.is_open()) {
@@ -315,7 +804,8 @@ void Graph::backup_to_disk(const std::vector<node_id_t>& ids_to_backup) {
 
 // given a list of ids restore those supernodes from disk
 // IMPORTANT: ids_to_restore must be the same as ids_to_backup
-void Graph::restore_from_disk(const std::vector<node_id_t>& ids_to_restore) {
+template <class SamplerT>
+void GraphT<SamplerT>::restore_from_disk(const std::vector<node_id_t>& ids_to_restore) {
   // restore from disk
   std::fstream binary_in(backup_file, std::ios::in | std::ios::binary);
   if (!binary_in.is_open()) {
@@ -323,15 +813,16 @@ void Graph::restore_from_disk(const std::vector<node_id_t>& ids_to_restore) {
     exit(EXIT_FAILURE);
   }
   for (node_id_t idx : ids_to_restore) {
-    free(this->supernodes[idx]);
-    this->supernodes[idx] = Supernode::makeSupernode(num_nodes, seed, binary_in);
+    Supernode::makeSupernode(num_nodes, seed, binary_in, supernodes[idx]);
   }
 }
 
-std::vector<std::set<node_id_t>> Graph::connected_components(bool cont) {
+template <class SamplerT>
+std::vector<std::set<node_id_t>> GraphT<SamplerT>::connected_components(bool cont) {
   flush_start = std::chrono::steady_clock::now();
   gts->force_flush(); // flush everything in guttering system to make final updates
   GraphWorker::pause_workers(); // wait for the workers to finish applying the updates
+  merge_partials();
   flush_end = std::chrono::steady_clock::now();
   // after this point all updates have been processed from the buffer tree
 
@@ -352,7 +843,7 @@ std::vector<std::set<node_id_t>> Graph::connected_components(bool cont) {
   // get ready for ingesting more from the stream
   // reset dsu and resume graph workers
   for (node_id_t i = 0; i < num_nodes; i++) {
-    supernodes[i]->reset_query_state();
+    if (supernodes[i] != nullptr) supernodes[i]->reset_query_state();
     parent[i] = i;
     size[i] = 1;
   }
@@ -365,23 +856,53 @@ std::vector<std::set<node_id_t>> Graph::connected_components(bool cont) {
   return ret;
 }
 
-node_id_t Graph::get_parent(node_id_t node) {
+template <class SamplerT>
+node_id_t GraphT<SamplerT>::get_parent(node_id_t node) {
   if (parent[node] == node) return node;
   return parent[node] = get_parent(parent[node]);
 }
 
-void Graph::write_binary(const std::string& filename) {
+template <class SamplerT>
+void GraphT<SamplerT>::write_binary(const std::string& filename) {
   gts->force_flush(); // flush everything in buffering system to make final updates
   GraphWorker::pause_workers(); // wait for the workers to finish applying the updates
+  merge_partials();
   // after this point all updates have been processed from the buffering system
 
   auto binary_out = std::fstream(filename, std::ios::out | std::ios::binary);
-  auto fail_factor = Sketch::get_failure_factor();
+  auto fail_factor = SamplerT::get_failure_factor();
+  uint32_t magic = checkpoint_magic, version = checkpoint_version;
+  binary_out.write((char*)&magic, sizeof(magic));
+  binary_out.write((char*)&version, sizeof(version));
+  CheckpointSettings settings = current_settings();
+  binary_out.write((char*)&settings, sizeof(settings));
   binary_out.write((char*)&seed, sizeof(seed));
   binary_out.write((char*)&num_nodes, sizeof(num_nodes));
   binary_out.write((char*)&fail_factor, sizeof(fail_factor));
+  // nodes never updated are skipped, the bitmap marks those written
+  std::vector<char> materialized((num_nodes + 7) / 8);
   for (node_id_t i = 0; i < num_nodes; ++i) {
-    supernodes[i]->write_binary(binary_out);
+    if (supernodes[i] != nullptr) materialized[i / 8] |= 1 << (i % 8);
+  }
+  binary_out.write(materialized.data(), materialized.size());
+  for (node_id_t i = 0; i < num_nodes; ++i) {
+    if (supernodes[i] != nullptr) supernodes[i]->write_binary(binary_out);
+  }
+  // followed by the nodes holding their edges explicitly
+  std::vector<node_id_t> exact_nodes;
+  for (node_id_t i = 0; exact_size != nullptr && i < num_nodes; ++i) {
+    if (supernodes[i] == nullptr && exact_size[i] > 0) exact_nodes.push_back(i);
+  }
+  node_id_t num_exact = exact_nodes.size();
+  binary_out.write((char*)&num_exact, sizeof(num_exact));
+  for (node_id_t i : exact_nodes) {
+    binary_out.write((char*)&i, sizeof(i));
+    binary_out.write((char*)&exact_size[i], sizeof(exact_size[i]));
+    binary_out.write((char*)get_exact(i), exact_size[i] * sizeof(vec_t));
   }
   binary_out.close();
 }
+
+// the samplers graphs may be built upon, see SupernodeT
+template class GraphT<Sketch>;
+template class GraphT<OneSparseSampler>;
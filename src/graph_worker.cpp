@@ -7,12 +7,20 @@
 
 #include <string>
 #include <iostream>
+#include <algorithm>
+#include <numeric>
 
-bool GraphWorker::shutdown = false;
-bool GraphWorker::paused   = false; // controls whether threads should pause or resume work
+std::atomic<bool> GraphWorker::shutdown{false};
+std::atomic<bool> GraphWorker::paused{false}; // controls whether threads should pause or resume work
 int GraphWorker::num_groups = 1;
-int GraphWorker::group_size = 1;
 long GraphWorker::supernode_size;
+bool GraphWorker::owner_computes = false;
+int GraphWorker::pack_size = 1;
+constexpr int GraphWorker::shards_per_worker;
+std::vector<int> GraphWorker::shard_owner;
+std::atomic<uint64_t> GraphWorker::num_forwarded;
+size_t GraphWorker::mail_capacity = 256;
+std::atomic<size_t> GraphWorker::max_mail;
 GraphWorker **GraphWorker::workers;
 std::condition_variable GraphWorker::pause_condition;
 std::mutex GraphWorker::pause_lock;
@@ -23,10 +31,16 @@ std::mutex GraphWorker::pause_lock;
 /* These functions are used by the rest of the
  * code to manipulate the GraphWorkers as a whole
  */
-void GraphWorker::start_workers(Graph *_graph, GutteringSystem *_gts, long _supernode_size) {
+void GraphWorker::start_workers(GraphBase *_graph, GutteringSystem *_gts, long _supernode_size) {
   shutdown = false;
   paused   = false;
   supernode_size = _supernode_size;
+  num_forwarded = 0;
+  max_mail = 0;
+
+  shard_owner.resize(num_groups * shards_per_worker);
+  for (size_t i = 0; i < shard_owner.size(); i++)
+    shard_owner[i] = i % num_groups;
 
   workers = (GraphWorker **) calloc(num_groups, sizeof(GraphWorker *));
   for (int i = 0; i < num_groups; i++) {
@@ -48,6 +62,26 @@ void GraphWorker::stop_workers() {
   free(workers);
 }
 
+void GraphWorker::balance_owners(const std::vector<node_id_t> &update_counts) {
+  if (!owner_computes) return;
+  std::vector<uint64_t> shard_load(shard_owner.size());
+  for (size_t i = 0; i < update_counts.size(); i++)
+    shard_load[i % shard_owner.size()] += update_counts[i];
+
+  // the heaviest remaining shard goes to the least loaded GraphWorker
+  std::vector<size_t> shards(shard_owner.size());
+  std::iota(shards.begin(), shards.end(), 0);
+  std::sort(shards.begin(), shards.end(), [&](size_t a, size_t b) {
+    return shard_load[a] > shard_load[b];
+  });
+  std::vector<uint64_t> worker_load(num_groups);
+  for (size_t shard : shards) {
+    int worker = std::min_element(worker_load.begin(), worker_load.end()) - worker_load.begin();
+    shard_owner[shard] = worker;
+    worker_load[worker] += shard_load[shard];
+  }
+}
+
 void GraphWorker::pause_workers() {
   paused = true;
   workers[0]->gts->set_non_block(true); // make the GraphWorkers bypass waiting in queue
@@ -57,7 +91,7 @@ void GraphWorker::pause_workers() {
     std::unique_lock<std::mutex> lk(pause_lock);
     pause_condition.wait_for(lk, std::chrono::milliseconds(500), []{
       for (int i = 0; i < num_groups; i++)
-        if (!workers[i]->get_thr_paused()) return false;
+        if (!workers[i]->get_thr_paused() || workers[i]->has_mail()) return false;
       return true;
     });
     
@@ -65,7 +99,7 @@ void GraphWorker::pause_workers() {
     // double check that we didn't get a spurious wake-up
     bool all_paused = true;
     for (int i = 0; i < num_groups; i++) {
-      if (!workers[i]->get_thr_paused()) {
+      if (!workers[i]->get_thr_paused() || workers[i]->has_mail()) {
         all_paused = false; // a worker still working so don't stop
         break;
       }
@@ -108,9 +142,11 @@ void GraphWorker::unpause_workers() {
 /***********************************************
  ************** GraphWorker class **************
  ***********************************************/
-GraphWorker::GraphWorker(int _id, Graph *_graph, GutteringSystem *_gts) :
- id(_id), graph(_graph), gts(_gts), thr(start_worker, this), thr_paused(false) {
-  delta_node = (Supernode *) malloc(supernode_size);
+GraphWorker::GraphWorker(int _id, GraphBase *_graph, GutteringSystem *_gts) :
+ id(_id), graph(_graph), gts(_gts), thr_paused(false) {
+  delta_node = malloc(supernode_size);
+  pack.resize(pack_size);
+  thr = std::thread(start_worker, this); // after the members it uses are ready
 }
 
 GraphWorker::~GraphWorker() {
@@ -119,26 +155,95 @@ GraphWorker::~GraphWorker() {
   free(delta_node);
 }
 
+void GraphWorker::forward(node_id_t node, const std::vector<node_id_t> &edges) {
+  GraphWorker *to = workers[owner(node)];
+  while (true) {
+    {
+      std::lock_guard<std::mutex> lk(to->mail_lock);
+      if (to->mail.size() < mail_capacity) {
+        to->mail.emplace_back(node, edges);
+        size_t len = to->mail.size();
+        size_t prev = max_mail;
+        while (len > prev && !max_mail.compare_exchange_weak(prev, len)) {}
+        break;
+      }
+    }
+    if (shutdown) return; // the owner has stopped, the batch is dropped with its mail
+    // the owner may in turn be waiting for room in our mailbox
+    if (!apply_mail()) std::this_thread::yield();
+  }
+  num_forwarded += edges.size();
+  // the owner may be paused and waiting for mail, see do_work
+  if (paused) {
+    std::lock_guard<std::mutex> lk(pause_lock);
+    pause_condition.notify_all();
+  }
+}
+
+bool GraphWorker::has_mail() {
+  std::lock_guard<std::mutex> lk(mail_lock);
+  return !mail.empty();
+}
+
+bool GraphWorker::apply_mail() {
+  std::unique_lock<std::mutex> lk(mail_lock);
+  if (mail.empty()) return false;
+  while (!mail.empty()) {
+    std::pair<node_id_t, std::vector<node_id_t>> batch = std::move(mail.front());
+    mail.pop_front();
+    lk.unlock();
+    graph->batch_update(batch.first, batch.second, delta_node);
+    lk.lock();
+  }
+  return true;
+}
+
+void GraphWorker::pack_batch(node_id_t node, const std::vector<node_id_t> &edges) {
+  pack[pack_len].first = node;
+  pack[pack_len].second.assign(edges.begin(), edges.end());
+  if (++pack_len == pack.size()) apply_pack();
+}
+
+void GraphWorker::apply_pack() {
+  if (pack_len == 0) return;
+  graph->batch_updates(pack.data(), pack_len, delta_node);
+  pack_len = 0;
+}
+
 void GraphWorker::do_work() {
   WorkQueue::DataNode *data;
   while(true) {
+    // the batches of owned nodes forwarded by the other GraphWorkers come first
+    if (owner_computes && apply_mail()) continue;
+
     // call get_data which will handle waiting on the queue
     // and will enforce locking.
     bool valid = gts->get_data(data);
 
     if (valid) {
-      graph->batch_update(data->get_node_idx(), data->get_data_vec(), delta_node);
+      node_id_t node = data->get_node_idx();
+      const std::vector<node_id_t> &edges = data->get_data_vec();
+      if (owner_computes && owner(node) != id)
+        forward(node, edges);
+      else if (pack_size > 1 && edges.size() < graph->get_in_place_threshold())
+        pack_batch(node, edges);
+      else
+        graph->batch_update(node, edges, delta_node);
       gts->get_data_callback(data); // inform guttering system that we're done
+      continue;
     }
-    else if(shutdown)
+    // the guttering system has no more batches for now, so don't hold the pack back
+    apply_pack();
+    if(shutdown)
       return;
     else if (paused) {
       std::unique_lock<std::mutex> lk(pause_lock);
+      if (owner_computes && has_mail()) continue; // forwarded while the queue emptied
       thr_paused = true; // this thread is currently paused
       pause_condition.notify_all(); // notify pause_workers()
 
-      // wait until we are unpaused
-      pause_condition.wait(lk, []{return !paused || shutdown;});
+      // wait until we are unpaused, or are forwarded a batch to apply first
+      pause_condition.wait(lk, [this]{return !paused || shutdown || has_mail();});
       thr_paused = false; // no longer paused
       lk.unlock();
       pause_condition.notify_all(); // notify unpause_workers()
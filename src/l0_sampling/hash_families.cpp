@@ -0,0 +1,218 @@
+#include "../../include/l0_sampling/hash_families.h"
+#include "../../include/l0_sampling/sketch_kernels.h"
+#include <atomic>
+#include <mutex>
+
+namespace {
+// generates the random values of MultiplyShiftHash and TabulationHash from a seed
+inline uint64_t splitmix64(uint64_t &state) {
+  uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
+
+/*
+ * The Keys of every sketch seed. Keys are built under a lock, when a sketch is
+ * created, and are then found without one: each slot is a list that only grows at its
+ * head, so a reader sees either the old or the new head. Keys are freed by release,
+ * once no sketch of their seed is in use (see Sketch::release_hash_keys), or with the
+ * registry.
+ */
+template <class Keys>
+class KeyRegistry {
+  struct Node {
+    uint64_t seed;
+    size_t num_cols;
+    Keys keys;
+    Node *next;
+    Node(uint64_t seed, size_t num_cols, Node *next) :
+      seed(seed), num_cols(num_cols), keys(seed, num_cols), next(next) {}
+  };
+  static constexpr size_t num_slots = 1 << 12;
+  std::atomic<Node *> slots[num_slots] = {};
+  std::mutex build_lock;
+  std::atomic<size_t> num_nodes{0};
+
+  static const Node *find(const Node *head, uint64_t seed, size_t num_cols) {
+    for (const Node *node = head; node != nullptr; node = node->next)
+      if (node->seed == seed && node->num_cols >= num_cols) return node;
+    return nullptr;
+  }
+
+  // the seeds of the sketches of a supernode are consecutive multiples of its width
+  std::atomic<Node *> &slot_of(uint64_t seed) {
+    return slots[(seed * 0x9E3779B97F4A7C15ULL) >> 52];
+  }
+
+public:
+  ~KeyRegistry() {
+    for (auto &slot : slots) {
+      Node *node = slot.load();
+      while (node != nullptr) {
+        Node *next = node->next;
+        delete node;
+        node = next;
+      }
+    }
+  }
+
+  const Keys &get(uint64_t seed, size_t num_cols) {
+    std::atomic<Node *> &slot = slot_of(seed);
+    const Node *node = find(slot.load(std::memory_order_acquire), seed, num_cols);
+    if (node != nullptr) return node->keys;
+
+    std::lock_guard<std::mutex> lk(build_lock);
+    Node *head = slot.load(std::memory_order_relaxed);
+    node = find(head, seed, num_cols);
+    if (node == nullptr) {
+      Node *built = new Node(seed, num_cols, head);
+      slot.store(built, std::memory_order_release);
+      ++num_nodes;
+      node = built;
+    }
+    return node->keys;
+  }
+
+  // free the Keys of seed. No sketch may be in use while they are, as the lists are
+  // unlinked under readers
+  void release(uint64_t seed) {
+    std::lock_guard<std::mutex> lk(build_lock);
+    std::atomic<Node *> &slot = slot_of(seed);
+    Node *prev = nullptr;
+    Node *node = slot.load(std::memory_order_relaxed);
+    while (node != nullptr) {
+      Node *next = node->next;
+      if (node->seed == seed) {
+        if (prev == nullptr) slot.store(next, std::memory_order_release);
+        else prev->next = next;
+        delete node;
+        --num_nodes;
+      } else {
+        prev = node;
+      }
+      node = next;
+    }
+  }
+
+  size_t size() const { return num_nodes; }
+};
+} // namespace
+
+const char *hash_family_name(HashFamily family) {
+  switch (family) {
+    case XXH3_HASH:           return "xxh3";
+    case MULTIPLY_SHIFT_HASH: return "multiply_shift";
+    case TABULATION_HASH:     return "tabulation";
+    default:                  return "xxh64";
+  }
+}
+
+void XXH64Hash::col_hash_batch(const Keys &k, const vec_t *idx, size_t num, unsigned col,
+                               col_hash_t *out) {
+  SketchKernels::col_index_hash_batch(idx, num, k.seed + col, out);
+}
+
+void XXH64Hash::checksum_batch(const Keys &k, const vec_t *idx, size_t num, vec_hash_t *out) {
+  SketchKernels::index_hash_batch(idx, num, k.seed, out);
+}
+
+void XXH3Hash::col_hash_batch(const Keys &k, const vec_t *idx, size_t num, unsigned col,
+                              col_hash_t *out) {
+  for (size_t i = 0; i < num; ++i)
+    out[i] = col_hash(k, idx[i], col);
+}
+
+void XXH3Hash::checksum_batch(const Keys &k, const vec_t *idx, size_t num, vec_hash_t *out) {
+  for (size_t i = 0; i < num; ++i)
+    out[i] = checksum(k, idx[i]);
+}
+
+MultiplyShiftHash::Params::Params(uint64_t seed) {
+  a_lo = splitmix64(seed) | 1;
+  a_hi = splitmix64(seed);
+  b_lo = splitmix64(seed);
+  b_hi = splitmix64(seed);
+}
+
+MultiplyShiftHash::Keys::Keys(uint64_t seed, size_t num_cols) : check(~seed) {
+  cols.reserve(num_cols);
+  for (size_t i = 0; i < num_cols; ++i)
+    cols.emplace_back(seed + i);
+}
+
+namespace {
+KeyRegistry<MultiplyShiftHash::Keys> &multiply_shift_keys() {
+  static KeyRegistry<MultiplyShiftHash::Keys> registry;
+  return registry;
+}
+} // namespace
+
+const MultiplyShiftHash::Keys &MultiplyShiftHash::keys(uint64_t seed, size_t num_cols) {
+  return multiply_shift_keys().get(seed, num_cols);
+}
+
+void MultiplyShiftHash::release_keys(uint64_t seed) {
+  multiply_shift_keys().release(seed);
+}
+
+size_t MultiplyShiftHash::num_keys() {
+  return multiply_shift_keys().size();
+}
+
+void MultiplyShiftHash::col_hash_batch(const Keys &k, const vec_t *idx, size_t num,
+                                       unsigned col, col_hash_t *out) {
+  const Params &h = k.cols[col];
+  for (size_t i = 0; i < num; ++i)
+    out[i] = h(idx[i]);
+}
+
+void MultiplyShiftHash::checksum_batch(const Keys &k, const vec_t *idx, size_t num,
+                                       vec_hash_t *out) {
+  for (size_t i = 0; i < num; ++i)
+    out[i] = k.check(idx[i]) >> 32;
+}
+
+void TabulationHash::fill_tables(Tables &t, uint64_t seed) {
+  for (size_t i = 0; i < sizeof(vec_t); ++i)
+    for (size_t j = 0; j < 256; ++j)
+      t[i][j] = splitmix64(seed);
+}
+
+TabulationHash::Keys::Keys(uint64_t seed, size_t num_cols) : cols(new Tables[num_cols]) {
+  for (size_t i = 0; i < num_cols; ++i)
+    fill_tables(cols[i], seed + i);
+  fill_tables(check, ~seed);
+}
+
+namespace {
+KeyRegistry<TabulationHash::Keys> &tabulation_keys() {
+  static KeyRegistry<TabulationHash::Keys> registry;
+  return registry;
+}
+} // namespace
+
+const TabulationHash::Keys &TabulationHash::keys(uint64_t seed, size_t num_cols) {
+  return tabulation_keys().get(seed, num_cols);
+}
+
+void TabulationHash::release_keys(uint64_t seed) {
+  tabulation_keys().release(seed);
+}
+
+size_t TabulationHash::num_keys() {
+  return tabulation_keys().size();
+}
+
+void TabulationHash::col_hash_batch(const Keys &k, const vec_t *idx, size_t num, unsigned col,
+                                    col_hash_t *out) {
+  const Tables &t = k.cols[col];
+  for (size_t i = 0; i < num; ++i)
+    out[i] = hash(t, idx[i]);
+}
+
+void TabulationHash::checksum_batch(const Keys &k, const vec_t *idx, size_t num,
+                                    vec_hash_t *out) {
+  for (size_t i = 0; i < num; ++i)
+    out[i] = hash(k.check, idx[i]) >> 32;
+}
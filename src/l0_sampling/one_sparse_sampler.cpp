@@ -0,0 +1,49 @@
+#include "../../include/l0_sampling/one_sparse_sampler.h"
+#include <cassert>
+
+vec_t OneSparseSampler::failure_factor = 100;
+
+OneSparseSampler::OneSparseSampler(uint64_t seed, std::istream &binary_in) : seed(seed) {
+  binary_in.read((char*)&a, sizeof(a));
+  binary_in.read((char*)&c, sizeof(c));
+}
+
+OneSparseSampler* OneSparseSampler::makeSketch(void* loc, uint64_t seed) {
+  return new (loc) OneSparseSampler(seed);
+}
+
+OneSparseSampler* OneSparseSampler::makeSketch(void* loc, uint64_t seed, std::istream &binary_in) {
+  return new (loc) OneSparseSampler(seed, binary_in);
+}
+
+OneSparseSampler* OneSparseSampler::makeSketch(void* loc, const OneSparseSampler& s) {
+  return new (loc) OneSparseSampler(s);
+}
+
+void OneSparseSampler::update(vec_t update_idx) {
+  Bucket_Boruvka::update(a, c, update_idx, Bucket_Boruvka::index_hash(update_idx, seed));
+}
+
+void OneSparseSampler::batch_update(const std::vector<vec_t>& updates) {
+  for (vec_t update_idx : updates) update(update_idx);
+}
+
+std::pair<vec_t, SampleSketchRet> OneSparseSampler::query() {
+  if (already_queried) throw MultipleQueryException();
+  already_queried = true;
+  if (a == 0 && c == 0) return {0, ZERO};
+  if (Bucket_Boruvka::is_good(a, c, seed)) return {a, GOOD};
+  return {0, FAIL};
+}
+
+OneSparseSampler &operator+= (OneSparseSampler &s1, const OneSparseSampler &s2) {
+  assert(s1.seed == s2.seed);
+  s1.a ^= s2.a;
+  s1.c ^= s2.c;
+  return s1;
+}
+
+void OneSparseSampler::write_binary(std::ostream& binary_out) {
+  binary_out.write((char*)&a, sizeof(a));
+  binary_out.write((char*)&c, sizeof(c));
+}
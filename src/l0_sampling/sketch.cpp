@@ -1,4 +1,6 @@
 #include "../../include/l0_sampling/sketch.h"
+#include "../../include/l0_sampling/sketch_kernels.h"
+#include <algorithm>
 #include <cassert>
 #include <cstring>
 #include <iostream>
@@ -8,141 +10,832 @@ vec_t Sketch::n;
 size_t Sketch::num_elems;
 size_t Sketch::num_buckets;
 size_t Sketch::num_guesses;
+SketchLayout Sketch::layout = COLUMN_MAJOR;
+SketchHashing Sketch::hashing = COLUMN_HASHING;
+HashFamily Sketch::hash_family = XXH64_HASH;
+size_t Sketch::suffix_xor_threshold = 64;
+SketchGeometry Sketch::geometry = EXACT_GEOMETRY;
+bool Sketch::adaptive_depth = false;
+constexpr size_t Sketch::class_guesses[];
 
 /*
  * Static functions for creating sketches with a provided memory location.
  * We use these in the production system to keep supernodes virtually contiguous.
  */
 Sketch* Sketch::makeSketch(void* loc, uint64_t seed) {
-  return new (loc) Sketch(seed);
+  return new (loc) Sketch(seed, num_guesses);
+}
+
+Sketch* Sketch::makeSketch(void* loc, uint64_t seed, size_t rows) {
+  return new (loc) Sketch(seed, rows);
 }
 
 Sketch* Sketch::makeSketch(void* loc, uint64_t seed, std::istream &binary_in) {
   return new (loc) Sketch(seed, binary_in);
 }
 
+Sketch* Sketch::makeZeroedSketch(void* loc, uint64_t seed) {
+  return new (loc) Sketch(seed, num_guesses, false);
+}
+
+Sketch* Sketch::makeZeroedSketch(void* loc, uint64_t seed, size_t rows) {
+  return new (loc) Sketch(seed, rows, false);
+}
+
 Sketch* Sketch::makeSketch(void* loc, const Sketch& s) {
   return new (loc) Sketch(s);
 }
 
-Sketch::Sketch(uint64_t seed): seed(seed) {
-  // establish the bucket_a and bucket_c locations
-  bucket_a = reinterpret_cast<vec_t*>(buckets);
-  bucket_c = reinterpret_cast<vec_hash_t*>(buckets + num_elems * sizeof(vec_t));
+/*
+ * The number of columns (buckets) and guesses of a sketch. The kernels are
+ * compiled for the FixedGeometry classes (see SketchGeometry) so that their
+ * loops have constant trip counts, and for the DynamicGeometry fallback.
+ */
+struct Sketch::DynamicGeometry {
+  static inline size_t buckets() { return num_buckets; }
+  static inline size_t guesses() { return num_guesses; }
+  static inline size_t elems() { return num_elems; }
+};
+
+template <size_t Buckets, size_t Guesses>
+struct Sketch::FixedGeometry {
+  static constexpr size_t buckets() { return Buckets; }
+  static constexpr size_t guesses() { return Guesses; }
+  static constexpr size_t elems() { return Buckets * Guesses + 1; }
+};
+
+/*
+ * Addressing of the buckets for each SketchLayout. A bucket is identified by its
+ * position in the layout; pos() maps a (column, depth) pair to a position and
+ * det() gives the position of the deterministic bucket.
+ */
+template <class Geometry>
+struct Sketch::ColumnMajor : Geometry {
+  static inline size_t pos(size_t col, size_t depth) { return col * Geometry::guesses() + depth; }
+  static inline size_t det() { return Geometry::elems() - 1; }
+  static inline size_t depth_step() { return 1; }
+  // every depth is held, adaptive depth requires the DEPTH_MAJOR layout
+  static inline size_t rows(const Sketch &) { return Geometry::guesses(); }
 
-  // initialize bucket values
-  for (size_t i = 0; i < num_elems; ++i) {
-    bucket_a[i] = 0;
-    bucket_c[i] = 0;
+  // the a values of every bucket are followed by the c values
+  static inline const vec_t *bucket_a(const Sketch &s) {
+    return reinterpret_cast<const vec_t*>(s.buckets);
+  }
+  static inline const vec_hash_t *bucket_c(const Sketch &s) {
+    return reinterpret_cast<const vec_hash_t*>(s.buckets + Geometry::elems() * sizeof(vec_t));
+  }
+
+  static inline vec_t get_a(const Sketch &s, size_t pos) { return bucket_a(s)[pos]; }
+  static inline vec_hash_t get_c(const Sketch &s, size_t pos) { return bucket_c(s)[pos]; }
+  static inline void update(Sketch &s, size_t pos, vec_t idx, vec_hash_t hash) {
+    Bucket_Boruvka::update(const_cast<vec_t*>(bucket_a(s))[pos],
+                           const_cast<vec_hash_t*>(bucket_c(s))[pos], idx, hash);
+  }
+};
+
+template <class Geometry>
+struct Sketch::DepthMajor : Geometry {
+  // a and c of a bucket are stored together, the deterministic bucket leads the depth 0 row
+  static constexpr size_t bucket_bytes = sizeof(vec_t) + sizeof(vec_hash_t);
+  static inline size_t pos(size_t col, size_t depth) { return 1 + depth * Geometry::buckets() + col; }
+  static inline size_t det() { return 0; }
+  static inline size_t depth_step() { return Geometry::buckets(); }
+  // the depths held, see set_adaptive_depth
+  static inline size_t rows(const Sketch &s) { return adaptive_depth ? s.rows : Geometry::guesses(); }
+
+  // memcpy because packed buckets leave every other a value unaligned
+  static inline vec_t get_a(const Sketch &s, size_t pos) {
+    vec_t a;
+    std::memcpy(&a, s.buckets + pos * bucket_bytes, sizeof(vec_t));
+    return a;
+  }
+  static inline vec_hash_t get_c(const Sketch &s, size_t pos) {
+    vec_hash_t c;
+    std::memcpy(&c, s.buckets + pos * bucket_bytes + sizeof(vec_t), sizeof(vec_hash_t));
+    return c;
+  }
+  static inline void update(Sketch &s, size_t pos, vec_t idx, vec_hash_t hash) {
+    vec_t a = get_a(s, pos) ^ idx;
+    vec_hash_t c = get_c(s, pos) ^ hash;
+    std::memcpy(s.buckets + pos * bucket_bytes, &a, sizeof(vec_t));
+    std::memcpy(s.buckets + pos * bucket_bytes + sizeof(vec_t), &c, sizeof(vec_hash_t));
+  }
+};
+
+template <class F>
+void Sketch::with_hash_family(F&& f) {
+  switch (hash_family) {
+    case XXH3_HASH:           f(XXH3Hash()); break;
+    case MULTIPLY_SHIFT_HASH: f(MultiplyShiftHash()); break;
+    case TABULATION_HASH:     f(TabulationHash()); break;
+    default:                  f(XXH64Hash()); break;
   }
 }
 
-Sketch::Sketch(uint64_t seed, std::istream &binary_in): seed(seed) {
-  // establish the bucket_a and bucket_c locations
-  bucket_a = reinterpret_cast<vec_t*>(buckets);
-  bucket_c = reinterpret_cast<vec_hash_t*>(buckets + num_elems * sizeof(vec_t));
+template <class Geometry, class F>
+void Sketch::with_layout_geometry(F&& f) {
+  if (layout == DEPTH_MAJOR) f(DepthMajor<Geometry>());
+  else f(ColumnMajor<Geometry>());
+}
 
-  binary_in.read((char*)bucket_a, num_elems * sizeof(vec_t));
-  binary_in.read((char*)bucket_c, num_elems * sizeof(vec_hash_t));
+template <class F>
+void Sketch::with_layout(F&& f) {
+  if (geometry != DYNAMIC_GEOMETRY && num_buckets == class_buckets) {
+    switch (num_guesses) {
+      case class_guesses[0]: return with_layout_geometry<FixedGeometry<class_buckets, class_guesses[0]>>(f);
+      case class_guesses[1]: return with_layout_geometry<FixedGeometry<class_buckets, class_guesses[1]>>(f);
+      case class_guesses[2]: return with_layout_geometry<FixedGeometry<class_buckets, class_guesses[2]>>(f);
+      case class_guesses[3]: return with_layout_geometry<FixedGeometry<class_buckets, class_guesses[3]>>(f);
+    }
+  }
+  with_layout_geometry<DynamicGeometry>(f);
 }
 
-Sketch::Sketch(const Sketch& s) : seed(s.seed) {
-  bucket_a = reinterpret_cast<vec_t*>(buckets);
-  bucket_c = reinterpret_cast<vec_hash_t*>(buckets + num_elems * sizeof(vec_t));
+bool Sketch::uses_fixed_geometry() {
+  if (geometry == DYNAMIC_GEOMETRY || num_buckets != class_buckets) return false;
+  return std::find(std::begin(class_guesses), std::end(class_guesses), num_guesses)
+         != std::end(class_guesses);
+}
 
-  std::memcpy(bucket_a, s.bucket_a, num_elems * sizeof(vec_t));
-  std::memcpy(bucket_c, s.bucket_c, num_elems * sizeof(vec_hash_t));
+Sketch::Sketch(uint64_t seed, size_t rows, bool zero_buckets): seed(seed), rows(rows) {
+  assert(rows == num_guesses || layout == DEPTH_MAJOR);
+  build_hash_keys(seed);
+  // initialize bucket values, both layouts occupy the same contiguous region
+  if (zero_buckets)
+    std::memset(buckets, 0, bucket_bytes(rows));
 }
 
-void Sketch::update(const vec_t& update_idx) {
-  vec_hash_t update_hash = Bucket_Boruvka::index_hash(update_idx, seed);
-  Bucket_Boruvka::update(bucket_a[num_elems - 1], bucket_c[num_elems - 1], update_idx, update_hash);
-  for (unsigned i = 0; i < num_buckets; ++i) {
-    col_hash_t col_index_hash = Bucket_Boruvka::col_index_hash(update_idx, seed + i);
-    for (unsigned j = 0; j < num_guesses; ++j) {
-      unsigned bucket_id = i * num_guesses + j;
-      if (Bucket_Boruvka::contains(col_index_hash, ((col_hash_t)1) << j)){
-        Bucket_Boruvka::update(bucket_a[bucket_id], bucket_c[bucket_id], update_idx, update_hash);
-      } else break;
+Sketch::Sketch(uint64_t seed, std::istream &binary_in): seed(seed), rows(num_guesses) {
+  build_hash_keys(seed);
+  binary_in.read((char*)bucket_a(), num_elems * sizeof(vec_t));
+  binary_in.read((char*)bucket_c(), num_elems * sizeof(vec_hash_t));
+  if (layout == DEPTH_MAJOR) {
+    // the serialized form is column major so rearrange the buckets
+    using Depth = DepthMajor<DynamicGeometry>;
+    std::vector<char> col_major(buckets, buckets + num_elems * Depth::bucket_bytes);
+    const vec_t* in_a = reinterpret_cast<const vec_t*>(col_major.data());
+    const vec_hash_t* in_c = reinterpret_cast<const vec_hash_t*>(col_major.data() + num_elems * sizeof(vec_t));
+    std::memset(buckets, 0, num_elems * Depth::bucket_bytes);
+    for (size_t i = 0; i < num_elems; ++i) {
+      Depth::update(*this, col_major_to_depth_major(i), in_a[i], in_c[i]);
     }
   }
 }
 
-void Sketch::batch_update(const std::vector<vec_t>& updates) {
-  for (const auto& update_idx : updates) {
-    update(update_idx);
+void Sketch::build_hash_keys(uint64_t seed) {
+  if (hashing == WIDE_HASHING) return;
+  with_hash_family([&](auto hash) {
+    decltype(hash)::keys(seed, num_buckets);
+  });
+}
+
+void Sketch::release_hash_keys(uint64_t seed) {
+  // the family may have changed since the keys were built
+  MultiplyShiftHash::release_keys(seed);
+  TabulationHash::release_keys(seed);
+}
+
+size_t Sketch::num_hash_keys() {
+  return MultiplyShiftHash::num_keys() + TabulationHash::num_keys();
+}
+
+Sketch::Sketch(const Sketch& s) : seed(s.seed), rows(s.rows) {
+  std::memcpy(buckets, s.buckets, bucket_bytes(rows));
+}
+
+size_t Sketch::col_major_to_depth_major(size_t col_major_pos) {
+  using Depth = DepthMajor<DynamicGeometry>;
+  if (col_major_pos == ColumnMajor<DynamicGeometry>::det()) return Depth::det();
+  return Depth::pos(col_major_pos / num_guesses, col_major_pos % num_guesses);
+}
+
+vec_t Sketch::get_bucket_a(size_t col_major_pos) const {
+  if (layout == DEPTH_MAJOR) {
+    // the depths not held are empty
+    size_t pos = col_major_to_depth_major(col_major_pos);
+    return pos < rows * num_buckets + 1 ? DepthMajor<DynamicGeometry>::get_a(*this, pos) : 0;
   }
+  return ColumnMajor<DynamicGeometry>::get_a(*this, col_major_pos);
 }
 
-std::pair<vec_t, SampleSketchRet> Sketch::query() {
-  if (already_queried) {
-    throw MultipleQueryException();
+vec_hash_t Sketch::get_bucket_c(size_t col_major_pos) const {
+  if (layout == DEPTH_MAJOR) {
+    size_t pos = col_major_to_depth_major(col_major_pos);
+    return pos < rows * num_buckets + 1 ? DepthMajor<DynamicGeometry>::get_c(*this, pos) : 0;
   }
-  already_queried = true;
+  return ColumnMajor<DynamicGeometry>::get_c(*this, col_major_pos);
+}
+
+size_t Sketch::used_rows() const {
+  if (layout != DEPTH_MAJOR) return rows;
+  // the rows of depths follow the deterministic bucket
+  size_t row_bytes = num_buckets * DepthMajor<DynamicGeometry>::bucket_bytes;
+  const char *first_row = buckets + DepthMajor<DynamicGeometry>::bucket_bytes;
+  size_t used = rows;
+  while (used > 0 && std::all_of(first_row + (used - 1) * row_bytes, first_row + used * row_bytes,
+                                 [](char b) { return b == 0; }))
+    --used;
+  return used;
+}
+
+size_t Sketch::hashed_rows(const char* hashes, size_t num, size_t stride) {
+  uint8_t depth = 0;
+  for (size_t k = 0; k < num; ++k) {
+    const uint8_t* depths = reinterpret_cast<const uint8_t*>(hashes + k * stride + sizeof(vec_hash_t));
+    for (size_t i = 0; i < num_buckets; ++i) depth = std::max(depth, depths[i]);
+  }
+  return depth;
+}
+
+void Sketch::resize_sketches(Sketch* sketches, size_t num, size_t rows) {
+  size_t old_rows = sketches->rows;
+  if (num == 0 || rows == old_rows) return;
+  assert(layout == DEPTH_MAJOR && rows <= num_guesses);
+  char *base = reinterpret_cast<char *>(sketches);
+  size_t old_size = sketchSizeof(old_rows);
+  size_t new_size = sketchSizeof(rows);
+  size_t kept = offsetof(Sketch, buckets) + bucket_bytes(std::min(old_rows, rows));
+  auto move = [&](size_t i) {
+    char *to = base + i * new_size;
+    std::memmove(to, base + i * old_size, kept);
+    if (rows > old_rows) std::memset(to + kept, 0, bucket_bytes(rows) - bucket_bytes(old_rows));
+    reinterpret_cast<Sketch *>(to)->rows = rows;
+  };
+  // a sketch only moves over the space of those that have already moved
+  if (rows > old_rows) {
+    for (size_t i = num; i-- > 0;) move(i);
+  } else {
+    for (size_t i = 0; i < num; ++i) move(i);
+  }
+}
+
+template <class Layout, class Hash>
+void Sketch::update_impl(const vec_t& update_idx) {
+  const auto &keys = Hash::keys(seed, num_buckets);
+  vec_hash_t update_hash = Hash::checksum(keys, update_idx);
+  Layout::update(*this, Layout::det(), update_idx, update_hash);
+  for (unsigned i = 0; i < Layout::buckets(); ++i) {
+    col_hash_t col_index_hash = Hash::col_hash(keys, update_idx, i);
+    unsigned depth = Bucket_Boruvka::get_depth(col_index_hash, Layout::guesses());
+    size_t bucket_id = Layout::pos(i, 0);
+    for (unsigned j = 0; j < depth; ++j, bucket_id += Layout::depth_step()) {
+      Layout::update(*this, bucket_id, update_idx, update_hash);
+    }
+  }
+}
+
+template <class Layout>
+void Sketch::xor_det(const vec_t* updates, const vec_hash_t* hashes, size_t num) {
+  vec_t acc_a = 0;
+  vec_hash_t acc_c = 0;
+  for (size_t k = 0; k < num; ++k) {
+    acc_a ^= updates[k];
+    acc_c ^= hashes[k];
+  }
+  Layout::update(*this, Layout::det(), acc_a, acc_c);
+}
+
+template <class Layout>
+void Sketch::suffix_xor_column(unsigned col, const vec_t* updates, const vec_hash_t* hashes,
+                               const uint8_t* depths, size_t depth_stride, size_t num) {
+  // depth is at most num_guesses < 64
+  vec_t acc_a[64 + 1] = {};
+  vec_hash_t acc_c[64 + 1] = {};
+  for (size_t k = 0; k < num; ++k) {
+    uint8_t depth = depths[k * depth_stride];
+    acc_a[depth] ^= updates[k];
+    acc_c[depth] ^= hashes[k];
+  }
+  vec_t suffix_a = 0;
+  vec_hash_t suffix_c = 0;
+  for (size_t j = Layout::rows(*this); j-- > 0;) {
+    suffix_a ^= acc_a[j + 1];
+    suffix_c ^= acc_c[j + 1];
+    Layout::update(*this, Layout::pos(col, j), suffix_a, suffix_c);
+  }
+}
+
+template <class Layout, class Hash>
+void Sketch::batch_update_impl(const std::vector<vec_t>& updates) {
+  const auto &keys = Hash::keys(seed, num_buckets);
+  if (updates.size() >= suffix_xor_threshold) {
+    thread_local std::vector<vec_hash_t> hashes;
+    thread_local std::vector<col_hash_t> col_hashes;
+    thread_local std::vector<uint8_t> depths;
+    size_t num = updates.size();
+    hashes.resize(num);
+    col_hashes.resize(num);
+    depths.resize(num);
+    Hash::checksum_batch(keys, updates.data(), num, hashes.data());
+    xor_det<Layout>(updates.data(), hashes.data(), num);
+    for (unsigned i = 0; i < Layout::buckets(); ++i) {
+      Hash::col_hash_batch(keys, updates.data(), num, i, col_hashes.data());
+      for (size_t k = 0; k < num; ++k)
+        depths[k] = Bucket_Boruvka::get_depth(col_hashes[k], Layout::guesses());
+      suffix_xor_column<Layout>(i, updates.data(), hashes.data(), depths.data(), 1, num);
+    }
+    return;
+  }
+
+  // hash the updates in chunks using the batched hash functions
+  vec_hash_t update_hashes[SketchKernels::batch_size];
+  col_hash_t col_hashes[SketchKernels::batch_size];
+  for (size_t base = 0; base < updates.size(); base += SketchKernels::batch_size) {
+    const vec_t* chunk = updates.data() + base;
+    size_t num = std::min(SketchKernels::batch_size, updates.size() - base);
+
+    Hash::checksum_batch(keys, chunk, num, update_hashes);
+    for (size_t k = 0; k < num; ++k) {
+      Layout::update(*this, Layout::det(), chunk[k], update_hashes[k]);
+    }
+    for (unsigned i = 0; i < Layout::buckets(); ++i) {
+      Hash::col_hash_batch(keys, chunk, num, i, col_hashes);
+      for (size_t k = 0; k < num; ++k) {
+        unsigned depth = Bucket_Boruvka::get_depth(col_hashes[k], Layout::guesses());
+        size_t bucket_id = Layout::pos(i, 0);
+        for (unsigned j = 0; j < depth; ++j, bucket_id += Layout::depth_step()) {
+          Layout::update(*this, bucket_id, chunk[k], update_hashes[k]);
+        }
+      }
+    }
+  }
+}
+
+template <class Layout>
+void Sketch::apply_hashed_impl(const vec_t* updates, size_t num, const char* hashes, size_t stride) {
+  if (num >= suffix_xor_threshold) {
+    thread_local std::vector<vec_hash_t> update_hashes;
+    update_hashes.resize(num);
+    for (size_t k = 0; k < num; ++k)
+      std::memcpy(&update_hashes[k], hashes + k * stride, sizeof(vec_hash_t));
+    xor_det<Layout>(updates, update_hashes.data(), num);
+    const uint8_t* depths = reinterpret_cast<const uint8_t*>(hashes + sizeof(vec_hash_t));
+    for (unsigned i = 0; i < Layout::buckets(); ++i)
+      suffix_xor_column<Layout>(i, updates, update_hashes.data(), depths + i, stride, num);
+    return;
+  }
+
+  for (size_t k = 0; k < num; ++k) {
+    const char* record = hashes + k * stride;
+    vec_hash_t update_hash;
+    std::memcpy(&update_hash, record, sizeof(vec_hash_t));
+    const uint8_t* depths = reinterpret_cast<const uint8_t*>(record + sizeof(vec_hash_t));
+
+    Layout::update(*this, Layout::det(), updates[k], update_hash);
+    for (unsigned i = 0; i < Layout::buckets(); ++i) {
+      size_t bucket_id = Layout::pos(i, 0);
+      for (unsigned j = 0; j < depths[i]; ++j, bucket_id += Layout::depth_step()) {
+        Layout::update(*this, bucket_id, updates[k], update_hash);
+      }
+    }
+  }
+}
+
+template <class Layout>
+void Sketch::apply_wide_impl(const vec_t* updates, const wide_hash_t* wide, size_t num) {
+  uint64_t checksum_key = Bucket_Boruvka::wide_key(Bucket_Boruvka::wide_checksum_seed(seed));
+  if (num >= suffix_xor_threshold) {
+    thread_local std::vector<vec_hash_t> hashes;
+    thread_local std::vector<col_hash_t> col_hashes;
+    thread_local std::vector<uint8_t> depths;
+    hashes.resize(num);
+    col_hashes.resize(num);
+    depths.resize(num);
+    SketchKernels::wide_col_index_hash_batch(wide, num, checksum_key, col_hashes.data());
+    for (size_t k = 0; k < num; ++k)
+      hashes[k] = col_hashes[k] >> 32;
+    xor_det<Layout>(updates, hashes.data(), num);
+    for (unsigned i = 0; i < Layout::buckets(); ++i) {
+      SketchKernels::wide_col_index_hash_batch(wide, num, Bucket_Boruvka::wide_key(seed + i),
+                                               col_hashes.data());
+      for (size_t k = 0; k < num; ++k)
+        depths[k] = Bucket_Boruvka::get_depth(col_hashes[k], Layout::guesses());
+      suffix_xor_column<Layout>(i, updates, hashes.data(), depths.data(), 1, num);
+    }
+    return;
+  }
+
+  vec_hash_t update_hashes[SketchKernels::batch_size];
+  col_hash_t col_hashes[SketchKernels::batch_size];
+  for (size_t base = 0; base < num; base += SketchKernels::batch_size) {
+    const vec_t* chunk = updates + base;
+    const wide_hash_t* chunk_wide = wide + base;
+    size_t chunk_num = std::min(SketchKernels::batch_size, num - base);
+
+    // wide_checksum is the high half of the expansion with the checksum key
+    SketchKernels::wide_col_index_hash_batch(chunk_wide, chunk_num, checksum_key, col_hashes);
+    for (size_t k = 0; k < chunk_num; ++k) {
+      update_hashes[k] = col_hashes[k] >> 32;
+      Layout::update(*this, Layout::det(), chunk[k], update_hashes[k]);
+    }
+    for (unsigned i = 0; i < Layout::buckets(); ++i) {
+      SketchKernels::wide_col_index_hash_batch(chunk_wide, chunk_num,
+                                               Bucket_Boruvka::wide_key(seed + i), col_hashes);
+      for (size_t k = 0; k < chunk_num; ++k) {
+        unsigned depth = Bucket_Boruvka::get_depth(col_hashes[k], Layout::guesses());
+        size_t bucket_id = Layout::pos(i, 0);
+        for (unsigned j = 0; j < depth; ++j, bucket_id += Layout::depth_step()) {
+          Layout::update(*this, bucket_id, chunk[k], update_hashes[k]);
+        }
+      }
+    }
+  }
+}
 
-  if (bucket_a[num_elems - 1] == 0 && bucket_c[num_elems - 1] == 0) {
+template <class Hash>
+bool Sketch::is_good(const HashKeys<Hash> &keys, vec_t a, vec_hash_t c) const {
+  if (hashing == WIDE_HASHING) {
+    uint64_t checksum_key = Bucket_Boruvka::wide_key(Bucket_Boruvka::wide_checksum_seed(seed));
+    return c == Bucket_Boruvka::wide_checksum(Bucket_Boruvka::wide_index_hash(a), checksum_key);
+  }
+  return c == Hash::checksum(keys, a);
+}
+
+template <class Hash>
+bool Sketch::is_good(const HashKeys<Hash> &keys, vec_t a, vec_hash_t c, unsigned bucket_col,
+                     col_hash_t guess_nonzero) const {
+  if (hashing == WIDE_HASHING) {
+    wide_hash_t wide = Bucket_Boruvka::wide_index_hash(a);
+    uint64_t checksum_key = Bucket_Boruvka::wide_key(Bucket_Boruvka::wide_checksum_seed(seed));
+    return c == Bucket_Boruvka::wide_checksum(wide, checksum_key)
+      && Bucket_Boruvka::contains(Bucket_Boruvka::wide_col_index_hash(wide,
+                                  Bucket_Boruvka::wide_key(seed + bucket_col)), guess_nonzero);
+  }
+  return c == Hash::checksum(keys, a)
+    && Bucket_Boruvka::contains(Hash::col_hash(keys, a, bucket_col), guess_nonzero);
+}
+
+template <class Hash>
+void Sketch::checksum_batch(const HashKeys<Hash> &keys, const vec_t* idx, size_t num,
+                            uint64_t seed, vec_hash_t* out) {
+  if (hashing == WIDE_HASHING) {
+    // wide_checksum is the high half of the expansion with the checksum key
+    uint64_t checksum_key = Bucket_Boruvka::wide_key(Bucket_Boruvka::wide_checksum_seed(seed));
+    wide_hash_t wide[SketchKernels::batch_size];
+    col_hash_t col_hashes[SketchKernels::batch_size];
+    for (size_t base = 0; base < num; base += SketchKernels::batch_size) {
+      size_t chunk_num = std::min(SketchKernels::batch_size, num - base);
+      for (size_t k = 0; k < chunk_num; ++k)
+        wide[k] = Bucket_Boruvka::wide_index_hash(idx[base + k]);
+      SketchKernels::wide_col_index_hash_batch(wide, chunk_num, checksum_key, col_hashes);
+      for (size_t k = 0; k < chunk_num; ++k)
+        out[base + k] = col_hashes[k] >> 32;
+    }
+    return;
+  }
+  Hash::checksum_batch(keys, idx, num, out);
+}
+
+template <class Layout, class Hash>
+std::pair<vec_t, SampleSketchRet> Sketch::query_impl() {
+  const auto &keys = Hash::keys(seed, num_buckets);
+  vec_t det_a = Layout::get_a(*this, Layout::det());
+  vec_hash_t det_c = Layout::get_c(*this, Layout::det());
+  if (det_a == 0 && det_c == 0) {
     return {0, ZERO}; // the "first" bucket is deterministic so if it is all zero then there are no edges to return
   }
-  if (Bucket_Boruvka::is_good(bucket_a[num_elems - 1], bucket_c[num_elems - 1], seed)) {
-    return {bucket_a[num_elems - 1], GOOD};
+  if (is_good<Hash>(keys, det_a, det_c)) {
+    return {det_a, GOOD};
   }
-  for (unsigned i = 0; i < num_buckets; ++i) {
-    for (unsigned j = 0; j < num_guesses; ++j) {
-      unsigned bucket_id = i * num_guesses + j;
-      if (Bucket_Boruvka::is_good(bucket_a[bucket_id], bucket_c[bucket_id], i, 1 << j, seed)) {
-        return {bucket_a[bucket_id], GOOD};
+  // the depths not held are empty, which can only be good if the checksum of 0 is 0
+  size_t held = Layout::rows(*this);
+  bool empty_good = held < Layout::guesses() && is_good<Hash>(keys, 0, 0);
+  for (unsigned i = 0; i < Layout::buckets(); ++i) {
+    for (unsigned j = 0; j < held; ++j) {
+      size_t bucket_id = Layout::pos(i, j);
+      vec_t a = Layout::get_a(*this, bucket_id);
+      if (is_good<Hash>(keys, a, Layout::get_c(*this, bucket_id), i, ((col_hash_t)1) << j)) {
+        return {a, GOOD};
       }
     }
+    for (unsigned j = held; empty_good && j < Layout::guesses(); ++j) {
+      if (is_good<Hash>(keys, 0, 0, i, ((col_hash_t)1) << j)) return {0, GOOD};
+    }
   }
   return {0, FAIL};
 }
 
-Sketch &operator+= (Sketch &sketch1, const Sketch &sketch2) {
-  assert (sketch1.seed == sketch2.seed);
-  for (unsigned i = 0; i < Sketch::num_elems; i++) {
-    sketch1.bucket_a[i] ^= sketch2.bucket_a[i];
-    sketch1.bucket_c[i] ^= sketch2.bucket_c[i];
+template <class Layout, class Hash>
+void Sketch::query_batch_impl(Sketch* const* sketches, size_t num,
+                              std::pair<vec_t, SampleSketchRet>* out,
+                              std::vector<vec_t>* samples) {
+  // the buckets that may be good and the sketch and depth of each
+  thread_local std::vector<vec_t> cand_a;
+  thread_local std::vector<vec_hash_t> cand_c;
+  thread_local std::vector<uint32_t> cand_id;
+  thread_local std::vector<vec_hash_t> checksums;
+  thread_local std::vector<uint32_t> unresolved;
+  size_t max_cands = std::max(num, num * Layout::guesses());
+  cand_a.resize(max_cands);
+  cand_c.resize(max_cands);
+  cand_id.resize(max_cands);
+  checksums.resize(max_cands);
+  unresolved.resize(num);
+  vec_t *ca = cand_a.data();
+  vec_hash_t *cc = cand_c.data();
+  uint32_t *cid = cand_id.data();
+
+  for (size_t base = 0; base < num;) {
+    // sketches that share a seed are hashed together
+    uint64_t seed = sketches[base]->seed;
+    size_t end = base + 1;
+    while (end < num && sketches[end]->seed == seed) ++end;
+    const auto &keys = Hash::keys(seed, num_buckets);
+
+    // the deterministic bucket of every sketch first, it is good for sketches of one index
+    size_t num_cands = 0;
+    for (size_t k = base; k < end; ++k) {
+      const Sketch &s = *sketches[k];
+      if (samples != nullptr) samples[k].clear();
+      vec_t det_a = Layout::get_a(s, Layout::det());
+      vec_hash_t det_c = Layout::get_c(s, Layout::det());
+      if (det_a == 0 && det_c == 0) {
+        out[k] = {0, ZERO}; // the "first" bucket is deterministic so if it is all zero then there are no edges to return
+        continue;
+      }
+      out[k] = {0, FAIL};
+      ca[num_cands] = det_a;
+      cc[num_cands] = det_c;
+      cid[num_cands++] = k;
+    }
+    checksum_batch<Hash>(keys, ca, num_cands, seed, checksums.data());
+    size_t num_unresolved = 0;
+    for (size_t t = 0; t < num_cands; ++t) {
+      if (checksums[t] == cc[t]) {
+        // every bucket holds the one index of the sketch
+        out[cid[t]] = {ca[t], GOOD};
+        if (samples != nullptr) samples[cid[t]].push_back(ca[t]);
+      }
+      else unresolved[num_unresolved++] = cid[t];
+    }
+
+    // then one column at a time so that most sketches stop after the first column
+    // (unless every sample is wanted)
+    // an empty bucket can only be good if the checksum of 0 is 0
+    vec_t zero = 0;
+    vec_hash_t zero_checksum;
+    checksum_batch<Hash>(keys, &zero, 1, seed, &zero_checksum);
+    bool skip_empty = zero_checksum != 0;
+    for (unsigned i = 0; i < Layout::buckets() && num_unresolved > 0; ++i) {
+      num_cands = 0;
+      for (size_t u = 0; u < num_unresolved; ++u) {
+        const Sketch &s = *sketches[unresolved[u]];
+        size_t bucket_id = Layout::pos(i, 0);
+        size_t held = Layout::rows(s);
+        for (unsigned j = 0; j < held; ++j, bucket_id += Layout::depth_step()) {
+          ca[num_cands] = Layout::get_a(s, bucket_id);
+          cc[num_cands] = Layout::get_c(s, bucket_id);
+          cid[num_cands] = (u << 8) | j;
+          num_cands += !skip_empty || ca[num_cands] != 0 || cc[num_cands] != 0;
+        }
+        // the depths not held are empty
+        for (unsigned j = held; !skip_empty && j < Layout::guesses(); ++j) {
+          ca[num_cands] = 0;
+          cc[num_cands] = 0;
+          cid[num_cands++] = (u << 8) | j;
+        }
+      }
+      checksum_batch<Hash>(keys, ca, num_cands, seed, checksums.data());
+      // the candidates of a sketch are in query order so the first good one is the result
+      for (size_t t = 0; t < num_cands; ++t) {
+        size_t k = unresolved[cid[t] >> 8];
+        if (checksums[t] != cc[t] || (samples == nullptr && out[k].second == GOOD)) continue;
+        if (!sketches[k]->is_good<Hash>(keys, ca[t], cc[t], i, ((col_hash_t)1) << (cid[t] & 0xFF)))
+          continue;
+        if (out[k].second != GOOD) out[k] = {ca[t], GOOD};
+        if (samples != nullptr && std::find(samples[k].begin(), samples[k].end(), ca[t])
+            == samples[k].end())
+          samples[k].push_back(ca[t]);
+      }
+      if (samples != nullptr) continue;
+      size_t still_unresolved = 0;
+      for (size_t u = 0; u < num_unresolved; ++u) {
+        if (out[unresolved[u]].second != GOOD) unresolved[still_unresolved++] = unresolved[u];
+      }
+      num_unresolved = still_unresolved;
+    }
+    base = end;
   }
-  sketch1.already_queried = sketch1.already_queried || sketch2.already_queried;
-  return sketch1;
 }
 
-bool operator== (const Sketch &sketch1, const Sketch &sketch2) {
-  if (sketch1.seed != sketch2.seed || sketch1.already_queried != sketch2.already_queried) 
-    return false;
+void Sketch::update(const vec_t& update_idx) {
+  if (hashing == WIDE_HASHING) {
+    wide_hash_t wide = Bucket_Boruvka::wide_index_hash(update_idx);
+    batch_update(&update_idx, &wide, 1);
+    return;
+  }
+  with_hash_family([&](auto hash) {
+    with_layout([&](auto layout) {
+      update_impl<decltype(layout), decltype(hash)>(update_idx);
+    });
+  });
+}
 
-  for (size_t i = 0; i < Sketch::num_elems; ++i) {
-    if (sketch1.bucket_a[i] != sketch2.bucket_a[i]) return false;
+void Sketch::batch_update(const std::vector<vec_t>& updates) {
+  if (hashing == WIDE_HASHING) {
+    thread_local std::vector<wide_hash_t> wide;
+    wide.resize(updates.size());
+    for (size_t k = 0; k < updates.size(); ++k)
+      wide[k] = Bucket_Boruvka::wide_index_hash(updates[k]);
+    batch_update(updates.data(), wide.data(), updates.size());
+    return;
   }
+  with_hash_family([&](auto hash) {
+    with_layout([&](auto layout) {
+      batch_update_impl<decltype(layout), decltype(hash)>(updates);
+    });
+  });
+}
+
+void Sketch::batch_update(const vec_t* updates, const wide_hash_t* wide, size_t num) {
+  assert(hashing == WIDE_HASHING);
+  with_layout([&](auto layout) {
+    apply_wide_impl<decltype(layout)>(updates, wide, num);
+  });
+}
 
-  for (size_t i = 0; i < Sketch::num_elems; ++i) {
-    if (sketch1.bucket_c[i] != sketch2.bucket_c[i]) return false;
+void Sketch::hash_updates(uint64_t seed, const vec_t* updates, size_t num, char* out, size_t stride) {
+  if (hashing == WIDE_HASHING) {
+    wide_hash_t wide[SketchKernels::batch_size];
+    for (size_t base = 0; base < num; base += SketchKernels::batch_size) {
+      size_t chunk_num = std::min(SketchKernels::batch_size, num - base);
+      for (size_t k = 0; k < chunk_num; ++k)
+        wide[k] = Bucket_Boruvka::wide_index_hash(updates[base + k]);
+      hash_updates(seed, wide, chunk_num, out + base * stride, stride);
+    }
+    return;
   }
+  with_hash_family([&](auto hash) {
+    hash_updates_impl<decltype(hash)>(seed, updates, num, out, stride);
+  });
+}
+
+template <class Hash>
+void Sketch::hash_updates_impl(uint64_t seed, const vec_t* updates, size_t num, char* out,
+                               size_t stride) {
+  const auto &keys = Hash::keys(seed, num_buckets);
+  vec_hash_t update_hashes[SketchKernels::batch_size];
+  col_hash_t col_hashes[SketchKernels::batch_size];
+  for (size_t base = 0; base < num; base += SketchKernels::batch_size) {
+    const vec_t* chunk = updates + base;
+    char* chunk_out = out + base * stride;
+    size_t chunk_num = std::min(SketchKernels::batch_size, num - base);
 
-  return true;
+    Hash::checksum_batch(keys, chunk, chunk_num, update_hashes);
+    for (size_t k = 0; k < chunk_num; ++k) {
+      std::memcpy(chunk_out + k * stride, &update_hashes[k], sizeof(vec_hash_t));
+    }
+    for (unsigned i = 0; i < num_buckets; ++i) {
+      Hash::col_hash_batch(keys, chunk, chunk_num, i, col_hashes);
+      for (size_t k = 0; k < chunk_num; ++k) {
+        chunk_out[k * stride + sizeof(vec_hash_t) + i] = Bucket_Boruvka::get_depth(col_hashes[k], num_guesses);
+      }
+    }
+  }
 }
 
-std::ostream& operator<< (std::ostream &os, const Sketch &sketch) {
-  for (unsigned k = 0; k < Sketch::n; k++) {
-    os << '1';
-  }
-  os << std::endl
-     << "a:" << sketch.bucket_a[Sketch::num_buckets * Sketch::num_guesses] << std::endl
-     << "c:" << sketch.bucket_c[Sketch::num_buckets * Sketch::num_guesses] << std::endl
-     << (Bucket_Boruvka::is_good(sketch.bucket_a[Sketch::num_buckets * Sketch::num_guesses], sketch.bucket_c[Sketch::num_buckets * Sketch::num_guesses], sketch.seed) ? "good" : "bad") << std::endl;
-
-  for (unsigned i = 0; i < Sketch::num_buckets; ++i) {
-    for (unsigned j = 0; j < Sketch::num_guesses; ++j) {
-      unsigned bucket_id = i * Sketch::num_guesses + j;
-      for (unsigned k = 0; k < Sketch::n; k++) {
-        os << (Bucket_Boruvka::contains(Bucket_Boruvka::col_index_hash(k, sketch.seed + 1), 1 << j) ? '1' : '0');
+void Sketch::hash_updates(uint64_t seed, const wide_hash_t* wide, size_t num, char* out, size_t stride) {
+  assert(hashing == WIDE_HASHING);
+  col_hash_t col_hashes[SketchKernels::batch_size];
+  uint64_t checksum_key = Bucket_Boruvka::wide_key(Bucket_Boruvka::wide_checksum_seed(seed));
+  for (size_t base = 0; base < num; base += SketchKernels::batch_size) {
+    const wide_hash_t* chunk_wide = wide + base;
+    char* chunk_out = out + base * stride;
+    size_t chunk_num = std::min(SketchKernels::batch_size, num - base);
+
+    SketchKernels::wide_col_index_hash_batch(chunk_wide, chunk_num, checksum_key, col_hashes);
+    for (size_t k = 0; k < chunk_num; ++k) {
+      vec_hash_t update_hash = col_hashes[k] >> 32;
+      std::memcpy(chunk_out + k * stride, &update_hash, sizeof(vec_hash_t));
+    }
+    for (unsigned i = 0; i < num_buckets; ++i) {
+      SketchKernels::wide_col_index_hash_batch(chunk_wide, chunk_num,
+                                               Bucket_Boruvka::wide_key(seed + i), col_hashes);
+      for (size_t k = 0; k < chunk_num; ++k) {
+        chunk_out[k * stride + sizeof(vec_hash_t) + i] = Bucket_Boruvka::get_depth(col_hashes[k], num_guesses);
       }
-      os << std::endl
-         << "a:" << sketch.bucket_a[bucket_id] << std::endl
-         << "c:" << sketch.bucket_c[bucket_id] << std::endl
-         << (Bucket_Boruvka::is_good(sketch.bucket_a[bucket_id], sketch.bucket_c[bucket_id], i, 1 << j, sketch.seed) ? "good" : "bad") << std::endl;
     }
   }
+}
+
+void Sketch::apply_hashed(const vec_t* updates, size_t num, const char* hashes, size_t stride) {
+  with_layout([&](auto layout) {
+    apply_hashed_impl<decltype(layout)>(updates, num, hashes, stride);
+  });
+}
+
+std::pair<vec_t, SampleSketchRet> Sketch::query() {
+  if (already_queried) {
+    throw MultipleQueryException();
+  }
+  already_queried = true;
+
+  std::pair<vec_t, SampleSketchRet> ret;
+  with_hash_family([&](auto hash) {
+    with_layout([&](auto layout) {
+      ret = query_impl<decltype(layout), decltype(hash)>();
+    });
+  });
+  return ret;
+}
+
+void Sketch::query_sketches(Sketch* const* sketches, size_t num,
+                            std::pair<vec_t, SampleSketchRet>* out,
+                            std::vector<vec_t>* samples) {
+  for (size_t k = 0; k < num; ++k) {
+    if (sketches[k]->already_queried) {
+      throw MultipleQueryException();
+    }
+  }
+  for (size_t k = 0; k < num; ++k) {
+    sketches[k]->already_queried = true;
+  }
+
+  with_hash_family([&](auto hash) {
+    with_layout([&](auto layout) {
+      query_batch_impl<decltype(layout), decltype(hash)>(sketches, num, out, samples);
+    });
+  });
+}
+
+void Sketch::query_batch(Sketch* const* sketches, size_t num,
+                         std::pair<vec_t, SampleSketchRet>* out) {
+  query_sketches(sketches, num, out, nullptr);
+}
+
+void Sketch::query_all_batch(Sketch* const* sketches, size_t num,
+                             std::pair<vec_t, SampleSketchRet>* out,
+                             std::vector<vec_t>* samples) {
+  query_sketches(sketches, num, out, samples);
+}
+
+Sketch &operator+= (Sketch &sketch1, const Sketch &sketch2) {
+  Sketch::add_sketches(&sketch1, &sketch2, 1, 0);
+  return sketch1;
+}
+
+void Sketch::add_sketches(Sketch *dst, const Sketch *src, size_t num, size_t stride) {
+  // both layouts occupy the same contiguous region and add bucket by bucket
+  size_t bytes = bucket_bytes(std::min(dst->rows, src->rows));
+  SketchKernels::xor_blocks(dst->buckets, src->buckets, bytes, num, stride);
+  for (size_t i = 0; i < num; ++i) {
+    auto *d = reinterpret_cast<Sketch *>(reinterpret_cast<char *>(dst) + i * stride);
+    auto *s = reinterpret_cast<const Sketch *>(reinterpret_cast<const char *>(src) + i * stride);
+    assert (d->seed == s->seed);
+    d->already_queried = d->already_queried || s->already_queried;
+  }
+}
+
+void Sketch::atomic_add_sketches(Sketch *dst, const Sketch *src, size_t num, size_t stride) {
+  size_t bytes = bucket_bytes(std::min(dst->rows, src->rows));
+  SketchKernels::atomic_xor_blocks(dst->buckets, src->buckets, bytes, num, stride);
+  for (size_t i = 0; i < num; ++i) {
+    auto *d = reinterpret_cast<Sketch *>(reinterpret_cast<char *>(dst) + i * stride);
+    auto *s = reinterpret_cast<const Sketch *>(reinterpret_cast<const char *>(src) + i * stride);
+    assert (d->seed == s->seed);
+    // only written if set, which it is not for the deltas of an ingestion
+    if (s->already_queried) __atomic_store_n(&d->already_queried, true, __ATOMIC_RELAXED);
+  }
+}
+
+bool operator== (const Sketch &sketch1, const Sketch &sketch2) {
+  if (sketch1.seed != sketch2.seed || sketch1.already_queried != sketch2.already_queried) 
+    return false;
+
+  // both layouts occupy the same contiguous region, the depths only one holds must be empty
+  size_t common = Sketch::bucket_bytes(std::min(sketch1.rows, sketch2.rows));
+  const Sketch &deeper = sketch1.rows > sketch2.rows ? sketch1 : sketch2;
+  return std::memcmp(sketch1.buckets, sketch2.buckets, common) == 0
+    && std::all_of(deeper.buckets + common, deeper.buckets + Sketch::bucket_bytes(deeper.rows),
+                   [](char b) { return b == 0; });
+}
+
+std::ostream& operator<< (std::ostream &os, const Sketch &sketch) {
+  Sketch::with_hash_family([&](auto hash) {
+    using Hash = decltype(hash);
+    const auto &keys = Hash::keys(sketch.seed, Sketch::num_buckets);
+    size_t det = Sketch::num_buckets * Sketch::num_guesses;
+    for (unsigned k = 0; k < Sketch::n; k++) {
+      os << '1';
+    }
+    os << std::endl
+       << "a:" << sketch.get_bucket_a(det) << std::endl
+       << "c:" << sketch.get_bucket_c(det) << std::endl
+       << (sketch.is_good<Hash>(keys, sketch.get_bucket_a(det), sketch.get_bucket_c(det)) ? "good" : "bad") << std::endl;
+
+    for (unsigned i = 0; i < Sketch::num_buckets; ++i) {
+      for (unsigned j = 0; j < Sketch::num_guesses; ++j) {
+        unsigned bucket_id = i * Sketch::num_guesses + j;
+        for (unsigned k = 0; k < Sketch::n; k++) {
+          os << (Bucket_Boruvka::contains(Hash::col_hash(keys, k, 1), 1 << j) ? '1' : '0');
+        }
+        os << std::endl
+           << "a:" << sketch.get_bucket_a(bucket_id) << std::endl
+           << "c:" << sketch.get_bucket_c(bucket_id) << std::endl
+           << (sketch.is_good<Hash>(keys, sketch.get_bucket_a(bucket_id), sketch.get_bucket_c(bucket_id), i, 1 << j) ? "good" : "bad") << std::endl;
+      }
+    }
+  });
   return os;
 }
 
@@ -151,6 +844,18 @@ void Sketch::write_binary(std::ostream& binary_out) {
 }
 
 void Sketch::write_binary(std::ostream &binary_out) const {
-  binary_out.write((char*)bucket_a, num_elems * sizeof(vec_t));
-  binary_out.write((char*)bucket_c, num_elems * sizeof(vec_hash_t));
+  if (layout == DEPTH_MAJOR) {
+    // always serialize in column major order with every depth so that files do not
+    // depend upon the layout (or the depths held)
+    std::vector<vec_t> out_a(num_elems);
+    std::vector<vec_hash_t> out_c(num_elems);
+    for (size_t i = 0; i < num_elems; ++i) {
+      out_a[i] = get_bucket_a(i);
+      out_c[i] = get_bucket_c(i);
+    }
+    binary_out.write((char*)out_a.data(), num_elems * sizeof(vec_t));
+    binary_out.write((char*)out_c.data(), num_elems * sizeof(vec_hash_t));
+    return;
+  }
+  binary_out.write(buckets, num_elems * (sizeof(vec_t) + sizeof(vec_hash_t)));
 }
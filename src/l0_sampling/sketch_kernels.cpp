@@ -0,0 +1,350 @@
+#include "../../include/l0_sampling/sketch_kernels.h"
+#include "../../include/bucket.h"
+#include <cstring>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define SKETCH_KERNELS_X86
+#endif
+
+/*
+ * The vectorized kernels below are specializations of XXH64 and XXH32 for
+ * inputs of exactly sizeof(vec_t) = 8 bytes. For such inputs both hashes
+ * reduce to a handful of multiply/rotate/xor-shift steps that can be
+ * computed for several updates at once.
+ */
+namespace {
+constexpr uint64_t PRIME64_1 = 0x9E3779B185EBCA87ULL;
+constexpr uint64_t PRIME64_2 = 0xC2B2AE3D27D4EB4FULL;
+constexpr uint64_t PRIME64_3 = 0x165667B19E3779F9ULL;
+constexpr uint64_t PRIME64_4 = 0x85EBCA77C2B2AE63ULL;
+constexpr uint64_t PRIME64_5 = 0x27D4EB2F165667C5ULL;
+constexpr uint32_t PRIME32_2 = 0x85EBCA77U;
+constexpr uint32_t PRIME32_3 = 0xC2B2AE3DU;
+constexpr uint32_t PRIME32_4 = 0x27D4EB2FU;
+constexpr uint32_t PRIME32_5 = 0x165667B1U;
+
+static_assert(sizeof(vec_t) == 8, "vectorized kernels assume 8 byte updates");
+
+typedef void (*col_hash_fn)(const vec_t *, size_t, uint64_t, col_hash_t *);
+typedef void (*idx_hash_fn)(const vec_t *, size_t, uint32_t, vec_hash_t *);
+typedef void (*wide_hash_fn)(const wide_hash_t *, size_t, uint64_t, col_hash_t *);
+typedef void (*xor_fn)(char *, const char *, size_t);
+
+void col_hash_scalar(const vec_t *idx, size_t num, uint64_t seed, col_hash_t *out) {
+  for (size_t k = 0; k < num; ++k)
+    out[k] = Bucket_Boruvka::col_index_hash(idx[k], seed);
+}
+
+void idx_hash_scalar(const vec_t *idx, size_t num, uint32_t seed, vec_hash_t *out) {
+  for (size_t k = 0; k < num; ++k)
+    out[k] = Bucket_Boruvka::index_hash(idx[k], seed);
+}
+
+void wide_hash_scalar(const wide_hash_t *wide, size_t num, uint64_t key, col_hash_t *out) {
+  for (size_t k = 0; k < num; ++k)
+    out[k] = Bucket_Boruvka::wide_col_index_hash(wide[k], key);
+}
+
+void xor_scalar(char *dst, const char *src, size_t bytes) {
+  size_t k = 0;
+  for (; k + sizeof(uint64_t) <= bytes; k += sizeof(uint64_t)) {
+    uint64_t d, s;
+    memcpy(&d, dst + k, sizeof(d));
+    memcpy(&s, src + k, sizeof(s));
+    d ^= s;
+    memcpy(dst + k, &d, sizeof(d));
+  }
+  for (; k < bytes; ++k)
+    dst[k] ^= src[k];
+}
+
+#ifdef SKETCH_KERNELS_X86
+/******************** AVX2 ********************/
+__attribute__((target("avx2")))
+inline __m256i mullo64_avx2(__m256i a, uint64_t b) {
+  // AVX2 has no 64 bit multiply so build one from 32x32->64 multiplies
+  const __m256i b_lo = _mm256_set1_epi64x(b & 0xFFFFFFFF);
+  const __m256i b_hi = _mm256_set1_epi64x(b >> 32);
+  __m256i lo    = _mm256_mul_epu32(a, b_lo);
+  __m256i cross = _mm256_add_epi64(_mm256_mul_epu32(_mm256_srli_epi64(a, 32), b_lo),
+                                   _mm256_mul_epu32(a, b_hi));
+  return _mm256_add_epi64(lo, _mm256_slli_epi64(cross, 32));
+}
+
+__attribute__((target("avx2")))
+inline __m256i rotl64_avx2(__m256i x, int r) {
+  return _mm256_or_si256(_mm256_slli_epi64(x, r), _mm256_srli_epi64(x, 64 - r));
+}
+
+__attribute__((target("avx2")))
+inline __m256i rotl32_avx2(__m256i x, int r) {
+  return _mm256_or_si256(_mm256_slli_epi32(x, r), _mm256_srli_epi32(x, 32 - r));
+}
+
+__attribute__((target("avx2")))
+inline __m256i xxh32_avx2(__m256i lo, __m256i hi, uint32_t seed) {
+  __m256i h = _mm256_set1_epi32(seed + PRIME32_5 + sizeof(vec_t));
+  h = _mm256_add_epi32(h, _mm256_mullo_epi32(lo, _mm256_set1_epi32(PRIME32_3)));
+  h = _mm256_mullo_epi32(rotl32_avx2(h, 17), _mm256_set1_epi32(PRIME32_4));
+  h = _mm256_add_epi32(h, _mm256_mullo_epi32(hi, _mm256_set1_epi32(PRIME32_3)));
+  h = _mm256_mullo_epi32(rotl32_avx2(h, 17), _mm256_set1_epi32(PRIME32_4));
+  h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 15));
+  h = _mm256_mullo_epi32(h, _mm256_set1_epi32(PRIME32_2));
+  h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 13));
+  h = _mm256_mullo_epi32(h, _mm256_set1_epi32(PRIME32_3));
+  return _mm256_xor_si256(h, _mm256_srli_epi32(h, 16));
+}
+
+__attribute__((target("avx2")))
+void col_hash_avx2(const vec_t *idx, size_t num, uint64_t seed, col_hash_t *out) {
+  const __m256i init = _mm256_set1_epi64x(seed + PRIME64_5 + sizeof(vec_t));
+  size_t k = 0;
+  for (; k + 4 <= num; k += 4) {
+    __m256i in = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(idx + k));
+    __m256i k1 = mullo64_avx2(rotl64_avx2(mullo64_avx2(in, PRIME64_2), 31), PRIME64_1);
+    __m256i h  = _mm256_xor_si256(init, k1);
+    h = _mm256_add_epi64(mullo64_avx2(rotl64_avx2(h, 27), PRIME64_1),
+                         _mm256_set1_epi64x(PRIME64_4));
+    h = _mm256_xor_si256(h, _mm256_srli_epi64(h, 33));
+    h = mullo64_avx2(h, PRIME64_2);
+    h = _mm256_xor_si256(h, _mm256_srli_epi64(h, 29));
+    h = mullo64_avx2(h, PRIME64_3);
+    h = _mm256_xor_si256(h, _mm256_srli_epi64(h, 32));
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + k), h);
+  }
+  col_hash_scalar(idx + k, num - k, seed, out + k);
+}
+
+__attribute__((target("avx2")))
+void idx_hash_avx2(const vec_t *idx, size_t num, uint32_t seed, vec_hash_t *out) {
+  size_t k = 0;
+  for (; k + 8 <= num; k += 8) {
+    __m256 v0 = _mm256_castsi256_ps(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(idx + k)));
+    __m256 v1 = _mm256_castsi256_ps(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(idx + k + 4)));
+    // split the 8 updates into their low and high 32 bit halves (in update order)
+    __m256i lo = _mm256_permute4x64_epi64(
+        _mm256_castps_si256(_mm256_shuffle_ps(v0, v1, _MM_SHUFFLE(2, 0, 2, 0))), _MM_SHUFFLE(3, 1, 2, 0));
+    __m256i hi = _mm256_permute4x64_epi64(
+        _mm256_castps_si256(_mm256_shuffle_ps(v0, v1, _MM_SHUFFLE(3, 1, 3, 1))), _MM_SHUFFLE(3, 1, 2, 0));
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + k), xxh32_avx2(lo, hi, seed));
+  }
+  idx_hash_scalar(idx + k, num - k, seed, out + k);
+}
+
+__attribute__((target("avx2")))
+void wide_hash_avx2(const wide_hash_t *wide, size_t num, uint64_t key, col_hash_t *out) {
+  size_t k = 0;
+  for (; k + 4 <= num; k += 4) {
+    __m256i v0 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(wide + k));
+    __m256i v1 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(wide + k + 2));
+    // deinterleave the low and high halves of the 4 wide hashes (in update order)
+    __m256i low  = _mm256_permute4x64_epi64(_mm256_unpacklo_epi64(v0, v1), _MM_SHUFFLE(3, 1, 2, 0));
+    __m256i high = _mm256_permute4x64_epi64(_mm256_unpackhi_epi64(v0, v1), _MM_SHUFFLE(3, 1, 2, 0));
+    __m256i h = _mm256_add_epi64(low, mullo64_avx2(high, key));
+    h = _mm256_xor_si256(h, _mm256_srli_epi64(h, 33));
+    h = mullo64_avx2(h, 0xff51afd7ed558ccdULL);
+    h = _mm256_xor_si256(h, _mm256_srli_epi64(h, 33));
+    h = mullo64_avx2(h, 0xc4ceb9fe1a85ec53ULL);
+    h = _mm256_xor_si256(h, _mm256_srli_epi64(h, 33));
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + k), h);
+  }
+  wide_hash_scalar(wide + k, num - k, key, out + k);
+}
+
+__attribute__((target("avx2")))
+void xor_avx2(char *dst, const char *src, size_t bytes) {
+  size_t k = 0;
+  for (; k + 32 <= bytes; k += 32) {
+    __m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(dst + k));
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + k));
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + k), _mm256_xor_si256(d, v));
+  }
+  xor_scalar(dst + k, src + k, bytes - k);
+}
+
+/******************* AVX512 *******************/
+// GCC 12's AVX512 intrinsic headers trigger spurious maybe-uninitialized warnings (GCC bug 105593)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+__attribute__((target("avx512f,avx512dq")))
+void col_hash_avx512(const vec_t *idx, size_t num, uint64_t seed, col_hash_t *out) {
+  const __m512i init = _mm512_set1_epi64(seed + PRIME64_5 + sizeof(vec_t));
+  const __m512i p1 = _mm512_set1_epi64(PRIME64_1);
+  const __m512i p2 = _mm512_set1_epi64(PRIME64_2);
+  const __m512i p3 = _mm512_set1_epi64(PRIME64_3);
+  const __m512i p4 = _mm512_set1_epi64(PRIME64_4);
+  size_t k = 0;
+  for (; k + 8 <= num; k += 8) {
+    __m512i in = _mm512_loadu_si512(idx + k);
+    __m512i k1 = _mm512_mullo_epi64(_mm512_rol_epi64(_mm512_mullo_epi64(in, p2), 31), p1);
+    __m512i h  = _mm512_xor_si512(init, k1);
+    h = _mm512_add_epi64(_mm512_mullo_epi64(_mm512_rol_epi64(h, 27), p1), p4);
+    h = _mm512_xor_si512(h, _mm512_srli_epi64(h, 33));
+    h = _mm512_mullo_epi64(h, p2);
+    h = _mm512_xor_si512(h, _mm512_srli_epi64(h, 29));
+    h = _mm512_mullo_epi64(h, p3);
+    h = _mm512_xor_si512(h, _mm512_srli_epi64(h, 32));
+    _mm512_storeu_si512(out + k, h);
+  }
+  col_hash_scalar(idx + k, num - k, seed, out + k);
+}
+
+__attribute__((target("avx512f,avx512dq")))
+void idx_hash_avx512(const vec_t *idx, size_t num, uint32_t seed, vec_hash_t *out) {
+  const __m512i p2 = _mm512_set1_epi32(PRIME32_2);
+  const __m512i p3 = _mm512_set1_epi32(PRIME32_3);
+  const __m512i p4 = _mm512_set1_epi32(PRIME32_4);
+  size_t k = 0;
+  for (; k + 16 <= num; k += 16) {
+    __m512i v0 = _mm512_loadu_si512(idx + k);
+    __m512i v1 = _mm512_loadu_si512(idx + k + 8);
+    // narrow the 16 updates into their low and high 32 bit halves (in update order)
+    __m512i lo = _mm512_inserti64x4(_mm512_castsi256_si512(_mm512_cvtepi64_epi32(v0)),
+                                    _mm512_cvtepi64_epi32(v1), 1);
+    __m512i hi = _mm512_inserti64x4(
+        _mm512_castsi256_si512(_mm512_cvtepi64_epi32(_mm512_srli_epi64(v0, 32))),
+        _mm512_cvtepi64_epi32(_mm512_srli_epi64(v1, 32)), 1);
+    __m512i h = _mm512_set1_epi32(seed + PRIME32_5 + sizeof(vec_t));
+    h = _mm512_add_epi32(h, _mm512_mullo_epi32(lo, p3));
+    h = _mm512_mullo_epi32(_mm512_rol_epi32(h, 17), p4);
+    h = _mm512_add_epi32(h, _mm512_mullo_epi32(hi, p3));
+    h = _mm512_mullo_epi32(_mm512_rol_epi32(h, 17), p4);
+    h = _mm512_xor_si512(h, _mm512_srli_epi32(h, 15));
+    h = _mm512_mullo_epi32(h, p2);
+    h = _mm512_xor_si512(h, _mm512_srli_epi32(h, 13));
+    h = _mm512_mullo_epi32(h, p3);
+    h = _mm512_xor_si512(h, _mm512_srli_epi32(h, 16));
+    _mm512_storeu_si512(out + k, h);
+  }
+  idx_hash_scalar(idx + k, num - k, seed, out + k);
+}
+__attribute__((target("avx512f,avx512dq")))
+void wide_hash_avx512(const wide_hash_t *wide, size_t num, uint64_t key, col_hash_t *out) {
+  const __m512i even = _mm512_set_epi64(14, 12, 10, 8, 6, 4, 2, 0);
+  const __m512i odd  = _mm512_set_epi64(15, 13, 11, 9, 7, 5, 3, 1);
+  const __m512i k_v  = _mm512_set1_epi64(key);
+  const __m512i m1   = _mm512_set1_epi64(0xff51afd7ed558ccdULL);
+  const __m512i m2   = _mm512_set1_epi64(0xc4ceb9fe1a85ec53ULL);
+  size_t k = 0;
+  for (; k + 8 <= num; k += 8) {
+    __m512i v0 = _mm512_loadu_si512(wide + k);
+    __m512i v1 = _mm512_loadu_si512(wide + k + 4);
+    // deinterleave the low and high halves of the 8 wide hashes
+    __m512i low  = _mm512_permutex2var_epi64(v0, even, v1);
+    __m512i high = _mm512_permutex2var_epi64(v0, odd, v1);
+    __m512i h = _mm512_add_epi64(low, _mm512_mullo_epi64(high, k_v));
+    h = _mm512_xor_si512(h, _mm512_srli_epi64(h, 33));
+    h = _mm512_mullo_epi64(h, m1);
+    h = _mm512_xor_si512(h, _mm512_srli_epi64(h, 33));
+    h = _mm512_mullo_epi64(h, m2);
+    h = _mm512_xor_si512(h, _mm512_srli_epi64(h, 33));
+    _mm512_storeu_si512(out + k, h);
+  }
+  wide_hash_scalar(wide + k, num - k, key, out + k);
+}
+__attribute__((target("avx512f")))
+void xor_avx512(char *dst, const char *src, size_t bytes) {
+  size_t k = 0;
+  for (; k + 64 <= bytes; k += 64) {
+    __m512i d = _mm512_loadu_si512(dst + k);
+    _mm512_storeu_si512(dst + k, _mm512_xor_si512(d, _mm512_loadu_si512(src + k)));
+  }
+  xor_scalar(dst + k, src + k, bytes - k);
+}
+#pragma GCC diagnostic pop
+#endif // SKETCH_KERNELS_X86
+
+struct KernelSet {
+  SketchKernels::KernelISA isa;
+  col_hash_fn col_hash;
+  idx_hash_fn idx_hash;
+  wide_hash_fn wide_hash;
+  xor_fn xor_bytes;
+};
+
+KernelSet kernels_for(SketchKernels::KernelISA isa) {
+  switch (isa) {
+#ifdef SKETCH_KERNELS_X86
+    case SketchKernels::AVX512: return {isa, col_hash_avx512, idx_hash_avx512, wide_hash_avx512, xor_avx512};
+    case SketchKernels::AVX2:   return {isa, col_hash_avx2, idx_hash_avx2, wide_hash_avx2, xor_avx2};
+#endif
+    default: return {SketchKernels::SCALAR, col_hash_scalar, idx_hash_scalar, wide_hash_scalar,
+                     xor_scalar};
+  }
+}
+
+// chosen upon first use, so that sketches used by the static initializers of other
+// translation units never see the kernels before they are set
+KernelSet &active() {
+  static KernelSet kernels = kernels_for(SketchKernels::detect_isa());
+  return kernels;
+}
+} // namespace
+
+SketchKernels::KernelISA SketchKernels::detect_isa() {
+#ifdef SKETCH_KERNELS_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq"))
+    return AVX512;
+  if (__builtin_cpu_supports("avx2"))
+    return AVX2;
+#endif
+  return SCALAR;
+}
+
+SketchKernels::KernelISA SketchKernels::get_isa() {
+  return active().isa;
+}
+
+bool SketchKernels::set_isa(KernelISA isa) {
+  if (isa > detect_isa()) return false;
+  active() = kernels_for(isa);
+  return true;
+}
+
+const char *SketchKernels::isa_name(KernelISA isa) {
+  switch (isa) {
+    case AVX512: return "AVX512";
+    case AVX2:   return "AVX2";
+    default:     return "Scalar";
+  }
+}
+
+void SketchKernels::col_index_hash_batch(const vec_t *idx, size_t num, long seed_and_col,
+                                         col_hash_t *out) {
+  active().col_hash(idx, num, seed_and_col, out);
+}
+
+void SketchKernels::index_hash_batch(const vec_t *idx, size_t num, long seed, vec_hash_t *out) {
+  active().idx_hash(idx, num, seed, out);
+}
+
+void SketchKernels::wide_col_index_hash_batch(const wide_hash_t *wide, size_t num, uint64_t key,
+                                              col_hash_t *out) {
+  active().wide_hash(wide, num, key, out);
+}
+
+void SketchKernels::xor_blocks(char *dst, const char *src, size_t block_bytes, size_t num_blocks,
+                               size_t stride) {
+  xor_fn xor_bytes = active().xor_bytes;
+  for (size_t i = 0; i < num_blocks; ++i)
+    xor_bytes(dst + i * stride, src + i * stride, block_bytes);
+}
+
+void SketchKernels::atomic_xor_blocks(char *dst, const char *src, size_t block_bytes,
+                                      size_t num_blocks, size_t stride) {
+  for (size_t i = 0; i < num_blocks; ++i) {
+    auto *d = reinterpret_cast<uint64_t *>(dst + i * stride);
+    auto *s = reinterpret_cast<const uint64_t *>(src + i * stride);
+    size_t words = block_bytes / sizeof(uint64_t);
+    // the buckets a delta does not reach are zero, skip their atomics
+    for (size_t k = 0; k < words; ++k)
+      if (s[k] != 0) __atomic_fetch_xor(&d[k], s[k], __ATOMIC_RELAXED);
+    if (block_bytes % sizeof(uint64_t) != 0) {
+      auto *d_tail = reinterpret_cast<uint32_t *>(d + words);
+      uint32_t s_tail = *reinterpret_cast<const uint32_t *>(s + words);
+      if (s_tail != 0) __atomic_fetch_xor(d_tail, s_tail, __ATOMIC_RELAXED);
+    }
+  }
+}
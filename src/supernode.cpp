@@ -1,55 +1,89 @@
+#include <algorithm>
 #include <stdexcept>
 #include <cmath>
+#include <mutex>
+#include <shared_mutex>
 #include "../include/supernode.h"
-#include "../include/graph_worker.h"
+#include "../include/task_pool.h"
 
-size_t Supernode::bytes_size;
+template <class SamplerT>
+size_t SupernodeT<SamplerT>::bytes_size;
+template <class SamplerT>
+size_t SupernodeT<SamplerT>::bundle_size;
+template <class SamplerT>
+size_t SupernodeT<SamplerT>::in_place_threshold = 256;
 
-Supernode::Supernode(uint64_t n, uint64_t seed): idx(0), num_sketches(log2(n)/(log2(3)-1)),
-               n(n), seed(seed), sketch_size(Sketch::sketchSizeof()) {
+template <class SamplerT>
+SupernodeT<SamplerT>::SupernodeT(uint64_t n, uint64_t seed, bool zero_buckets, size_t rows):
+               idx(0), num_sketches(log2(n)/(log2(3)-1)), n(n), seed(seed),
+               sketch_size(Traits::sketch_size(rows)) {
 
-  size_t sketch_width = guess_gen(Sketch::get_failure_factor());
+  size_t sketch_width = guess_gen(SamplerT::get_failure_factor());
   // generate num_sketches sketches for each supernode (read: node)
   for (int i = 0; i < num_sketches; ++i) {
-    Sketch::makeSketch(get_sketch(i), seed);
+    if (zero_buckets)
+      Traits::make(get_sketch(i), seed, rows);
+    else
+      Traits::make_zeroed(get_sketch(i), seed, rows);
     seed += sketch_width;
   }
 }
 
-Supernode::Supernode(uint64_t n, uint64_t seed, std::istream &binary_in) :
-  idx(0), num_sketches(log2(n)/(log2(3)-1)), n(n), seed(seed), sketch_size(Sketch::sketchSizeof()) {
+template <class SamplerT>
+SupernodeT<SamplerT>::SupernodeT(uint64_t n, uint64_t seed, std::istream &binary_in) :
+  idx(0), num_sketches(log2(n)/(log2(3)-1)), n(n), seed(seed), sketch_size(SamplerT::sketchSizeof()) {
 
-  size_t sketch_width = guess_gen(Sketch::get_failure_factor());
+  size_t sketch_width = guess_gen(SamplerT::get_failure_factor());
   // read num_sketches sketches from file for each supernode (read: node)
   for (int i = 0; i < num_sketches; ++i) {
-    Sketch::makeSketch(get_sketch(i), seed, binary_in);
+    SamplerT::makeSketch(get_sketch(i), seed, binary_in);
     seed += sketch_width;
   }
+  if (adaptive_rows() && num_sketches > 0) {
+    // the sketches are read with every depth, keep those in use
+    size_t rows = 0;
+    for (int i = 0; i < num_sketches; ++i)
+      rows = std::max(rows, Traits::used_rows(get_sketch(i)));
+    Traits::resize_sketches(get_sketch(0), num_sketches, rows);
+    sketch_size = Traits::sketch_size(rows);
+  }
 }
 
-Supernode::Supernode(const Supernode& s) : idx(s.idx), num_sketches(s.num_sketches), n(s.n),
+template <class SamplerT>
+SupernodeT<SamplerT>::SupernodeT(const SupernodeT& s) : idx(s.idx), num_sketches(s.num_sketches), n(s.n),
     seed(s.seed), sketch_size(s.sketch_size) {
   for (int i = 0; i < num_sketches; ++i) {
-    Sketch::makeSketch(get_sketch(i), *s.get_sketch(i));
+    SamplerT::makeSketch(get_sketch(i), *s.get_sketch(i));
   }
 }
 
-Supernode* Supernode::makeSupernode(uint64_t n, long seed, void *loc) {
-  return new (loc) Supernode(n, seed);
+template <class SamplerT>
+SupernodeT<SamplerT>* SupernodeT<SamplerT>::makeSupernode(uint64_t n, long seed, void *loc) {
+  return new (loc) SupernodeT(n, seed);
+}
+
+template <class SamplerT>
+SupernodeT<SamplerT>* SupernodeT<SamplerT>::makeZeroedSupernode(uint64_t n, long seed, void *loc) {
+  return new (loc) SupernodeT(n, seed, false);
 }
 
-Supernode* Supernode::makeSupernode(uint64_t n, long seed, std::istream &binary_in, void *loc) {
-  return new (loc) Supernode(n, seed, binary_in);
+template <class SamplerT>
+SupernodeT<SamplerT>* SupernodeT<SamplerT>::makeSupernode(uint64_t n, long seed, std::istream &binary_in,
+               void *loc) {
+  return new (loc) SupernodeT(n, seed, binary_in);
 }
 
-Supernode* Supernode::makeSupernode(const Supernode& s, void *loc) {
-  return new (loc) Supernode(s);
+template <class SamplerT>
+SupernodeT<SamplerT>* SupernodeT<SamplerT>::makeSupernode(const SupernodeT& s, void *loc) {
+  return new (loc) SupernodeT(s);
 }
 
-Supernode::~Supernode() {
+template <class SamplerT>
+SupernodeT<SamplerT>::~SupernodeT() {
 }
 
-std::pair<Edge, SampleSketchRet> Supernode::sample() {
+template <class SamplerT>
+std::pair<Edge, SampleSketchRet> SupernodeT<SamplerT>::sample() {
   if (idx == num_sketches) throw OutOfQueriesException();
 
   std::pair<vec_t, SampleSketchRet> query_ret = get_sketch(idx++)->query();
@@ -58,58 +92,221 @@ std::pair<Edge, SampleSketchRet> Supernode::sample() {
   return {inv_nondir_non_self_edge_pairing_fn(idx), ret_code};
 }
 
-void Supernode::merge(Supernode &other) {
+template <class SamplerT>
+void SupernodeT<SamplerT>::sample_batch(SupernodeT* const* nodes, size_t num,
+               std::pair<Edge, SampleSketchRet>* out) {
+  sample_nodes(nodes, num, out, nullptr);
+}
+
+template <class SamplerT>
+void SupernodeT<SamplerT>::sample_all_batch(SupernodeT* const* nodes, size_t num,
+               std::pair<Edge, SampleSketchRet>* out, std::vector<Edge>* samples) {
+  sample_nodes(nodes, num, out, samples);
+}
+
+template <class SamplerT>
+void SupernodeT<SamplerT>::sample_nodes(SupernodeT* const* nodes, size_t num,
+               std::pair<Edge, SampleSketchRet>* out, std::vector<Edge>* samples) {
+  // reused across calls by the same thread
+  thread_local std::vector<SamplerT*> sketches;
+  thread_local std::vector<std::pair<vec_t, SampleSketchRet>> query_ret;
+  thread_local std::vector<std::vector<vec_t>> query_samples;
+  for (size_t k = 0; k < num; ++k) {
+    if (nodes[k]->idx == nodes[k]->num_sketches) throw OutOfQueriesException();
+  }
+  sketches.resize(num);
+  query_ret.resize(num);
+  for (size_t k = 0; k < num; ++k) {
+    sketches[k] = nodes[k]->get_sketch(nodes[k]->idx++);
+  }
+  if (samples == nullptr) {
+    Traits::query_batch(sketches.data(), num, query_ret.data());
+  } else {
+    if (query_samples.size() < num) query_samples.resize(num);
+    Traits::query_all_batch(sketches.data(), num, query_ret.data(), query_samples.data());
+    for (size_t k = 0; k < num; ++k) {
+      samples[k].clear();
+      for (vec_t sample : query_samples[k])
+        samples[k].push_back(inv_nondir_non_self_edge_pairing_fn(sample));
+    }
+  }
+  for (size_t k = 0; k < num; ++k) {
+    out[k] = {inv_nondir_non_self_edge_pairing_fn(query_ret[k].first), query_ret[k].second};
+  }
+}
+
+template <class SamplerT>
+size_t SupernodeT<SamplerT>::bundle_rows(const char *bundles, size_t num) const {
+  size_t rows = 0;
+  for (int i = 0; i < num_sketches; ++i) {
+    rows = std::max(rows, Traits::hashed_rows(bundles + i * Traits::hashed_update_size(),
+                                              num, bundle_size));
+  }
+  return rows;
+}
+
+template <class SamplerT>
+void SupernodeT<SamplerT>::reserve_rows(size_t rows) {
+  if (num_sketches == 0 || rows <= Traits::get_rows(get_sketch(0))) return;
+  // the slot of a supernode has room for every depth (see get_size)
+  Traits::resize_sketches(get_sketch(0), num_sketches, rows);
+  sketch_size = Traits::sketch_size(rows);
+}
+
+template <class SamplerT>
+void SupernodeT<SamplerT>::reserve_updates(uint64_t num_updates) {
+  if (!adaptive_rows()) return;
+  std::lock_guard<SpinLock> lk(node_lock);
+  // every update reaches a depth in each of the sketches
+  reserve_rows(Traits::expected_rows(num_updates * num_sketches));
+}
+
+template <class SamplerT>
+void SupernodeT<SamplerT>::add_sketches(const SupernodeT &other, size_t first, bool atomic) {
+  auto add = atomic ? Traits::atomic_add_sketches : Traits::add_sketches;
+  if (sketch_size == other.sketch_size) {
+    add(get_sketch(first), other.get_sketch(first), num_sketches - first, sketch_size);
+    return;
+  }
+  // the sketches hold different depths so are placed at different strides
+  for (int i = first; i < num_sketches; ++i)
+    add(get_sketch(i), other.get_sketch(i), 1, 0);
+}
+
+template <class SamplerT>
+void SupernodeT<SamplerT>::merge(SupernodeT &other) {
   idx = std::max(idx, other.idx);
-  for (int i=idx;i<num_sketches;++i) {
-    (*get_sketch(i))+=(*other.get_sketch(i));
+  if (idx < num_sketches) {
+    reserve_rows(Traits::get_rows(other.get_sketch(0)));
+    add_sketches(other, idx);
   }
 }
 
-void Supernode::update(vec_t upd) {
+template <class SamplerT>
+void SupernodeT<SamplerT>::update(vec_t upd) {
+  if (adaptive_rows()) {
+    // the hashes give the depth of the update to grow the sketches to
+    thread_local std::vector<char> bundle;
+    bundle.resize(bundle_size);
+    size_t sketch_width = guess_gen(SamplerT::get_failure_factor());
+    typename Traits::Batch batch(&upd, 1);
+    for (int i = 0; i < num_sketches; ++i) {
+      Traits::hash_updates(seed + i * sketch_width, batch, &upd, 1,
+                           bundle.data() + i * Traits::hashed_update_size(), bundle_size);
+    }
+    apply_hashed_updates(&upd, 1, bundle.data());
+    return;
+  }
   for (int i = 0; i < num_sketches; ++i)
     get_sketch(i)->update(upd);
 }
 
-void Supernode::apply_delta_update(const Supernode* delta_node) {
-  std::unique_lock<std::mutex> lk(node_mt);
-  for (int i = 0; i < num_sketches; ++i) {
-    *get_sketch(i) += *delta_node->get_sketch(i);
-  }
-  lk.unlock();
-}
-
-/*
- * Consider fiddling with environment vars
- * OMP_DYNAMIC: whether the OS is allowed to dynamically change the number
- * of threads employed for each parallel section
- * OMP_NUM_THREADS (or set_omp_num_threads): how many threads to spin up for
- * each parallel section. the default is (probably) one per CPU core
- * available, but we may want to set it lower if num_sketches is a nice multiple of
- * a lower number.
- *
- * We may want to use omp option schedule(dynamic) or schedule(guided) if
- * there are very many more iterations of loop than threads. Dynamic
- * scheduling is good if loop iterations are expected to take very much
- * different amounts of time. Refer to
- * http://www.inf.ufsc.br/~bosco.sobral/ensino/ine5645/OpenMP_Dynamic_Scheduling.pdf
- * for a detailed explanation.
- */
-/*
- * Current impl uses default threads and parallelism within batched_update.
- * Considered using spin-threads and parallelism within sketch::update, but
- * this was slow (at least on small graph inputs).
- */
-void Supernode::delta_supernode(uint64_t n, uint64_t seed,
+template <class SamplerT>
+void SupernodeT<SamplerT>::apply_delta_update(const SupernodeT* delta_node, bool exclusive) {
+  size_t rows = 0;
+  if (adaptive_rows()) {
+    for (int i = 0; i < num_sketches; ++i)
+      rows = std::max(rows, Traits::used_rows(delta_node->get_sketch(i)));
+  }
+  if (exclusive) {
+    reserve_rows(rows);
+    add_sketches(*delta_node, 0);
+    return;
+  }
+#ifdef SUPERNODE_ATOMIC_XOR
+  if (Traits::atomic_add) {
+    // shared with the other deltas, but not while the sketches grow or are updated in place
+    std::shared_lock<SpinLock> lk(node_lock);
+    while (num_sketches > 0 && rows > Traits::get_rows(get_sketch(0))) {
+      lk.unlock();
+      {
+        std::lock_guard<SpinLock> grow_lk(node_lock);
+        reserve_rows(rows);
+      }
+      lk.lock();
+    }
+    add_sketches(*delta_node, 0, true);
+    return;
+  }
+#endif
+  std::lock_guard<SpinLock> lk(node_lock);
+  reserve_rows(rows);
+  add_sketches(*delta_node, 0);
+}
+
+namespace {
+// batches of fewer updates are applied to every sketch by the calling thread alone,
+// as handing their sketches out to the task pool would cost more than it saves
+constexpr size_t parallel_batch_size = 4096;
+
+// apply f to each sketch index for a batch of num_updates, see parallel_batch_size
+template <class F>
+inline void for_each_sketch(size_t num_sketches, size_t num_updates, F f) {
+  TaskPool::parallel_for(0, num_sketches, num_updates < parallel_batch_size ? num_sketches : 1, f);
+}
+} // namespace
+
+template <class SamplerT>
+void SupernodeT<SamplerT>::delta_supernode(uint64_t n, uint64_t seed,
                const std::vector<vec_t> &updates, void *loc) {
-  auto delta_node = makeSupernode(n, seed, loc);
-#pragma omp parallel for num_threads(GraphWorker::get_group_size()) default(shared)
-  for (int i = 0; i < delta_node->num_sketches; ++i) {
-    delta_node->get_sketch(i)->batch_update(updates);
+  // deltas hold every depth, see apply_delta_update
+  auto delta_node = new (loc) SupernodeT(n, seed, true, Traits::max_rows());
+  typename Traits::Batch batch(updates.data(), updates.size());
+  for_each_sketch(delta_node->num_sketches, updates.size(), [&](size_t i) {
+    Traits::batch_update(delta_node->get_sketch(i), batch, updates);
+  });
+}
+
+template <class SamplerT>
+void SupernodeT<SamplerT>::hash_updates(uint64_t n, uint64_t seed, const vec_t *updates, size_t num,
+               char *bundles) {
+  int num_sketches = log2(n)/(log2(3)-1);
+  size_t sketch_width = guess_gen(SamplerT::get_failure_factor());
+  typename Traits::Batch batch(updates, num);
+  for_each_sketch(num_sketches, num, [&](size_t i) {
+    Traits::hash_updates(seed + i * sketch_width, batch, updates, num,
+                         bundles + i * Traits::hashed_update_size(), bundle_size);
+  });
+}
+
+template <class SamplerT>
+void SupernodeT<SamplerT>::delta_supernode(uint64_t n, uint64_t seed,
+               const std::vector<vec_t> &updates, const char *bundles, void *loc) {
+  auto delta_node = new (loc) SupernodeT(n, seed, true, Traits::max_rows());
+  for_each_sketch(delta_node->num_sketches, updates.size(), [&](size_t i) {
+    Traits::apply_hashed(delta_node->get_sketch(i), updates.data(), updates.size(),
+                         bundles + i * Traits::hashed_update_size(), bundle_size);
+  });
+}
+
+template <class SamplerT>
+void SupernodeT<SamplerT>::apply_hashed_updates(const vec_t *updates, size_t num, const char *bundles,
+                                                bool exclusive) {
+  size_t rows = adaptive_rows() ? bundle_rows(bundles, num) : 0;
+  std::unique_lock<SpinLock> lk(node_lock, std::defer_lock);
+  if (!exclusive) lk.lock();
+  reserve_rows(rows);
+  for (int i = 0; i < num_sketches; ++i) {
+    Traits::apply_hashed(get_sketch(i), updates, num, bundles + i * Traits::hashed_update_size(),
+                         bundle_size);
   }
 }
 
-void Supernode::write_binary(std::ostream& binary_out) {
+template <class SamplerT>
+void SupernodeT<SamplerT>::release_hash_keys(uint64_t n, uint64_t seed) {
+  int num_sketches = log2(n)/(log2(3)-1);
+  size_t sketch_width = guess_gen(SamplerT::get_failure_factor());
+  for (int i = 0; i < num_sketches; ++i)
+    Traits::release_keys(seed + i * sketch_width);
+}
+
+template <class SamplerT>
+void SupernodeT<SamplerT>::write_binary(std::ostream& binary_out) {
   for (int i = 0; i < num_sketches; ++i) {
     get_sketch(i)->write_binary(binary_out);
   }
 }
+
+// the samplers supernodes may be built upon, see SupernodeT
+template class SupernodeT<Sketch>;
+template class SupernodeT<OneSparseSampler>;
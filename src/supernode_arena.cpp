@@ -0,0 +1,85 @@
+#include <new>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "../include/supernode_arena.h"
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MAP_HUGE_1GB
+#define MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+#endif
+
+namespace {
+constexpr size_t huge_2mb = (size_t) 1 << 21;
+constexpr size_t huge_1gb = (size_t) 1 << 30;
+
+inline size_t round_up(size_t bytes, size_t align) {
+  return (bytes + align - 1) / align * align;
+}
+} // namespace
+
+char *SupernodeArena::map(size_t bytes, int flags) {
+  void *mem = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | flags,
+                   -1, 0);
+  return mem == MAP_FAILED ? nullptr : static_cast<char *>(mem);
+}
+
+SupernodeArena::SupernodeArena(size_t slot_size, size_t num_slots, bool huge_pages) : base(nullptr),
+               slot_bytes(round_up(slot_size, slot_align)), num_slots(num_slots) {
+  size_t bytes = slot_bytes * num_slots;
+  if (bytes == 0) bytes = slot_align;
+
+  if (!huge_pages) {
+    page_bytes = sysconf(_SC_PAGESIZE);
+    map_bytes = round_up(bytes, page_bytes);
+    base = map(map_bytes, MAP_NORESERVE);
+    if (base == nullptr) throw std::bad_alloc();
+#ifdef MADV_NOHUGEPAGE
+    // even if transparent huge pages are enabled system wide
+    madvise(base, map_bytes, MADV_NOHUGEPAGE);
+#endif
+    return;
+  }
+
+#ifdef MAP_HUGETLB
+  if (bytes >= huge_1gb) {
+    map_bytes = round_up(bytes, huge_1gb);
+    page_bytes = huge_1gb;
+    base = map(map_bytes, MAP_HUGETLB | MAP_HUGE_1GB);
+  }
+  if (base == nullptr) {
+    map_bytes = round_up(bytes, huge_2mb);
+    page_bytes = huge_2mb;
+    base = map(map_bytes, MAP_HUGETLB | MAP_HUGE_2MB);
+  }
+#endif
+  if (base == nullptr) {
+    // no huge pages reserved. Map normal pages aligned to 2MB (by over mapping
+    // and trimming the ends) so that the kernel can back them with transparent
+    // huge pages. Slots are only touched when used (see Graph::materialize) so
+    // don't reserve swap for the whole arena, which may be far larger than memory.
+    page_bytes = sysconf(_SC_PAGESIZE);
+    map_bytes = round_up(bytes, page_bytes);
+    size_t over_bytes = map_bytes >= huge_2mb ? map_bytes + huge_2mb : map_bytes;
+    char *mem = map(over_bytes, MAP_NORESERVE);
+    if (mem == nullptr) throw std::bad_alloc();
+    base = mem;
+    if (over_bytes != map_bytes) {
+      base = reinterpret_cast<char *>(round_up(reinterpret_cast<size_t>(mem), huge_2mb));
+      if (base != mem) munmap(mem, base - mem);
+      if (mem + over_bytes != base + map_bytes)
+        munmap(base + map_bytes, (mem + over_bytes) - (base + map_bytes));
+    }
+#ifdef MADV_HUGEPAGE
+    madvise(base, map_bytes, MADV_HUGEPAGE);
+#endif
+  }
+}
+
+SupernodeArena::~SupernodeArena() {
+  munmap(base, map_bytes);
+}
@@ -0,0 +1,140 @@
+#include "../include/task_pool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace {
+struct Loop {
+  const TaskPool::RangeFunc *body;
+  size_t end;
+  size_t grain;
+  std::atomic<size_t> next;      // first iteration of the next chunk to claim
+  int helpers = 0;               // pool threads running chunks, under pool_lock
+  std::atomic<bool> failed{false};
+  std::exception_ptr error;      // the first exception thrown, set by whoever sets failed
+
+  Loop(const TaskPool::RangeFunc *body, size_t begin, size_t end, size_t grain) :
+    body(body), end(end), grain(grain), next(begin) {}
+};
+
+std::mutex pool_lock;
+std::condition_variable loop_opened;  // a loop was opened or the pool is stopping
+std::condition_variable helper_left;  // a pool thread finished with a loop
+std::vector<Loop *> open_loops;       // the loops with chunks left to claim
+size_t next_loop = 0;                 // spreads the idle threads over the open loops
+bool started = false;
+bool shutdown = false;
+int num_threads = 0;
+
+void stop();
+
+// the threads of the pool, joined when the program exits
+struct PoolThreads {
+  std::vector<std::thread> threads;
+  ~PoolThreads() { stop(); }
+} pool_threads;
+
+int resolve(int num) {
+  if (num > 0) return num;
+  return std::max(1, (int) std::thread::hardware_concurrency());
+}
+
+void close_loop(Loop *loop) {
+  auto it = std::find(open_loops.begin(), open_loops.end(), loop);
+  if (it != open_loops.end()) open_loops.erase(it);
+}
+
+void run_chunks(Loop *loop) {
+  size_t lo;
+  while ((lo = loop->next.fetch_add(loop->grain)) < loop->end) {
+    try {
+      (*loop->body)(lo, std::min(lo + loop->grain, loop->end));
+    } catch (...) {
+      if (!loop->failed.exchange(true)) loop->error = std::current_exception();
+      loop->next = loop->end; // skip the rest of the loop
+    }
+  }
+}
+
+// run by each thread of the pool
+void help() {
+  std::unique_lock<std::mutex> lk(pool_lock);
+  while (true) {
+    loop_opened.wait(lk, []{ return shutdown || !open_loops.empty(); });
+    if (shutdown) return;
+    Loop *loop = open_loops[next_loop++ % open_loops.size()];
+    ++loop->helpers;
+    lk.unlock();
+    run_chunks(loop);
+    lk.lock();
+    close_loop(loop); // no chunks left to claim
+    if (--loop->helpers == 0) helper_left.notify_all();
+  }
+}
+
+// spawn the threads of the pool, under pool_lock
+void start() {
+  shutdown = false;
+  started = true;
+  // the caller of each loop is one of its threads
+  for (int i = 1; i < resolve(num_threads); ++i)
+    pool_threads.threads.emplace_back(help);
+}
+
+void stop() {
+  {
+    std::lock_guard<std::mutex> lk(pool_lock);
+    if (!started) return;
+    shutdown = true;
+    started = false;
+  }
+  loop_opened.notify_all();
+  for (auto &thr : pool_threads.threads) thr.join();
+  pool_threads.threads.clear();
+}
+} // namespace
+
+void TaskPool::set_num_threads(int num) {
+  if (num == num_threads) return;
+  stop(); // restarted with the new number of threads by the next loop
+  num_threads = num;
+}
+
+int TaskPool::get_num_threads() {
+  return resolve(num_threads);
+}
+
+void TaskPool::parallel_for_range(size_t begin, size_t end, size_t grain,
+                                  const RangeFunc &body) {
+  if (end <= begin) return;
+  grain = std::max(grain, (size_t) 1);
+  if (end - begin <= grain) {
+    body(begin, end);
+    return;
+  }
+
+  Loop loop(&body, begin, end, grain);
+  size_t num_wake;
+  {
+    std::lock_guard<std::mutex> lk(pool_lock);
+    if (!started) start();
+    // wake no more threads than there are chunks for besides the caller's
+    num_wake = std::min((end - begin - 1) / grain, pool_threads.threads.size());
+    if (num_wake > 0) open_loops.push_back(&loop);
+  }
+  for (size_t i = 0; i < num_wake; ++i) loop_opened.notify_one();
+
+  run_chunks(&loop);
+  if (num_wake > 0) {
+    // no thread joins the loop once closed, wait for those that did
+    std::unique_lock<std::mutex> lk(pool_lock);
+    close_loop(&loop);
+    helper_left.wait(lk, [&loop]{ return loop.helpers == 0; });
+  }
+  if (loop.failed) std::rethrow_exception(loop.error);
+}
@@ -1,6 +1,9 @@
 #include <stdexcept>
+#include <algorithm>
+#include <thread>
 #include "../include/util.h"
 #include "../include/graph_worker.h"
+#include "../include/task_pool.h"
 #include "../include/graph.h"
 
 const char *config_file = "streaming.conf";
@@ -33,8 +36,19 @@ std::tuple<bool, bool, std::string> configure_system() {
   bool use_guttertree = false;
   std::string dir = "./";
   int num_groups = 1;
-  int group_size = 1;
+  int pool_threads = 0;
   bool backup_in_mem = true;
+  SketchLayout layout = COLUMN_MAJOR;
+  SketchHashing hashing = COLUMN_HASHING;
+  HashFamily hash_family = XXH64_HASH;
+  SketchGeometry geometry = EXACT_GEOMETRY;
+  size_t edge_cache_mb = 0;
+  bool sample_all = false;
+  size_t exact_degree = 0;
+  bool adaptive_depth = false;
+  bool owner_computes = false;
+  size_t hot_updates = 0;
+  int pack_size = 1;
   std::string line;
   std::ifstream conf(config_file);
   if (conf.is_open()) {
@@ -62,18 +76,111 @@ std::tuple<bool, bool, std::string> configure_system() {
           printf("WARNING: string %s is not a valid option for backup_in_mem"
                  "Defaulting to ON.\n", flag.c_str());
       }
+      if(line.substr(0, line.find('=')) == "sketch_layout") {
+        std::string layout_str = line.substr(line.find('=') + 1);
+        if (layout_str == "depth_major")
+          layout = DEPTH_MAJOR;
+        else if (layout_str != "column_major")
+          printf("WARNING: string %s is not a valid option for sketch_layout. "
+                 "Defaulting to column_major.\n", layout_str.c_str());
+      }
+      if(line.substr(0, line.find('=')) == "sketch_hashing") {
+        std::string hashing_str = line.substr(line.find('=') + 1);
+        if (hashing_str == "wide")
+          hashing = WIDE_HASHING;
+        else if (hashing_str != "column")
+          printf("WARNING: string %s is not a valid option for sketch_hashing. "
+                 "Defaulting to column.\n", hashing_str.c_str());
+      }
+      if(line.substr(0, line.find('=')) == "hash_family") {
+        std::string family_str = line.substr(line.find('=') + 1);
+        if (family_str == "xxh3")
+          hash_family = XXH3_HASH;
+        else if (family_str == "multiply_shift")
+          hash_family = MULTIPLY_SHIFT_HASH;
+        else if (family_str == "tabulation")
+          hash_family = TABULATION_HASH;
+        else if (family_str != "xxh64")
+          printf("WARNING: string %s is not a valid option for hash_family. "
+                 "Defaulting to xxh64.\n", family_str.c_str());
+      }
+      if(line.substr(0, line.find('=')) == "sketch_geometry") {
+        std::string geometry_str = line.substr(line.find('=') + 1);
+        if (geometry_str == "dynamic")
+          geometry = DYNAMIC_GEOMETRY;
+        else if (geometry_str == "class")
+          geometry = CLASS_GEOMETRY;
+        else if (geometry_str != "exact")
+          printf("WARNING: string %s is not a valid option for sketch_geometry. "
+                 "Defaulting to exact.\n", geometry_str.c_str());
+      }
+      if(line.substr(0, line.find('=')) == "edge_hash_cache_mb") {
+        long mb = std::stol(line.substr(line.find('=') + 1));
+        if (mb < 0) {
+          printf("edge_hash_cache_mb=%li is out of bounds. Defaulting to 0.\n", mb);
+          mb = 0;
+        }
+        edge_cache_mb = mb;
+      }
+      if(line.substr(0, line.find('=')) == "boruvka_samples") {
+        std::string samples_str = line.substr(line.find('=') + 1);
+        if (samples_str == "all")
+          sample_all = true;
+        else if (samples_str != "one")
+          printf("WARNING: string %s is not a valid option for boruvka_samples. "
+                 "Defaulting to one.\n", samples_str.c_str());
+      }
+      if(line.substr(0, line.find('=')) == "exact_degree") {
+        long degree = std::stol(line.substr(line.find('=') + 1));
+        if (degree < 0) {
+          printf("exact_degree=%li is out of bounds. Defaulting to 0.\n", degree);
+          degree = 0;
+        }
+        exact_degree = degree;
+      }
+      if(line.substr(0, line.find('=')) == "sketch_depth") {
+        std::string depth_str = line.substr(line.find('=') + 1);
+        if (depth_str == "adaptive")
+          adaptive_depth = true;
+        else if (depth_str != "full")
+          printf("WARNING: string %s is not a valid option for sketch_depth. "
+                 "Defaulting to full.\n", depth_str.c_str());
+      }
+      if(line.substr(0, line.find('=')) == "hot_node_updates") {
+        long updates = std::stol(line.substr(line.find('=') + 1));
+        if (updates < 0) {
+          printf("hot_node_updates=%li is out of bounds. Defaulting to 0.\n", updates);
+          updates = 0;
+        }
+        hot_updates = updates;
+      }
+      if(line.substr(0, line.find('=')) == "owner_computes") {
+        std::string flag = line.substr(line.find('=') + 1);
+        if (flag == "ON")
+          owner_computes = true;
+        else if (flag != "OFF")
+          printf("WARNING: string %s is not a valid option for owner_computes. "
+                 "Defaulting to OFF.\n", flag.c_str());
+      }
+      if(line.substr(0, line.find('=')) == "batch_pack_size") {
+        pack_size = std::stoi(line.substr(line.find('=') + 1));
+        if (pack_size < 1) {
+          printf("batch_pack_size=%i is out of bounds. Defaulting to 1.\n", pack_size);
+          pack_size = 1;
+        }
+      }
       if(line.substr(0, line.find('=')) == "num_groups") {
         num_groups = std::stoi(line.substr(line.find('=') + 1));
-        if (num_groups < 1) { 
+        if (num_groups < 0) { 
           printf("num_groups=%i is out of bounds. Defaulting to 1.\n", num_groups);
           num_groups = 1; 
         }
       }
-      if(line.substr(0, line.find('=')) == "group_size") {
-        group_size = std::stoi(line.substr(line.find('=') + 1));
-        if (group_size < 1) { 
-          printf("group_size=%i is out of bounds. Defaulting to 1.\n", group_size);
-          group_size = 1; 
+      if(line.substr(0, line.find('=')) == "task_pool_threads") {
+        pool_threads = std::stoi(line.substr(line.find('=') + 1));
+        if (pool_threads < 0) {
+          printf("task_pool_threads=%i is out of bounds. Defaulting to 0.\n", pool_threads);
+          pool_threads = 0;
         }
       }
     }
@@ -81,12 +188,48 @@ std::tuple<bool, bool, std::string> configure_system() {
     printf("WARNING: Could not open thread configuration file! Using default values.\n");
   }
   
+  if (adaptive_depth && layout != DEPTH_MAJOR) {
+    printf("WARNING: sketch_depth=adaptive requires sketch_layout=depth_major. "
+           "Using depth_major.\n");
+    layout = DEPTH_MAJOR;
+  }
+
+  int hw_threads = std::max(1, (int) std::thread::hardware_concurrency());
+  if (num_groups == 0) num_groups = hw_threads;
+  // by default the pool has the hardware threads the GraphWorkers leave, besides the thread
+  // opening each loop, so workers splitting large batches do not oversubscribe the cores
+  if (pool_threads == 0) pool_threads = std::max(1, hw_threads - num_groups + 1);
+  TaskPool::set_num_threads(pool_threads);
+
   printf("Configuration:\n");
   printf("Buffering system = %s\n", use_guttertree? "GutterTree" : "StandAloneGutters");
   printf("Number of groups = %i\n", num_groups);
-  printf("Size of groups = %i\n", group_size);
+  printf("Task pool threads = %i\n", TaskPool::get_num_threads());
+  printf("Owner computes = %s\n", owner_computes? "ON" : "OFF");
+  printf("Hot node updates = %lu\n", hot_updates);
+  printf("Batch pack size = %i\n", pack_size);
   printf("Directory for on disk data = %s\n", dir.c_str());
   printf("Query backups in memory = %s\n", backup_in_mem? "ON" : "OFF");
-  GraphWorker::set_config(num_groups, group_size);
+  printf("Sketch layout = %s\n", layout == DEPTH_MAJOR? "depth_major" : "column_major");
+  printf("Sketch hashing = %s\n", hashing == WIDE_HASHING? "wide" : "column");
+  printf("Hash family = %s\n", hash_family_name(hash_family));
+  printf("Sketch geometry = %s\n", geometry == DYNAMIC_GEOMETRY? "dynamic" :
+                                    geometry == CLASS_GEOMETRY? "class" : "exact");
+  printf("Edge hash cache = %lu MiB\n", edge_cache_mb);
+  printf("Boruvka samples = %s\n", sample_all? "all" : "one");
+  printf("Exact degree = %lu\n", exact_degree);
+  printf("Sketch depth = %s\n", adaptive_depth? "adaptive" : "full");
+  GraphWorker::set_config(num_groups);
+  GraphWorker::set_owner_computes(owner_computes);
+  GraphWorker::set_pack_size(pack_size);
+  Sketch::set_layout(layout);
+  Sketch::set_hashing(hashing);
+  Sketch::set_hash_family(hash_family);
+  Sketch::set_geometry(geometry);
+  Sketch::set_adaptive_depth(adaptive_depth);
+  EdgeHashCache::set_config(edge_cache_mb << 20);
+  Graph::set_sample_all(sample_all);
+  Graph::set_exact_degree(exact_degree);
+  Graph::set_hot_updates(hot_updates);
   return {use_guttertree, backup_in_mem, dir};
 }
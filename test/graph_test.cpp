@@ -1,7 +1,10 @@
 #include <gtest/gtest.h>
 #include <fstream>
 #include <algorithm>
+#include <functional>
+#include <memory>
 #include "../include/graph.h"
+#include "../include/binary_graph_stream.h"
 #include "../graph_worker.h"
 #include "../include/test/file_graph_verifier.h"
 #include "../include/test/mat_graph_verifier.h"
@@ -91,11 +94,17 @@ TEST_P(GraphTest, TestSupernodeRestoreAfterCCFailure) {
   GraphWorker::pause_workers();
   Supernode* copy_supernodes[num_nodes];
   for (node_id_t i = 0; i < num_nodes; ++i) {
-    copy_supernodes[i] = Supernode::makeSupernode(*g.supernodes[i]);
+    // nodes without edges are never materialized
+    copy_supernodes[i] = g.supernodes[i] == nullptr ? nullptr
+                         : Supernode::makeSupernode(*g.supernodes[i]);
   }
 
   ASSERT_THROW(g.connected_components(true), OutOfQueriesException);
   for (node_id_t i = 0; i < num_nodes; ++i) {
+    if (copy_supernodes[i] == nullptr) {
+      ASSERT_EQ(g.supernodes[i], nullptr);
+      continue;
+    }
     for (int j = 0; j < copy_supernodes[i]->get_num_sktch(); ++j) {
       ASSERT_TRUE(*copy_supernodes[i]->get_sketch(j) ==
                 *g.supernodes[i]->get_sketch(j));
@@ -149,6 +158,285 @@ TEST_P(GraphTest, TestCorrectnessOnSmallSparseGraphs) {
   } 
 }
 
+// A configuration the correctness of connected components is checked under, see
+// GraphCorrectnessTest
+struct CorrectnessCase {
+  const char *name;
+  TestConfiguration config; // use_tree is set by the test
+  int num_trials = 1;
+  double density = 0.03; // of the random streams on 1024 nodes
+  // checks particular to the configuration once the stream is applied and queried
+  std::function<void(const Graph &, node_id_t, edge_id_t)> check;
+  size_t in_place_threshold = 0; // 0 for the default
+  bool cancelling = false;    // apply each update three times, the extra two cancel
+  bool reserve = false;       // prepare the graph for the update counts of the stream
+  bool binary_stream = false; // ingest the stream from a file with MT_StreamReader
+  bool reheat = false;        // compare to the graph read back from a checkpoint
+};
+void PrintTo(const CorrectnessCase &c, std::ostream *os) { *os << c.name; }
+
+static TestConfiguration with(std::function<void(TestConfiguration &)> set) {
+  TestConfiguration config;
+  set(config);
+  return config;
+}
+
+static const std::vector<CorrectnessCase> correctness_cases = [] {
+  std::vector<CorrectnessCase> cases;
+  auto add = [&cases](const char *name, TestConfiguration config) -> CorrectnessCase & {
+    cases.emplace_back();
+    cases.back().name = name;
+    cases.back().config = config;
+    return cases.back();
+  };
+
+  auto &cache = add("EdgeHashCache", with([](TestConfiguration &c) { c.edge_cache_mb = 16; }));
+  cache.num_trials = 5;
+  cache.check = [](const Graph &g, node_id_t, edge_id_t) {
+    ASSERT_NE(g.get_edge_cache(), nullptr);
+    ASSERT_GT(g.get_edge_cache()->get_hits(), 0);
+  };
+
+  add("WideHashing", with([](TestConfiguration &c) { c.wide_hashing = true; })).num_trials = 5;
+
+  // every batch is applied in place rather than through a delta supernode
+  auto &in_place = add("InPlaceUpdates", {});
+  in_place.num_trials = 5;
+  in_place.in_place_threshold = SIZE_MAX;
+
+  auto &cancelling = add("CancellingUpdates", {});
+  cancelling.num_trials = 5;
+  cancelling.cancelling = true;
+  cancelling.check = [](const Graph &g, node_id_t, edge_id_t) {
+    ASSERT_GT(g.get_num_cancelled(), 0);
+  };
+
+  auto &geometry = add("ClassGeometry", with([](TestConfiguration &c) { c.class_geometry = true; }));
+  geometry.num_trials = 5;
+  geometry.check = [](const Graph &, node_id_t, edge_id_t) {
+    ASSERT_TRUE(Sketch::uses_fixed_geometry());
+  };
+
+  auto &samples = add("AllSamples", with([](TestConfiguration &c) { c.sample_all = true; }));
+  samples.num_trials = 5;
+  samples.check = [](const Graph &g, node_id_t, edge_id_t) {
+    ASSERT_TRUE(Graph::get_sample_all());
+    ASSERT_GT(g.get_num_rounds(), 0);
+  };
+
+  // nodes with few edges hold them explicitly, the others are given supernodes. Dense
+  // enough for many nodes to be promoted, and sparse enough for none to be
+  struct { const char *name; bool backup_in_mem; double density; } exact_cases[] = {
+    {"ExactNodes", true, 0.03}, {"ExactNodesSparse", true, 0.002},
+    {"ExactNodesBackupOnDisk", false, 0.03}, {"ExactNodesSparseBackupOnDisk", false, 0.002}};
+  for (auto &e : exact_cases) {
+    bool backup_in_mem = e.backup_in_mem;
+    auto &exact = add(e.name, with([=](TestConfiguration &c) {
+                        c.backup_in_mem = backup_in_mem;
+                        c.exact_degree = 32;
+                      }));
+    exact.density = e.density;
+    exact.reheat = true;
+    exact.check = [](const Graph &, node_id_t, edge_id_t) {
+      ASSERT_EQ(32, Graph::get_exact_degree());
+    };
+  }
+
+  for (bool backup_in_mem : {true, false}) {
+    auto &adaptive = add(backup_in_mem ? "AdaptiveDepth" : "AdaptiveDepthBackupOnDisk",
+                         with([=](TestConfiguration &c) {
+                           c.backup_in_mem = backup_in_mem;
+                           c.adaptive_depth = true;
+                         }));
+    adaptive.reheat = true;
+    adaptive.check = [](const Graph &g, node_id_t n, edge_id_t) {
+      ASSERT_TRUE(Sketch::get_adaptive_depth());
+      ASSERT_EQ(DEPTH_MAJOR, Sketch::get_layout());
+      ASSERT_GT(g.get_supernode_bytes(), 0);
+      ASSERT_LT(g.get_supernode_bytes(), n * Supernode::get_size());
+    };
+  }
+
+  // graph workers each applying the batches of their own nodes
+  for (bool balanced : {false, true}) {
+    auto &owner = add(balanced ? "OwnerComputesBalanced" : "OwnerComputes",
+                      with([](TestConfiguration &c) {
+                        c.num_groups = 4;
+                        c.owner_computes = true;
+                      }));
+    owner.reserve = balanced;
+    owner.check = [](const Graph &g, node_id_t, edge_id_t m) {
+      ASSERT_TRUE(GraphWorker::get_owner_computes());
+      ASSERT_EQ(2 * m, g.num_updates);
+      ASSERT_GT(GraphWorker::get_num_forwarded(), 0);
+    };
+  }
+
+  // small batches packed together by the graph workers, with nodes holding their
+  // edges explicitly and promoted within a pack
+  auto &packing = add("BatchPacking", with([](TestConfiguration &c) {
+                        c.num_groups = 2;
+                        c.exact_degree = 4;
+                        c.pack_size = 16;
+                      }));
+  packing.num_trials = 5;
+  packing.density = 0.002;
+  packing.check = [](const Graph &, node_id_t, edge_id_t) {
+    ASSERT_EQ(16, GraphWorker::get_pack_size());
+  };
+
+  // the batches of hot nodes applied to partial supernodes of each graph worker
+  auto &hot = add("HotNodes", with([](TestConfiguration &c) {
+                    c.num_groups = 4;
+                    c.hot_node_updates = 64;
+                  }));
+  hot.reheat = true;
+  hot.check = [](const Graph &, node_id_t, edge_id_t) {
+    ASSERT_EQ(64, Graph::get_hot_updates());
+  };
+
+  // nodes prepared for the update counts of a prescan of a binary stream
+  auto &counts = add("UpdateCounts", with([](TestConfiguration &c) {
+                       c.exact_degree = 8;
+                       c.adaptive_depth = true;
+                     }));
+  counts.reserve = true;
+  counts.binary_stream = true;
+  counts.check = [](const Graph &g, node_id_t, edge_id_t m) {
+    ASSERT_EQ(2 * m, g.num_updates);
+  };
+  return cases;
+}();
+
+// Each configuration with both the GutterTree and StandAloneGutters
+class GraphCorrectnessTest : public testing::TestWithParam<std::tuple<bool, CorrectnessCase>> {
+
+};
+INSTANTIATE_TEST_SUITE_P(GraphTestSuite, GraphCorrectnessTest,
+                         testing::Combine(testing::Bool(), testing::ValuesIn(correctness_cases)),
+                         [](const testing::TestParamInfo<GraphCorrectnessTest::ParamType> &info) {
+                           return std::string(std::get<1>(info.param).name) +
+                                  (std::get<0>(info.param) ? "Tree" : "Gutters");
+                         });
+
+// Apply a random stream under the configuration, querying halfway through (which must
+// leave the graph as it was for the rest of the stream) and at the end
+TEST_P(GraphCorrectnessTest, TestCorrectness) {
+  const CorrectnessCase &c = std::get<1>(GetParam());
+  TestConfiguration config = c.config;
+  config.use_tree = std::get<0>(GetParam());
+  write_configuration(config);
+  size_t default_threshold = Supernode::get_in_place_threshold();
+  if (c.in_place_threshold > 0) Supernode::set_in_place_threshold(c.in_place_threshold);
+
+  for (int trial = 0; trial < c.num_trials; ++trial) {
+    generate_stream({1024, c.density, 0.5, 0, "./sample.txt", "./cumul_sample.txt"});
+    std::ifstream in{"./sample.txt"};
+    node_id_t n;
+    edge_id_t m;
+    in >> n >> m;
+    std::vector<GraphUpdate> stream(m);
+    std::vector<node_id_t> counts(n);
+    for (auto &upd : stream) {
+      int type;
+      in >> type >> upd.first.first >> upd.first.second;
+      upd.second = (UpdateType) type;
+      ++counts[upd.first.first];
+      ++counts[upd.first.second];
+    }
+
+    std::unique_ptr<BinaryGraphStream_MT> binary;
+    std::unique_ptr<MT_StreamReader> reader;
+    if (c.binary_stream) {
+      {
+        std::ofstream out{"./sample_binary", std::ios::binary};
+        uint32_t num_nodes = n;
+        uint64_t num_edges = m;
+        out.write(reinterpret_cast<char *>(&num_nodes), 4);
+        out.write(reinterpret_cast<char *>(&num_edges), 8);
+        for (auto &upd : stream) {
+          uint8_t u = upd.second;
+          uint32_t a = upd.first.first;
+          uint32_t b = upd.first.second;
+          out.write(reinterpret_cast<char *>(&u), 1);
+          out.write(reinterpret_cast<char *>(&a), 4);
+          out.write(reinterpret_cast<char *>(&b), 4);
+        }
+      }
+      // a buffer that does not divide the stream
+      binary.reset(new BinaryGraphStream_MT("./sample_binary", 1000));
+      ASSERT_EQ(counts, binary->update_counts(3));
+    }
+
+    Graph *g = new Graph(n);
+    if (c.reserve) g->reserve_updates(counts);
+    if (c.binary_stream) reader.reset(new MT_StreamReader(*binary));
+    MatGraphVerifier verify(n);
+    auto apply = [&](edge_id_t begin, edge_id_t end) {
+      for (edge_id_t i = begin; i < end; ++i) {
+        GraphUpdate upd = stream[i];
+        if (c.binary_stream) {
+          upd = reader->get_edge();
+        } else if (c.cancelling) {
+          g->update({upd.first, INSERT});
+          g->update({upd.first, DELETE});
+        }
+        g->update(upd);
+        verify.edge_update(upd.first.first, upd.first.second);
+      }
+    };
+
+    apply(0, m / 2);
+    verify.reset_cc_state();
+    g->set_verifier(std::make_unique<MatGraphVerifier>(verify));
+    g->connected_components(true);
+    apply(m / 2, m);
+    // checkpoints hold the graph as the next query would find it
+    if (c.reheat) g->write_binary("./out_temp.txt");
+    verify.reset_cc_state();
+    g->set_verifier(std::make_unique<MatGraphVerifier>(verify));
+    size_t num_ccs = g->connected_components(true).size();
+    if (c.check) c.check(*g, n, m);
+    delete g;
+
+    if (c.reheat) {
+      Graph reheated("./out_temp.txt");
+      verify.reset_cc_state();
+      reheated.set_verifier(std::make_unique<MatGraphVerifier>(verify));
+      ASSERT_EQ(num_ccs, reheated.connected_components().size());
+    }
+  }
+  Supernode::set_in_place_threshold(default_threshold);
+}
+
+// Every batch of a stream upon a single node's owner, forwarded through mailboxes
+// small enough to fill
+TEST_P(GraphTest, TestOwnerComputesSkewedStream) {
+  TestConfiguration config;
+  config.use_tree = GetParam();
+  config.num_groups = 4;
+  config.owner_computes = true;
+  write_configuration(config);
+  size_t default_capacity = GraphWorker::get_mail_capacity();
+  GraphWorker::set_mail_capacity(2);
+  node_id_t n = 1024;
+  MatGraphVerifier verify(n);
+  {
+    Graph g{n};
+    // a star upon node 0 inserted, deleted and inserted again
+    for (UpdateType type : {INSERT, DELETE, INSERT}) {
+      for (node_id_t i = 1; i < n; ++i) g.update({{0, i}, type});
+    }
+    for (node_id_t i = 1; i < n; ++i) verify.edge_update(0, i);
+    verify.reset_cc_state();
+    g.set_verifier(std::make_unique<MatGraphVerifier>(verify));
+    ASSERT_EQ(1, g.connected_components().size());
+    ASSERT_GT(GraphWorker::get_num_forwarded(), 0);
+    ASSERT_LE(GraphWorker::get_max_mail(), 2);
+  }
+  GraphWorker::set_mail_capacity(default_capacity);
+}
+
 TEST_P(GraphTest, TestCorrectnessOfReheating) {
   write_configuration(GetParam());
   int num_trials = 5;
@@ -189,9 +477,13 @@ TEST_P(GraphTest, TestCorrectnessOfReheating) {
 }
 
 // Test the multithreaded system by specifiying multiple
-// Graph Workers of size 2. Ingest a stream and run CC algorithm.
+// Graph Workers and a task pool of 2 threads. Ingest a stream and run CC algorithm.
 TEST_P(GraphTest, MultipleInserters) {
-  write_configuration(GetParam(), false, 4, 2);
+  TestConfiguration config;
+  config.use_tree = GetParam();
+  config.num_groups = 4;
+  config.pool_threads = 2;
+  write_configuration(config);
   int num_trials = 5;
   while(num_trials--) {
     generate_stream({1024,0.002,0.5,0,"./sample.txt","./cumul_sample.txt"});
@@ -282,3 +574,191 @@ TEST(GraphTest, TestQueryDuringStream) {
     g.connected_components();
   }
 }
+
+// Only nodes that are updated get a supernode, the others are singleton components
+TEST(GraphTest, TestUntouchedSupernodes) {
+  write_configuration(false, true);
+  node_id_t n = 1024;
+  MatGraphVerifier verify(n);
+  Graph *g = new Graph(n);
+  // a path over the even nodes below 200
+  for (node_id_t a = 0; a + 2 < 200; a += 2) {
+    g->update({{a, a + 2}, INSERT});
+    verify.edge_update(a, a + 2);
+  }
+  // an edge toggled twice leaves its endpoints without edges
+  g->update({{301, 303}, INSERT});
+  g->update({{301, 303}, DELETE});
+
+  verify.reset_cc_state();
+  g->set_verifier(std::make_unique<MatGraphVerifier>(verify));
+  ASSERT_EQ(n - 99, g->connected_components(true).size());
+  for (node_id_t i = 0; i < n; ++i) {
+    if (i < 200 && i % 2 == 0) {
+      ASSERT_NE(g->supernodes[i], nullptr);
+    } else if (i != 301 && i != 303) {
+      ASSERT_EQ(g->supernodes[i], nullptr);
+    }
+  }
+
+  // checkpoints hold only the supernodes of updated nodes
+  g->write_binary("./out_temp.txt");
+  delete g;
+  Graph reheated("./out_temp.txt");
+  for (node_id_t i = 0; i < n; ++i) {
+    if (i < 200 && i % 2 == 0) {
+      ASSERT_NE(reheated.supernodes[i], nullptr);
+    } else if (i != 301 && i != 303) {
+      ASSERT_EQ(reheated.supernodes[i], nullptr);
+    }
+  }
+  reheated.set_verifier(std::make_unique<MatGraphVerifier>(verify));
+  ASSERT_EQ(n - 99, reheated.connected_components().size());
+}
+
+TEST(GraphTest, TestCheckpointVersions) {
+  write_configuration(false, true);
+  node_id_t n = 64;
+  MatGraphVerifier verify(n);
+  Graph *g = new Graph(n);
+  // a path over every node so that the legacy format (every supernode) can be made
+  for (node_id_t a = 0; a + 1 < n; a += 1 + (a == 31)) {
+    g->update({{a, a + 1}, INSERT});
+    verify.edge_update(a, a + 1);
+  }
+  g->write_binary("./out_temp.txt");
+  delete g;
+
+  std::ifstream in("./out_temp.txt", std::ios::binary);
+  std::string file((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+  in.close();
+  size_t header = 2 * sizeof(uint32_t) + 4; // and the sketch settings
+  size_t graph_info = sizeof(uint64_t) + sizeof(node_id_t) + sizeof(vec_t);
+  size_t bitmap = (n + 7) / 8;
+
+  // the format before the header: no bitmap and no explicit edges
+  std::string legacy = file.substr(header, graph_info)
+    + file.substr(header + graph_info + bitmap,
+                  file.size() - header - graph_info - bitmap - sizeof(node_id_t));
+  std::ofstream("./out_temp_legacy.txt", std::ios::binary) << legacy;
+  {
+    Graph reheated("./out_temp_legacy.txt");
+    verify.reset_cc_state();
+    reheated.set_verifier(std::make_unique<MatGraphVerifier>(verify));
+    ASSERT_EQ(2, reheated.connected_components().size());
+  }
+
+  // a version this build does not know is refused
+  std::string future = file;
+  uint32_t version = 1000;
+  future.replace(sizeof(uint32_t), sizeof(version), (char *) &version, sizeof(version));
+  std::ofstream("./out_temp_future.txt", std::ios::binary) << future;
+  ASSERT_THROW(Graph("./out_temp_future.txt"), BadCheckpointException);
+  ASSERT_THROW(Graph("./does_not_exist.txt"), BadCheckpointException);
+}
+
+// A graph written under some sketch settings is refused under any others
+TEST(GraphTest, TestCheckpointSettings) {
+  TestConfiguration written;
+  written.hash_family = "tabulation";
+  written.class_geometry = true;
+  write_configuration(written);
+  node_id_t n = 64;
+  MatGraphVerifier verify(n);
+  {
+    Graph g(n);
+    for (node_id_t a = 0; a + 1 < n; ++a) {
+      g.update({{a, a + 1}, INSERT});
+      verify.edge_update(a, a + 1);
+    }
+    g.write_binary("./out_temp.txt");
+  }
+
+  TestConfiguration other_family = written;
+  other_family.hash_family = "xxh64";
+  TestConfiguration other_geometry = written;
+  other_geometry.class_geometry = false;
+  TestConfiguration other_hashing = written;
+  other_hashing.wide_hashing = true;
+  TestConfiguration other_depth = written;
+  other_depth.adaptive_depth = true;
+  for (auto &config : {other_family, other_geometry, other_hashing, other_depth}) {
+    write_configuration(config);
+    ASSERT_THROW(Graph("./out_temp.txt"), BadCheckpointException);
+  }
+
+  write_configuration(written);
+  {
+    Graph reheated("./out_temp.txt");
+    verify.reset_cc_state();
+    reheated.set_verifier(std::make_unique<MatGraphVerifier>(verify));
+    ASSERT_EQ(1, reheated.connected_components().size());
+  }
+  // the sketch tests run under the defaults
+  Sketch::set_hash_family(XXH64_HASH);
+  Sketch::set_geometry(EXACT_GEOMETRY);
+}
+
+TEST(GraphTest, TestHashKeysReleased) {
+  size_t initial_keys = Sketch::num_hash_keys();
+  for (std::string family : {"multiply_shift", "tabulation"}) {
+    TestConfiguration config;
+    config.hash_family = family;
+    write_configuration(config);
+    for (int i = 0; i < 8; ++i) {
+      node_id_t n = 64 << (i % 4); // the number of sketches grows with n
+      Graph g(n);
+      MatGraphVerifier verify(n);
+      for (node_id_t a = 0; a + 1 < n; ++a) {
+        g.update({{a, a + 1}, INSERT});
+        verify.edge_update(a, a + 1);
+      }
+      verify.reset_cc_state();
+      g.set_verifier(std::make_unique<MatGraphVerifier>(verify));
+      ASSERT_EQ(1, g.connected_components().size());
+      ASSERT_GT(Sketch::num_hash_keys(), initial_keys);
+    }
+    ASSERT_EQ(initial_keys, Sketch::num_hash_keys());
+  }
+  Sketch::set_hash_family(XXH64_HASH);
+}
+
+// GraphT needs nothing more of a sampler than the concept of SupernodeT, see OneSparseSampler
+TEST_P(GraphTest, TestOneSparseSampler) {
+  write_configuration(GetParam());
+  node_id_t n = 1024;
+  MatGraphVerifier verify(n);
+  auto *g = new GraphT<OneSparseSampler>(n);
+  // the cut of every node and component is at most one edge: a matching, plus edges
+  // between the pairs that are later deleted
+  for (node_id_t a = 0; a < n; a += 2) {
+    g->update({{a, a + 1}, INSERT});
+    verify.edge_update(a, a + 1);
+    g->update({{a + 1, (a + 2) % n}, INSERT});
+  }
+  for (node_id_t a = 0; a < n; a += 2) g->update({{a + 1, (a + 2) % n}, DELETE});
+  g->write_binary("./out_temp.txt");
+  verify.reset_cc_state();
+  g->set_verifier(std::make_unique<MatGraphVerifier>(verify));
+  ASSERT_EQ(n / 2, g->connected_components().size());
+  delete g;
+
+  GraphT<OneSparseSampler> reheated("./out_temp.txt");
+  verify.reset_cc_state();
+  reheated.set_verifier(std::make_unique<MatGraphVerifier>(verify));
+  ASSERT_EQ(n / 2, reheated.connected_components().size());
+}
+
+// the GraphWorkers pack batches by the threshold of the graph's own supernodes
+TEST(GraphTest, TestInPlaceThresholdOfSampler) {
+  write_configuration(TestConfiguration());
+  size_t sketch_threshold = Supernode::get_in_place_threshold();
+  size_t sampler_threshold = SupernodeT<OneSparseSampler>::get_in_place_threshold();
+  SupernodeT<OneSparseSampler>::set_in_place_threshold(sketch_threshold + 1);
+  {
+    GraphT<OneSparseSampler> g(64);
+    const GraphBase &base = g;
+    ASSERT_EQ(sketch_threshold + 1, base.get_in_place_threshold());
+  }
+  SupernodeT<OneSparseSampler>::set_in_place_threshold(sampler_threshold);
+}
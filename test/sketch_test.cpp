@@ -1,5 +1,7 @@
 #include "../include/l0_sampling/sketch.h"
+#include "../include/l0_sampling/sketch_kernels.h"
 #include <chrono>
+#include <set>
 #include <gtest/gtest.h>
 #include "../include/test/testing_vector.h"
 #include "../include/test/sketch_constructors.h"
@@ -299,6 +301,65 @@ TEST(SketchTestSuite, TestBatchUpdate) {
   ASSERT_EQ(*sketch, *sketch_batch);
 }
 
+TEST(SketchTestSuite, TestKernelsMatchScalar) {
+  unsigned long vec_size = 1000000000, num_updates = 1000;
+  Sketch::configure(vec_size * vec_size, fail_factor);
+  srand(time(nullptr));
+  std::vector<vec_t> updates(num_updates);
+  for (unsigned long i = 0; i < num_updates; i++) {
+    updates[i] = static_cast<vec_t>(rand() % vec_size) * vec_size + rand() % vec_size;
+  }
+  long sketch_seed = rand();
+  SketchUniquePtr sketch = makeSketch(sketch_seed);
+  for (const vec_t& update : updates) {
+    sketch->update(update);
+  }
+
+  SketchKernels::KernelISA best = SketchKernels::detect_isa();
+  std::vector<col_hash_t> col_hashes(num_updates);
+  std::vector<vec_hash_t> idx_hashes(num_updates);
+  std::vector<wide_hash_t> wide(num_updates);
+  for (unsigned long i = 0; i < num_updates; i++) {
+    wide[i] = Bucket_Boruvka::wide_index_hash(updates[i]);
+  }
+  for (int isa = SketchKernels::SCALAR; isa <= best; isa++) {
+    ASSERT_TRUE(SketchKernels::set_isa((SketchKernels::KernelISA) isa));
+    // use an odd length to exercise the scalar remainder of the kernels
+    SketchKernels::col_index_hash_batch(updates.data(), num_updates - 3, sketch_seed + 1, col_hashes.data());
+    SketchKernels::index_hash_batch(updates.data(), num_updates - 3, sketch_seed, idx_hashes.data());
+    for (unsigned long i = 0; i < num_updates - 3; i++) {
+      ASSERT_EQ(col_hashes[i], Bucket_Boruvka::col_index_hash(updates[i], sketch_seed + 1))
+        << SketchKernels::isa_name((SketchKernels::KernelISA) isa);
+      ASSERT_EQ(idx_hashes[i], Bucket_Boruvka::index_hash(updates[i], sketch_seed))
+        << SketchKernels::isa_name((SketchKernels::KernelISA) isa);
+    }
+    uint64_t key = Bucket_Boruvka::wide_key(sketch_seed + 1);
+    SketchKernels::wide_col_index_hash_batch(wide.data(), num_updates - 3, key, col_hashes.data());
+    for (unsigned long i = 0; i < num_updates - 3; i++) {
+      ASSERT_EQ(col_hashes[i], Bucket_Boruvka::wide_col_index_hash(wide[i], key))
+        << SketchKernels::isa_name((SketchKernels::KernelISA) isa);
+    }
+
+    // 3 blocks of 203 bytes, 256 bytes apart, to exercise the scalar remainder
+    std::vector<char> dst(3 * 256), src(3 * 256);
+    for (size_t i = 0; i < dst.size(); i++) {
+      dst[i] = rand();
+      src[i] = rand();
+    }
+    std::vector<char> expected = dst;
+    for (size_t b = 0; b < 3; b++)
+      for (size_t i = 0; i < 203; i++)
+        expected[b * 256 + i] ^= src[b * 256 + i];
+    SketchKernels::xor_blocks(dst.data(), src.data(), 203, 3, 256);
+    ASSERT_EQ(dst, expected) << SketchKernels::isa_name((SketchKernels::KernelISA) isa);
+
+    SketchUniquePtr sketch_batch = makeSketch(sketch_seed);
+    sketch_batch->batch_update(updates);
+    ASSERT_EQ(*sketch, *sketch_batch) << SketchKernels::isa_name((SketchKernels::KernelISA) isa);
+  }
+  SketchKernels::set_isa(best);
+}
+
 TEST(SketchTestSuite, TestSerialization) {
   printf("starting test!\n");
   unsigned long vec_size = 1024*1024;
@@ -319,3 +380,371 @@ TEST(SketchTestSuite, TestSerialization) {
 
   ASSERT_EQ(*sketch, *reheated);
 }
+
+TEST(SketchTestSuite, TestDepthMajorLayout) {
+  unsigned long vec_size = 1024*1024;
+  unsigned long num_updates = 10000;
+  Sketch::configure(vec_size * vec_size, fail_factor);
+  Testing_Vector test_vec = Testing_Vector(vec_size, num_updates);
+  std::vector<vec_t> updates(num_updates);
+  for (unsigned long j = 0; j < num_updates; j++) {
+    updates[j] = test_vec.get_update(j);
+  }
+  auto seed = rand();
+
+  SketchUniquePtr col_major = makeSketch(seed);
+  col_major->batch_update(updates);
+  auto file = std::fstream("./out_sketch.txt", std::ios::out | std::ios::binary);
+  col_major->write_binary(file);
+  file.close();
+
+  Sketch::set_layout(DEPTH_MAJOR);
+  SketchUniquePtr depth_major = makeSketch(seed);
+  SketchUniquePtr depth_major_batch = makeSketch(seed);
+  for (const vec_t& update : updates) {
+    depth_major->update(update);
+  }
+  depth_major_batch->batch_update(updates);
+  ASSERT_EQ(*depth_major, *depth_major_batch);
+
+  // a column major file is read into the depth major layout
+  auto in_file = std::fstream("./out_sketch.txt", std::ios::in | std::ios::binary);
+  SketchUniquePtr reheated = makeSketch(seed, in_file);
+  ASSERT_EQ(*depth_major, *reheated);
+
+  // adding a sketch of the same vector cancels every bucket
+  *reheated += *depth_major;
+  ASSERT_EQ(reheated->query().second, ZERO);
+
+  // a depth major sketch serializes to the same bytes as a column major one
+  file = std::fstream("./out_sketch_depth.txt", std::ios::out | std::ios::binary);
+  depth_major->write_binary(file);
+  file.close();
+  std::ifstream col_in("./out_sketch.txt", std::ios::binary);
+  std::ifstream depth_in("./out_sketch_depth.txt", std::ios::binary);
+  std::string col_bytes((std::istreambuf_iterator<char>(col_in)), std::istreambuf_iterator<char>());
+  std::string depth_bytes((std::istreambuf_iterator<char>(depth_in)), std::istreambuf_iterator<char>());
+  ASSERT_EQ(col_bytes, depth_bytes);
+
+  std::pair<vec_t, SampleSketchRet> depth_ret = depth_major->query();
+  Sketch::set_layout(COLUMN_MAJOR);
+  ASSERT_EQ(depth_ret, col_major->query());
+}
+
+TEST(SketchTestSuite, TestAdaptiveDepth) {
+  unsigned long vec_size = 1024*1024, num_sketches = 8;
+  Sketch::configure(vec_size * vec_size, fail_factor);
+  Sketch::set_layout(DEPTH_MAJOR);
+  Sketch::set_adaptive_depth(true);
+  ASSERT_EQ(Sketch::initial_rows(), 0);
+  long sketch_seed = rand();
+
+  // the adaptive sketches are placed one after another as within a supernode
+  std::vector<SketchUniquePtr> full;
+  std::vector<char> buffer(num_sketches * Sketch::sketchSizeof());
+  for (unsigned long i = 0; i < num_sketches; i++) {
+    full.push_back(makeSketch(sketch_seed + i));
+    Sketch::makeSketch(buffer.data() + i * Sketch::sketchSizeof(0), sketch_seed + i, 0);
+  }
+  auto adaptive = [&](size_t i) {
+    Sketch *first = reinterpret_cast<Sketch*>(buffer.data());
+    return reinterpret_cast<Sketch*>(buffer.data() + i * Sketch::sketchSizeof(first->get_rows()));
+  };
+
+  // batches applied one update at a time and one bucket write at a time
+  for (unsigned long num_updates : {1, 10, 200}) {
+    std::vector<vec_t> updates(num_updates);
+    for (unsigned long j = 0; j < num_updates; j++) {
+      updates[j] = static_cast<vec_t>(rand() % vec_size);
+    }
+    std::vector<char> hashes(num_sketches * num_updates * Sketch::hashed_update_size());
+    size_t rows = adaptive(0)->get_rows();
+    for (unsigned long i = 0; i < num_sketches; i++) {
+      full[i]->batch_update(updates);
+      Sketch::hash_updates(sketch_seed + i, updates.data(), num_updates,
+                           hashes.data() + i * num_updates * Sketch::hashed_update_size(),
+                           Sketch::hashed_update_size());
+      rows = std::max(rows, Sketch::hashed_rows(hashes.data() + i * num_updates *
+                                                Sketch::hashed_update_size(), num_updates,
+                                                Sketch::hashed_update_size()));
+    }
+    Sketch::resize_sketches(adaptive(0), num_sketches, rows);
+    for (unsigned long i = 0; i < num_sketches; i++) {
+      adaptive(i)->apply_hashed(updates.data(), num_updates, hashes.data() + i * num_updates *
+                                Sketch::hashed_update_size(), Sketch::hashed_update_size());
+      ASSERT_EQ(*full[i], *adaptive(i)) << "sketch " << i;
+      ASSERT_EQ(full[i]->used_rows(), adaptive(i)->used_rows());
+    }
+  }
+  // the deep depths of a sketch of few updates are not held
+  size_t rows = adaptive(0)->get_rows();
+  ASSERT_LT(rows, Sketch::max_rows());
+  ASSERT_LT(Sketch::sketchSizeof(rows), Sketch::sketchSizeof());
+
+  // shrinking to the depths in use and growing again keeps every bucket
+  size_t used = 0;
+  for (unsigned long i = 0; i < num_sketches; i++) used = std::max(used, adaptive(i)->used_rows());
+  Sketch::resize_sketches(adaptive(0), num_sketches, used);
+  Sketch::resize_sketches(adaptive(0), num_sketches, Sketch::max_rows());
+  Sketch::resize_sketches(adaptive(0), num_sketches, rows);
+  for (unsigned long i = 0; i < num_sketches; i++) {
+    ASSERT_EQ(*full[i], *adaptive(i)) << "sketch " << i;
+  }
+
+  // a sketch serializes with every depth
+  auto file = std::fstream("./out_sketch.txt", std::ios::out | std::ios::binary);
+  full[0]->write_binary(file);
+  file.close();
+  file = std::fstream("./out_sketch_adaptive.txt", std::ios::out | std::ios::binary);
+  adaptive(0)->write_binary(file);
+  file.close();
+  std::ifstream full_in("./out_sketch.txt", std::ios::binary);
+  std::ifstream adaptive_in("./out_sketch_adaptive.txt", std::ios::binary);
+  std::string full_bytes((std::istreambuf_iterator<char>(full_in)), std::istreambuf_iterator<char>());
+  std::string adaptive_bytes((std::istreambuf_iterator<char>(adaptive_in)),
+                             std::istreambuf_iterator<char>());
+  ASSERT_EQ(full_bytes, adaptive_bytes);
+
+  // and queries as a sketch that holds every depth
+  std::vector<Sketch*> batch;
+  for (unsigned long i = 0; i < num_sketches; i++) batch.push_back(adaptive(i));
+  std::vector<std::pair<vec_t, SampleSketchRet>> ret(num_sketches);
+  Sketch::query_batch(batch.data(), num_sketches, ret.data());
+  for (unsigned long i = 0; i < num_sketches; i++) {
+    ASSERT_EQ(ret[i], full[i]->query()) << "sketch " << i;
+  }
+  Sketch::set_adaptive_depth(false);
+  Sketch::set_layout(COLUMN_MAJOR);
+}
+
+TEST(SketchTestSuite, TestWideHashing) {
+  Sketch::set_hashing(WIDE_HASHING);
+  srand(time(nullptr));
+  test_sketch_sample(10000, 100, 100, 0.005, 0.02);
+  test_sketch_addition(10000, 100, 100, 0.005, 0.02);
+
+  unsigned long vec_size = 1024*1024;
+  unsigned long num_updates = 10000;
+  Sketch::configure(vec_size * vec_size, fail_factor);
+  Testing_Vector test_vec = Testing_Vector(vec_size, num_updates);
+  std::vector<vec_t> updates(num_updates);
+  for (unsigned long j = 0; j < num_updates; j++) {
+    updates[j] = test_vec.get_update(j);
+  }
+  auto seed = rand();
+  for (SketchLayout layout : {COLUMN_MAJOR, DEPTH_MAJOR}) {
+    Sketch::set_layout(layout);
+    SketchUniquePtr sketch = makeSketch(seed);
+    SketchUniquePtr sketch_batch = makeSketch(seed);
+    SketchUniquePtr sketch_hashed = makeSketch(seed);
+    for (const vec_t& update : updates) {
+      sketch->update(update);
+    }
+    sketch_batch->batch_update(updates);
+    size_t stride = Sketch::hashed_update_size();
+    std::vector<char> hashes(num_updates * stride);
+    Sketch::hash_updates(seed, updates.data(), num_updates, hashes.data(), stride);
+    sketch_hashed->apply_hashed(updates.data(), num_updates, hashes.data(), stride);
+    ASSERT_EQ(*sketch, *sketch_batch);
+    ASSERT_EQ(*sketch, *sketch_hashed);
+  }
+  Sketch::set_layout(COLUMN_MAJOR);
+  Sketch::set_hashing(COLUMN_HASHING);
+}
+
+TEST(SketchTestSuite, TestHashFamilies) {
+  for (HashFamily family : {XXH3_HASH, MULTIPLY_SHIFT_HASH, TABULATION_HASH}) {
+    Sketch::set_hash_family(family);
+    srand(time(nullptr));
+    test_sketch_sample(10000, 100, 100, 0.005, 0.02);
+    test_sketch_addition(10000, 100, 100, 0.005, 0.02);
+
+    unsigned long vec_size = 1024*1024;
+    unsigned long num_updates = 10000;
+    Sketch::configure(vec_size * vec_size, fail_factor);
+    Testing_Vector test_vec = Testing_Vector(vec_size, num_updates);
+    std::vector<vec_t> updates(num_updates);
+    for (unsigned long j = 0; j < num_updates; j++) {
+      updates[j] = test_vec.get_update(j);
+    }
+    auto seed = rand();
+    SketchUniquePtr sketch = makeSketch(seed);
+    SketchUniquePtr sketch_batch = makeSketch(seed);
+    SketchUniquePtr sketch_hashed = makeSketch(seed);
+    for (const vec_t& update : updates) {
+      sketch->update(update);
+    }
+    sketch_batch->batch_update(updates);
+    size_t stride = Sketch::hashed_update_size();
+    std::vector<char> hashes(num_updates * stride);
+    Sketch::hash_updates(seed, updates.data(), num_updates, hashes.data(), stride);
+    sketch_hashed->apply_hashed(updates.data(), num_updates, hashes.data(), stride);
+    ASSERT_EQ(*sketch, *sketch_batch) << hash_family_name(family);
+    ASSERT_EQ(*sketch, *sketch_hashed) << hash_family_name(family);
+  }
+  Sketch::set_hash_family(XXH64_HASH);
+}
+
+TEST(SketchTestSuite, TestSuffixXorBatch) {
+  unsigned long vec_size = 1024*1024;
+  Sketch::configure(vec_size * vec_size, fail_factor);
+  size_t default_threshold = Sketch::get_suffix_xor_threshold();
+  for (SketchHashing hashing : {COLUMN_HASHING, WIDE_HASHING}) {
+    Sketch::set_hashing(hashing);
+    for (unsigned long num_updates : {1, 63, 64, 1000}) {
+      Testing_Vector test_vec = Testing_Vector(vec_size, num_updates);
+      std::vector<vec_t> updates(num_updates);
+      for (unsigned long j = 0; j < num_updates; j++) {
+        updates[j] = test_vec.get_update(j);
+      }
+      auto seed = rand();
+      SketchUniquePtr sketch = makeSketch(seed);
+      for (const vec_t& update : updates) {
+        sketch->update(update);
+      }
+      size_t stride = Sketch::hashed_update_size();
+      std::vector<char> hashes(num_updates * stride);
+      Sketch::hash_updates(seed, updates.data(), num_updates, hashes.data(), stride);
+
+      // force every batch to use the suffix xor kernel
+      Sketch::set_suffix_xor_threshold(1);
+      SketchUniquePtr sketch_batch = makeSketch(seed);
+      SketchUniquePtr sketch_hashed = makeSketch(seed);
+      sketch_batch->batch_update(updates);
+      sketch_hashed->apply_hashed(updates.data(), num_updates, hashes.data(), stride);
+      Sketch::set_suffix_xor_threshold(default_threshold);
+      ASSERT_EQ(*sketch, *sketch_batch) << num_updates;
+      ASSERT_EQ(*sketch, *sketch_hashed) << num_updates;
+    }
+  }
+  Sketch::set_hashing(COLUMN_HASHING);
+}
+
+TEST(SketchTestSuite, TestFixedGeometry) {
+  unsigned long num_updates = 1000;
+  SketchGeometry default_geometry = Sketch::get_geometry();
+  for (SketchLayout layout : {COLUMN_MAJOR, DEPTH_MAJOR}) {
+    Sketch::set_layout(layout);
+    // the number of nodes of each geometry class
+    for (unsigned long num_nodes : {1ul << 16, 1ul << 20, 1ul << 24, 1ul << 28}) {
+      unsigned long vec_size = num_nodes * num_nodes;
+      std::vector<vec_t> updates(num_updates);
+      for (unsigned long i = 0; i < num_updates; i++) {
+        updates[i] = static_cast<vec_t>(rand() % num_nodes) * num_nodes + rand() % num_nodes;
+      }
+      long sketch_seed = rand();
+
+      Sketch::set_geometry(DYNAMIC_GEOMETRY);
+      Sketch::configure(vec_size, fail_factor);
+      ASSERT_FALSE(Sketch::uses_fixed_geometry());
+      SketchUniquePtr sketch = makeSketch(sketch_seed);
+      for (const vec_t& update : updates) {
+        sketch->update(update);
+      }
+
+      Sketch::set_geometry(EXACT_GEOMETRY);
+      Sketch::configure(vec_size, fail_factor);
+      ASSERT_TRUE(Sketch::uses_fixed_geometry()) << num_nodes;
+      SketchUniquePtr sketch_fixed = makeSketch(sketch_seed);
+      SketchUniquePtr sketch_fixed_batch = makeSketch(sketch_seed);
+      for (const vec_t& update : updates) {
+        sketch_fixed->update(update);
+      }
+      sketch_fixed_batch->batch_update(updates);
+      ASSERT_EQ(*sketch, *sketch_fixed);
+      ASSERT_EQ(*sketch, *sketch_fixed_batch);
+      ASSERT_EQ(sketch->query(), sketch_fixed->query());
+    }
+  }
+
+  // smaller graphs are rounded up to the first class
+  Sketch::set_layout(COLUMN_MAJOR);
+  Sketch::set_geometry(CLASS_GEOMETRY);
+  unsigned long num_nodes = 1000;
+  Sketch::configure(num_nodes * num_nodes, fail_factor);
+  ASSERT_TRUE(Sketch::uses_fixed_geometry());
+  SketchUniquePtr sketch = makeSketch(rand());
+  sketch->update(5 * num_nodes + 7);
+  ASSERT_EQ(sketch->query(), std::make_pair((vec_t) 5 * num_nodes + 7, GOOD));
+  Sketch::set_geometry(default_geometry);
+}
+
+TEST(SketchTestSuite, TestQueryBatch) {
+  unsigned long vec_size = 1000000, num_sketches = 100;
+  Sketch::configure(vec_size, fail_factor);
+  for (SketchHashing hashing : {COLUMN_HASHING, WIDE_HASHING}) {
+    Sketch::set_hashing(hashing);
+    // two groups of sketches that share a seed, with between 0 and 199 updates each
+    long seeds[2] = {rand(), rand()};
+    std::vector<SketchUniquePtr> sketches;
+    std::vector<SketchUniquePtr> copies;
+    std::vector<Sketch*> batch;
+    for (unsigned long i = 0; i < num_sketches; i++) {
+      sketches.push_back(makeSketch(seeds[i * 2 / num_sketches]));
+      for (unsigned long j = 0; j < (i * 7) % 200; j++) {
+        sketches[i]->update(static_cast<vec_t>(rand() % vec_size));
+      }
+      copies.push_back(makeSketch(seeds[i * 2 / num_sketches]));
+      *copies[i] += *sketches[i];
+      batch.push_back(sketches[i].get());
+    }
+
+    std::vector<std::pair<vec_t, SampleSketchRet>> ret(num_sketches);
+    Sketch::query_batch(batch.data(), num_sketches, ret.data());
+    for (unsigned long i = 0; i < num_sketches; i++) {
+      ASSERT_EQ(ret[i], copies[i]->query()) << "sketch " << i;
+    }
+    ASSERT_THROW(Sketch::query_batch(batch.data(), num_sketches, ret.data()),
+                 MultipleQueryException);
+  }
+  Sketch::set_hashing(COLUMN_HASHING);
+}
+
+TEST(SketchTestSuite, TestQueryAllBatch) {
+  unsigned long vec_size = 1000000, num_sketches = 100;
+  Sketch::configure(vec_size, fail_factor);
+  for (SketchHashing hashing : {COLUMN_HASHING, WIDE_HASHING}) {
+    Sketch::set_hashing(hashing);
+    long sketch_seed = rand();
+    std::vector<SketchUniquePtr> sketches;
+    std::vector<SketchUniquePtr> copies;
+    std::vector<std::set<vec_t>> nonzero(num_sketches);
+    std::vector<Sketch*> batch;
+    for (unsigned long i = 0; i < num_sketches; i++) {
+      sketches.push_back(makeSketch(sketch_seed));
+      for (unsigned long j = 0; j < (i * 7) % 200; j++) {
+        vec_t update = static_cast<vec_t>(rand() % vec_size);
+        sketches[i]->update(update);
+        if (!nonzero[i].erase(update)) nonzero[i].insert(update);
+      }
+      copies.push_back(makeSketch(sketch_seed));
+      *copies[i] += *sketches[i];
+      batch.push_back(sketches[i].get());
+    }
+
+    std::vector<std::pair<vec_t, SampleSketchRet>> ret(num_sketches);
+    std::vector<std::vector<vec_t>> samples(num_sketches);
+    Sketch::query_all_batch(batch.data(), num_sketches, ret.data(), samples.data());
+    size_t num_good = 0, num_samples = 0;
+    for (unsigned long i = 0; i < num_sketches; i++) {
+      // the first sample is the one query returns
+      ASSERT_EQ(ret[i], copies[i]->query()) << "sketch " << i;
+      if (ret[i].second != GOOD) {
+        ASSERT_TRUE(samples[i].empty());
+        continue;
+      }
+      ASSERT_EQ(samples[i][0], ret[i].first);
+      std::set<vec_t> distinct(samples[i].begin(), samples[i].end());
+      ASSERT_EQ(distinct.size(), samples[i].size());
+      for (vec_t sample : samples[i])
+        ASSERT_EQ(nonzero[i].count(sample), 1) << "sketch " << i;
+      ++num_good;
+      num_samples += samples[i].size();
+    }
+    // most sketches with many nonzero indices hold more than one sample
+    ASSERT_GT(num_samples, 2 * num_good);
+    ASSERT_THROW(Sketch::query_all_batch(batch.data(), num_sketches, ret.data(), samples.data()),
+                 MultipleQueryException);
+  }
+  Sketch::set_hashing(COLUMN_HASHING);
+}
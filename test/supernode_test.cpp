@@ -3,7 +3,7 @@
 #include <chrono>
 #include <thread>
 #include "../include/supernode.h"
-#include "../include/graph_worker.h"
+#include "../include/task_pool.h"
 
 const long seed = 7000000001;
 const unsigned long long int num_nodes = 2000;
@@ -163,6 +163,37 @@ void inline apply_delta_to_node(Supernode* node, const std::vector<vec_t>& updat
   free(loc);
 }
 
+TEST_F(SupernodeTestSuite, TestSampleBatch) {
+  size_t num_supernodes = 20;
+  std::vector<Supernode*> nodes;
+  std::vector<Supernode*> copies;
+  for (size_t i = 0; i < num_supernodes; ++i) {
+    nodes.push_back(Supernode::makeSupernode(num_nodes, seed));
+    for (size_t j = 0; j < i * i; ++j) {
+      const Edge &edge = (*graph_edges)[rand() % graph_edges->size()];
+      nodes[i]->update(nondirectional_non_self_edge_pairing_fn(edge.first, edge.second));
+    }
+    copies.push_back(Supernode::makeSupernode(*nodes[i]));
+  }
+  // a supernode a query ahead of the rest queries a sketch with a different seed
+  nodes[0]->sample();
+  copies[0]->sample();
+
+  std::vector<std::pair<Edge, SampleSketchRet>> samples(num_supernodes);
+  while (!nodes[0]->out_of_queries()) {
+    Supernode::sample_batch(nodes.data(), num_supernodes, samples.data());
+    for (size_t i = 0; i < num_supernodes; ++i) {
+      ASSERT_EQ(samples[i], copies[i]->sample()) << "supernode " << i;
+    }
+  }
+  ASSERT_THROW(Supernode::sample_batch(nodes.data(), num_supernodes, samples.data()),
+               OutOfQueriesException);
+  for (size_t i = 0; i < num_supernodes; ++i) {
+    free(nodes[i]);
+    free(copies[i]);
+  }
+}
+
 TEST_F(SupernodeTestSuite, TestBatchUpdate) {
   unsigned long vec_size = 1000000000, num_updates = 100000;
   srand(time(nullptr));
@@ -190,6 +221,57 @@ TEST_F(SupernodeTestSuite, TestBatchUpdate) {
   }
 }
 
+TEST_F(SupernodeTestSuite, TestHashedDelta) {
+  unsigned long vec_size = 1000000000, num_updates = 10000;
+  std::vector<vec_t> updates(num_updates);
+  for (unsigned long i = 0; i < num_updates; i++) {
+    updates[i] = static_cast<vec_t>(rand() % vec_size);
+  }
+  Supernode::configure(vec_size);
+  Supernode* supernode = Supernode::makeSupernode(vec_size, seed);
+  Supernode* supernode_hashed = Supernode::makeSupernode(vec_size, seed);
+  apply_delta_to_node(supernode, updates);
+
+  // the hashes depend only upon the seed so hash with a different supernode
+  std::vector<char> bundles(num_updates * Supernode::get_bundle_size());
+  Supernode::hash_updates(vec_size, seed, updates.data(), num_updates, bundles.data());
+  auto* loc = (Supernode*) malloc(Supernode::get_size());
+  Supernode::delta_supernode(vec_size, seed, updates, bundles.data(), loc);
+  supernode_hashed->apply_delta_update(loc);
+  free(loc);
+
+  for (int i=0;i<supernode->get_num_sktch();++i) {
+    ASSERT_EQ(*supernode->get_sketch(i), *supernode_hashed->get_sketch(i));
+  }
+  free(supernode);
+  free(supernode_hashed);
+}
+
+TEST_F(SupernodeTestSuite, TestInPlaceUpdate) {
+  unsigned long vec_size = 1000000000, num_updates = 10000, batch_size = 10;
+  std::vector<vec_t> updates(num_updates);
+  for (unsigned long i = 0; i < num_updates; i++) {
+    updates[i] = static_cast<vec_t>(rand() % vec_size);
+  }
+  Supernode::configure(vec_size);
+  Supernode* supernode = Supernode::makeSupernode(vec_size, seed);
+  Supernode* supernode_in_place = Supernode::makeSupernode(vec_size, seed);
+  apply_delta_to_node(supernode, updates);
+
+  // apply the updates to a supernode that already holds earlier batches
+  std::vector<char> bundles(batch_size * Supernode::get_bundle_size());
+  for (unsigned long i = 0; i < num_updates; i += batch_size) {
+    Supernode::hash_updates(vec_size, seed, updates.data() + i, batch_size, bundles.data());
+    supernode_in_place->apply_hashed_updates(updates.data() + i, batch_size, bundles.data());
+  }
+
+  for (int i=0;i<supernode->get_num_sktch();++i) {
+    ASSERT_EQ(*supernode->get_sketch(i), *supernode_in_place->get_sketch(i));
+  }
+  free(supernode);
+  free(supernode_in_place);
+}
+
 TEST_F(SupernodeTestSuite, TestConcurrency) {
   int num_threads_per_group = 2;
   unsigned num_threads =
@@ -210,7 +292,7 @@ TEST_F(SupernodeTestSuite, TestConcurrency) {
   Supernode *supernode = Supernode::makeSupernode(vec_len, seed);
   Supernode *piecemeal = Supernode::makeSupernode(vec_len, seed);
 
-  GraphWorker::set_config(0,num_threads_per_group); // set number of threads per omp parallel
+  TaskPool::set_num_threads(num_threads_per_group); // number of threads per delta supernode
 
   // concurrently run batch_updates
   std::thread thd[num_threads];
@@ -234,6 +316,49 @@ TEST_F(SupernodeTestSuite, TestConcurrency) {
   }
 }
 
+// Threads adding deltas to and updating in place a supernode whose sketches grow
+TEST_F(SupernodeTestSuite, TestConcurrentDeltas) {
+  Sketch::set_layout(DEPTH_MAJOR);
+  Sketch::set_adaptive_depth(true);
+  unsigned num_threads = 4;
+  size_t num_batches = 20, delta_size = 300, in_place_size = 10;
+  std::vector<std::vector<vec_t>> batches(num_threads * num_batches);
+  for (size_t b = 0; b < batches.size(); ++b) {
+    batches[b].resize(b % 2 ? in_place_size : delta_size);
+    for (auto &upd : batches[b]) {
+      const Edge &edge = (*graph_edges)[rand() % graph_edges->size()];
+      upd = nondirectional_non_self_edge_pairing_fn(edge.first, edge.second);
+    }
+  }
+  Supernode* supernode = Supernode::makeSupernode(num_nodes, seed);
+  Supernode* concurrent = Supernode::makeSupernode(num_nodes, seed);
+  for (auto &batch : batches) apply_delta_to_node(supernode, batch);
+
+  std::vector<std::thread> threads;
+  for (unsigned t = 0; t < num_threads; ++t) {
+    threads.emplace_back([&, t]() {
+      std::vector<char> bundles(in_place_size * Supernode::get_bundle_size());
+      for (size_t b = t; b < batches.size(); b += num_threads) {
+        if (batches[b].size() == delta_size) {
+          apply_delta_to_node(concurrent, batches[b]);
+          continue;
+        }
+        Supernode::hash_updates(num_nodes, seed, batches[b].data(), in_place_size, bundles.data());
+        concurrent->apply_hashed_updates(batches[b].data(), in_place_size, bundles.data());
+      }
+    });
+  }
+  for (auto &thr : threads) thr.join();
+
+  for (int i = 0; i < supernode->get_num_sktch(); ++i) {
+    ASSERT_EQ(*supernode->get_sketch(i), *concurrent->get_sketch(i));
+  }
+  Sketch::set_adaptive_depth(false);
+  Sketch::set_layout(COLUMN_MAJOR);
+  free(supernode);
+  free(concurrent);
+}
+
 TEST_F(SupernodeTestSuite, TestSerialization) {
   std::vector<Supernode*> snodes;
   snodes.reserve(num_nodes);
@@ -262,3 +387,75 @@ TEST_F(SupernodeTestSuite, TestSerialization) {
     ASSERT_EQ(*snodes[num_nodes / 2]->get_sketch(i), *reheated->get_sketch(i));
   }
 }
+
+TEST_F(SupernodeTestSuite, TestAdaptiveDepth) {
+  Sketch::set_layout(DEPTH_MAJOR);
+  // the edges of a node to its even and odd multiples
+  node_id_t node = 3;
+  std::vector<vec_t> even;
+  std::vector<vec_t> odd;
+  for (auto edge : *graph_edges) {
+    if (edge.first != node) continue;
+    vec_t encoded = nondirectional_non_self_edge_pairing_fn(edge.first, edge.second);
+    ((edge.second / node) % 2 ? odd : even).push_back(encoded);
+  }
+  Supernode* full = Supernode::makeSupernode(num_nodes, seed);
+  Supernode* full_odd = Supernode::makeSupernode(num_nodes, seed);
+  apply_delta_to_node(full, even);
+  for (vec_t upd : odd) full_odd->update(upd);
+
+  Sketch::set_adaptive_depth(true);
+  Supernode* adaptive = Supernode::makeSupernode(num_nodes, seed);
+  Supernode* adaptive_odd = Supernode::makeSupernode(num_nodes, seed);
+  ASSERT_EQ(adaptive->get_sketch(0)->get_rows(), 0);
+  ASSERT_LT(adaptive->get_bytes(), Supernode::get_size() / 10);
+
+  // grown by batches applied in place, delta supernodes and single updates
+  size_t batch_size = 10;
+  std::vector<char> bundles(batch_size * Supernode::get_bundle_size());
+  for (size_t i = 0; i < 100; i += batch_size) {
+    Supernode::hash_updates(num_nodes, seed, even.data() + i, batch_size, bundles.data());
+    adaptive->apply_hashed_updates(even.data() + i, batch_size, bundles.data());
+  }
+  apply_delta_to_node(adaptive, std::vector<vec_t>(even.begin() + 100, even.end()));
+  for (vec_t upd : odd) adaptive_odd->update(upd);
+  for (int i = 0; i < full->get_num_sktch(); ++i) {
+    ASSERT_EQ(*full->get_sketch(i), *adaptive->get_sketch(i));
+    ASSERT_EQ(*full_odd->get_sketch(i), *adaptive_odd->get_sketch(i));
+  }
+  ASSERT_LT(adaptive->get_bytes(), Supernode::get_size());
+  ASSERT_LT(adaptive->get_sketch(0)->get_rows(), Sketch::max_rows());
+
+  // merging grows to the depths of either supernode
+  size_t rows = std::max(adaptive->get_sketch(0)->get_rows(),
+                         adaptive_odd->get_sketch(0)->get_rows());
+  full->merge(*full_odd);
+  adaptive->merge(*adaptive_odd);
+  ASSERT_EQ(adaptive->get_sketch(0)->get_rows(), rows);
+  for (int i = 0; i < full->get_num_sktch(); ++i) {
+    ASSERT_EQ(*full->get_sketch(i), *adaptive->get_sketch(i));
+  }
+
+  // read back with the depths in use
+  auto file = std::fstream("./out_supernode.txt", std::ios::out | std::ios::binary);
+  adaptive->write_binary(file);
+  file.close();
+  auto in_file = std::fstream("./out_supernode.txt", std::ios::in | std::ios::binary);
+  Supernode* reheated = Supernode::makeSupernode(num_nodes, seed, in_file);
+  ASSERT_LE(reheated->get_sketch(0)->get_rows(), rows);
+  for (int i = 0; i < full->get_num_sktch(); ++i) {
+    ASSERT_EQ(*full->get_sketch(i), *reheated->get_sketch(i));
+  }
+
+  // and samples as a supernode that holds every depth
+  for (int i = 0; i < full->get_num_sktch(); ++i) {
+    ASSERT_EQ(full->sample(), adaptive->sample());
+  }
+  Sketch::set_adaptive_depth(false);
+  Sketch::set_layout(COLUMN_MAJOR);
+  free(full);
+  free(full_odd);
+  free(adaptive);
+  free(adaptive_odd);
+  free(reheated);
+}
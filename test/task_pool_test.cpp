@@ -0,0 +1,49 @@
+#include <gtest/gtest.h>
+#include <atomic>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include "../include/task_pool.h"
+
+// Every iteration runs exactly once, for loops of a single chunk and of many
+TEST(TaskPoolTestSuite, TestEveryIterationOnce) {
+  TaskPool::set_num_threads(4);
+  for (size_t grain : {1, 7, 1000, 5000}) {
+    std::vector<std::atomic<int>> runs(1000);
+    for (auto &r : runs) r = 0;
+    TaskPool::parallel_for(0, runs.size(), grain, [&](size_t i) { ++runs[i]; });
+    for (auto &r : runs) ASSERT_EQ(1, r);
+  }
+  TaskPool::set_num_threads(0);
+}
+
+// Loops opened from within the chunks of a loop, and by several threads at once,
+// are run by their callers rather than waiting for the pool
+TEST(TaskPoolTestSuite, TestNestedAndConcurrentLoops) {
+  TaskPool::set_num_threads(2);
+  std::atomic<size_t> sum{0};
+  auto outer = [&]() {
+    TaskPool::parallel_for(0, 64, 1, [&](size_t i) {
+      TaskPool::parallel_for(0, 64, 1, [&](size_t j) { sum += i * 64 + j; });
+    });
+  };
+  std::vector<std::thread> callers;
+  for (int t = 0; t < 4; ++t) callers.emplace_back(outer);
+  for (auto &thr : callers) thr.join();
+  size_t n = 64 * 64;
+  ASSERT_EQ(4 * (n * (n - 1) / 2), sum);
+  TaskPool::set_num_threads(0);
+}
+
+// An exception thrown by any chunk is rethrown to the caller of the loop
+TEST(TaskPoolTestSuite, TestExceptionRethrown) {
+  TaskPool::set_num_threads(4);
+  ASSERT_THROW(TaskPool::parallel_for(0, 1000, 1, [](size_t i) {
+    if (i == 517) throw std::runtime_error("chunk failed");
+  }), std::runtime_error);
+  // the pool is still usable afterwards
+  std::atomic<size_t> count{0};
+  TaskPool::parallel_for(0, 1000, 1, [&](size_t) { ++count; });
+  ASSERT_EQ(1000, count);
+  TaskPool::set_num_threads(0);
+}
@@ -1,13 +1,18 @@
 #include <benchmark/benchmark.h>
 #include <xxhash.h>
+#include <chrono>
 #include <iostream>
 #include <unistd.h>
 #include <fstream>
 #include <vector>
+#include <random>
 #include <thread>
 
 #include "binary_graph_stream.h"
 #include "bucket.h"
+#include "graph.h"
+#include "sketch_kernels.h"
+#include "supernode.h"
 #include "test/sketch_constructors.h"
 
 constexpr uint64_t KB   = 1024;
@@ -123,6 +128,70 @@ static void BM_Hash_XXH3_64(benchmark::State &state) {
 }
 BENCHMARK(BM_Hash_XXH3_64)->Arg(1)->Arg(100)->Arg(10000);
 
+static void BM_Hash_MultiplyShift(benchmark::State &state) {
+  uint64_t num_seeds = 8;
+  uint64_t num_hashes = state.range(0);
+  uint64_t output;
+  for (auto _ : state) {
+    for (uint64_t h = 0; h < num_seeds; h++) {
+      MultiplyShiftHash::Params hash(seed + h);
+      for (uint64_t i = 0; i < num_hashes; i++) {
+        benchmark::DoNotOptimize(output = hash(i));
+      }
+    }
+  }
+  state.counters["Hashes"] = benchmark::Counter(state.iterations() * num_hashes, benchmark::Counter::kIsRate);
+}
+BENCHMARK(BM_Hash_MultiplyShift)->Arg(1)->Arg(100)->Arg(10000);
+
+static void BM_Hash_Tabulation(benchmark::State &state) {
+  uint64_t num_seeds = 8;
+  uint64_t num_hashes = state.range(0);
+  uint64_t output;
+  for (auto _ : state) {
+    for (uint64_t h = 0; h < num_seeds; h++) {
+      const TabulationHash::Tables &tables = TabulationHash::keys(seed, num_seeds).cols[h];
+      for (uint64_t i = 0; i < num_hashes; i++) {
+        benchmark::DoNotOptimize(output = TabulationHash::hash(tables, i));
+      }
+    }
+  }
+  state.counters["Hashes"] = benchmark::Counter(state.iterations() * num_hashes, benchmark::Counter::kIsRate);
+}
+BENCHMARK(BM_Hash_Tabulation)->Arg(1)->Arg(100)->Arg(10000);
+
+// Compare the hash families end to end upon Sketch::batch_update
+// The second argument is the HashFamily (0 = xxh64, 1 = xxh3, 2 = multiply_shift, 3 = tabulation)
+static void BM_Hash_Family_Batch_Update(benchmark::State &state) {
+  constexpr size_t upd_per_sketch = 10000;
+  constexpr size_t num_sketches   = 100;
+  size_t vec_size = state.range(0);
+  auto family = (HashFamily) state.range(1);
+  state.SetLabel(hash_family_name(family));
+
+  // initialize sketches
+  Sketch::configure(vec_size, 100);
+  Sketch::set_hash_family(family);
+  SketchUniquePtr sketches[num_sketches];
+  for (size_t i = 0; i < num_sketches; i++) {
+    sketches[i] = makeSketch(seed + i);
+  }
+  std::vector<vec_t> updates(upd_per_sketch);
+  for (size_t j = 0; j < upd_per_sketch; j++) {
+    updates[j] = j % vec_size;
+  }
+
+  for (auto _ : state) {
+    for (size_t i = 0; i < num_sketches; i++) {
+      sketches[i]->batch_update(updates);
+    }
+  }
+  state.counters["Update_Rate"] = benchmark::Counter(state.iterations() * upd_per_sketch * num_sketches,
+                                                     benchmark::Counter::kIsRate);
+  Sketch::set_hash_family(XXH64_HASH);
+}
+BENCHMARK(BM_Hash_Family_Batch_Update)->ArgsProduct({{KB << 4, MB << 4}, {0, 1, 2, 3}});
+
 static void BM_Hash_bucket(benchmark::State &state) {
   uint64_t num_seeds = 8;
   uint64_t num_hashes = state.range(0);
@@ -138,6 +207,69 @@ static void BM_Hash_bucket(benchmark::State &state) {
 }
 BENCHMARK(BM_Hash_bucket)->Arg(1)->Arg(100)->Arg(10000);
 
+// Benchmark computing every hash of an update for all the sketches of a supernode.
+// COLUMN_HASHING computes num_buckets XXH64 plus one XXH32 per sketch while
+// WIDE_HASHING computes one XXH3-128 and expands it.
+// The first argument is the number of sketches per supernode, the second is the SketchHashing
+static void BM_Hash_Supernode(benchmark::State &state) {
+  constexpr uint64_t num_buckets = 7; // bucket_gen(100)
+  constexpr uint64_t sketch_width = 4; // guess_gen(100)
+  uint64_t num_sketches = state.range(0);
+  auto hashing = (SketchHashing) state.range(1);
+  state.SetLabel(hashing == WIDE_HASHING ? "wide" : "column");
+  uint64_t output;
+  for (auto _ : state) {
+    for (uint64_t i = 0; i < 1000; i++) {
+      if (hashing == WIDE_HASHING) {
+        wide_hash_t wide = Bucket_Boruvka::wide_index_hash(i);
+        for (uint64_t s = 0; s < num_sketches; s++) {
+          uint64_t sketch_seed = seed + s * sketch_width;
+          benchmark::DoNotOptimize(output = Bucket_Boruvka::wide_checksum(wide,
+                     Bucket_Boruvka::wide_key(Bucket_Boruvka::wide_checksum_seed(sketch_seed))));
+          for (uint64_t c = 0; c < num_buckets; c++)
+            benchmark::DoNotOptimize(output = Bucket_Boruvka::wide_col_index_hash(wide,
+                                              Bucket_Boruvka::wide_key(sketch_seed + c)));
+        }
+      } else {
+        for (uint64_t s = 0; s < num_sketches; s++) {
+          uint64_t sketch_seed = seed + s * sketch_width;
+          benchmark::DoNotOptimize(output = Bucket_Boruvka::index_hash(i, sketch_seed));
+          for (uint64_t c = 0; c < num_buckets; c++)
+            benchmark::DoNotOptimize(output = Bucket_Boruvka::col_index_hash(i, sketch_seed + c));
+        }
+      }
+    }
+  }
+  state.counters["Updates"] = benchmark::Counter(state.iterations() * 1000, benchmark::Counter::kIsRate);
+  state.counters["Hashes_Per_Update"] = hashing == WIDE_HASHING ? 1 : num_sketches * (num_buckets + 1);
+}
+BENCHMARK(BM_Hash_Supernode)->ArgsProduct({{1, 17, 34}, {0, 1}});
+
+// Benchmark building a delta supernode from a batch of updates with each SketchHashing
+// The first argument is the number of nodes in the graph, the second is the SketchHashing
+static void BM_Supernode_Delta_Hashing(benchmark::State &state) {
+  constexpr size_t num_updates = 1000;
+  node_id_t num_nodes = state.range(0);
+  auto hashing = (SketchHashing) state.range(1);
+  state.SetLabel(hashing == WIDE_HASHING ? "wide" : "column");
+  Sketch::set_hashing(hashing);
+  Supernode::configure(num_nodes);
+  void *loc = malloc(Supernode::get_size());
+
+  std::vector<vec_t> updates(num_updates);
+  for (size_t i = 0; i < num_updates; i++)
+    updates[i] = nondirectional_non_self_edge_pairing_fn(0, i % (num_nodes - 1) + 1);
+
+  for (auto _ : state) {
+    Supernode::delta_supernode(num_nodes, seed, updates, loc);
+  }
+  state.counters["Update_Rate"] = benchmark::Counter(state.iterations() * num_updates,
+                                                     benchmark::Counter::kIsRate);
+  free(loc);
+  Sketch::set_hashing(COLUMN_HASHING);
+}
+BENCHMARK(BM_Supernode_Delta_Hashing)->ArgsProduct({{KB, KB << 6, MB}, {0, 1}});
+
 // Benchmark the speed of updating sketches both serially and in batch mode
 static void BM_Sketch_Update(benchmark::State &state) {
   constexpr size_t upd_per_sketch = 10000;
@@ -185,6 +317,257 @@ static void BM_Sketch_Update(benchmark::State &state) {
 }
 BENCHMARK(BM_Sketch_Update)->RangeMultiplier(4)->Ranges({{KB << 4, MB << 4}, {false, true}});
 
+// Benchmark batched sketch updates using the hashing kernels of a specific instruction set
+// The second argument is the SketchKernels::KernelISA (0 = Scalar, 1 = AVX2, 2 = AVX512)
+static void BM_Sketch_Update_ISA(benchmark::State &state) {
+  constexpr size_t upd_per_sketch = 10000;
+  constexpr size_t num_sketches   = 1000;
+  size_t vec_size = state.range(0);
+  auto isa = (SketchKernels::KernelISA) state.range(1);
+  if (!SketchKernels::set_isa(isa)) {
+    state.SkipWithError("Instruction set not supported by this CPU");
+    return;
+  }
+  state.SetLabel(SketchKernels::isa_name(isa));
+
+  // initialize sketches
+  Sketch::configure(vec_size, 100);
+  SketchUniquePtr sketches[num_sketches];
+  for (size_t i = 0; i < num_sketches; i++) {
+    sketches[i] = makeSketch(seed + i);
+  }
+
+  // initialize updates
+  std::vector<vec_t> updates;
+  updates.reserve(upd_per_sketch);
+  for (size_t j = 0; j < upd_per_sketch; j++) {
+    updates.push_back(j % vec_size);
+  }
+
+  for (auto _ : state) {
+    for (size_t i = 0; i < num_sketches; i++) {
+      sketches[i]->batch_update(updates);
+    }
+  }
+  state.counters["Update_Rate"] = benchmark::Counter(state.iterations() * upd_per_sketch * num_sketches,
+                                                     benchmark::Counter::kIsRate);
+  SketchKernels::set_isa(SketchKernels::detect_isa());
+}
+BENCHMARK(BM_Sketch_Update_ISA)->ArgsProduct({{KB << 4, KB << 8, KB << 12, MB << 4}, {0, 1, 2}});
+
+// Benchmark the kernels compiled for each geometry class against the dynamic kernels
+// The first argument is log2 of the number of nodes of the class (16, 20, 24, 28),
+// the second selects the SketchGeometry (0 = dynamic, 1 = exact) and the third the
+// operation (0 = update, 1 = batch_update, 2 = query)
+static void BM_Sketch_Geometry(benchmark::State &state) {
+  constexpr size_t num_sketches = 100;
+  constexpr size_t upd_per_sketch = 1000;
+  uint64_t num_nodes = 1ull << state.range(0);
+  auto geometry = (SketchGeometry) state.range(1);
+  int op = state.range(2);
+  const char *op_names[] = {"update", "batch_update", "query"};
+  state.SetLabel(std::string(geometry == DYNAMIC_GEOMETRY ? "dynamic " : "fixed ") + op_names[op]);
+  SketchGeometry default_geometry = Sketch::get_geometry();
+  Sketch::set_geometry(geometry);
+  Sketch::configure(num_nodes * num_nodes, 100);
+
+  SketchUniquePtr sketches[num_sketches];
+  for (size_t i = 0; i < num_sketches; i++) {
+    sketches[i] = makeSketch(seed + i);
+  }
+  std::vector<vec_t> updates(upd_per_sketch);
+  for (size_t j = 0; j < upd_per_sketch; j++) {
+    updates[j] = nondirectional_non_self_edge_pairing_fn(j, j + 1 + j % 7);
+  }
+  // queries of sketches holding many updates scan every bucket
+  if (op == 2) {
+    for (size_t i = 0; i < num_sketches; i++)
+      sketches[i]->batch_update(updates);
+  }
+  std::pair<vec_t, SampleSketchRet> q_ret;
+
+  for (auto _ : state) {
+    for (size_t i = 0; i < num_sketches; i++) {
+      if (op == 0) {
+        for (vec_t update : updates)
+          sketches[i]->update(update);
+      } else if (op == 1) {
+        sketches[i]->batch_update(updates);
+      } else {
+        benchmark::DoNotOptimize(q_ret = sketches[i]->query());
+        sketches[i]->reset_queried();
+      }
+    }
+  }
+  size_t ops_per_sketch = op == 2 ? 1 : upd_per_sketch;
+  state.counters["Rate"] = benchmark::Counter(state.iterations() * ops_per_sketch * num_sketches,
+                                              benchmark::Counter::kIsRate);
+  Sketch::set_geometry(default_geometry);
+}
+BENCHMARK(BM_Sketch_Geometry)->ArgsProduct({{16, 20, 24, 28}, {0, 1}, {0, 1, 2}});
+
+// Benchmark the bucket layouts by performing updates round robin over many sketches
+// so that nearly every update misses in cache. Run with --benchmark_perf_counters=CACHE-MISSES
+// (requires google benchmark built with libpfm) to see the misses directly.
+// The second argument is the SketchLayout (0 = COLUMN_MAJOR, 1 = DEPTH_MAJOR)
+static void BM_Sketch_Update_Layout(benchmark::State &state) {
+  constexpr size_t upd_per_sketch = 1000;
+  constexpr size_t num_sketches   = 10000;
+  size_t vec_size = state.range(0);
+  auto layout = (SketchLayout) state.range(1);
+  state.SetLabel(layout == DEPTH_MAJOR ? "depth_major" : "column_major");
+
+  // initialize sketches
+  Sketch::configure(vec_size, 100);
+  Sketch::set_layout(layout);
+  SketchUniquePtr sketches[num_sketches];
+  for (size_t i = 0; i < num_sketches; i++) {
+    sketches[i] = makeSketch(seed + i);
+  }
+
+  for (auto _ : state) {
+    for (size_t j = 0; j < upd_per_sketch; j++) {
+      for (size_t i = 0; i < num_sketches; i++) {
+        sketches[i]->update((j * num_sketches + i) % vec_size);
+      }
+    }
+  }
+  state.counters["Update_Rate"] = benchmark::Counter(state.iterations() * upd_per_sketch * num_sketches,
+                                                     benchmark::Counter::kIsRate);
+  state.counters["Sketch_Bytes"] = Sketch::sketchSizeof();
+  Sketch::set_layout(COLUMN_MAJOR);
+}
+BENCHMARK(BM_Sketch_Update_Layout)->ArgsProduct({{KB << 4, MB << 4, (uint64_t) 1 << 40}, {0, 1}});
+
+// Benchmark the per update batch kernel against the write once per bucket suffix xor kernel
+// upon Supernode::delta_supernode. Used to choose the default Sketch::suffix_xor_threshold.
+// The first argument is the batch size, the second selects the kernel (0 = per update, 1 = suffix xor)
+static void BM_Sketch_Suffix_XOR(benchmark::State &state) {
+  constexpr node_id_t num_nodes = KB << 6;
+  size_t num_updates = state.range(0);
+  bool suffix = state.range(1);
+  state.SetLabel(suffix ? "suffix_xor" : "per_update");
+  Supernode::configure(num_nodes);
+  size_t default_threshold = Sketch::get_suffix_xor_threshold();
+  Sketch::set_suffix_xor_threshold(suffix ? 1 : SIZE_MAX);
+  void *loc = malloc(Supernode::get_size());
+
+  std::vector<vec_t> updates(num_updates);
+  for (size_t i = 0; i < num_updates; i++)
+    updates[i] = nondirectional_non_self_edge_pairing_fn(0, i % (num_nodes - 1) + 1);
+
+  for (auto _ : state) {
+    Supernode::delta_supernode(num_nodes, seed, updates, loc);
+  }
+  state.counters["Update_Rate"] = benchmark::Counter(state.iterations() * num_updates,
+                                                     benchmark::Counter::kIsRate);
+  free(loc);
+  Sketch::set_suffix_xor_threshold(default_threshold);
+}
+BENCHMARK(BM_Sketch_Suffix_XOR)->ArgsProduct({{8, 16, 32, 64, 128, 512, 2048}, {0, 1}});
+
+// Benchmark applying a batch through a delta supernode against applying it in place
+// (as Graph::batch_update does). Used to choose the default Supernode::in_place_threshold.
+// The first argument is the batch size, the second selects the method (0 = delta, 1 = in place)
+static void BM_Supernode_In_Place(benchmark::State &state) {
+  constexpr node_id_t num_nodes = KB << 6;
+  size_t num_updates = state.range(0);
+  bool in_place = state.range(1);
+  state.SetLabel(in_place ? "in_place" : "delta");
+  Supernode::configure(num_nodes);
+  Supernode *node = Supernode::makeSupernode(num_nodes, seed);
+  void *loc = malloc(Supernode::get_size());
+  std::vector<char> bundles(num_updates * Supernode::get_bundle_size());
+
+  std::vector<vec_t> updates(num_updates);
+  for (size_t i = 0; i < num_updates; i++)
+    updates[i] = nondirectional_non_self_edge_pairing_fn(0, i % (num_nodes - 1) + 1);
+
+  for (auto _ : state) {
+    Supernode::hash_updates(num_nodes, seed, updates.data(), num_updates, bundles.data());
+    if (in_place) {
+      node->apply_hashed_updates(updates.data(), num_updates, bundles.data());
+    } else {
+      Supernode::delta_supernode(num_nodes, seed, updates, bundles.data(), loc);
+      node->apply_delta_update((Supernode *) loc);
+    }
+  }
+  state.counters["Update_Rate"] = benchmark::Counter(state.iterations() * num_updates,
+                                                     benchmark::Counter::kIsRate);
+  free(loc);
+  free(node);
+}
+BENCHMARK(BM_Supernode_In_Place)->ArgsProduct({{1, 4, 16, 64, 256, 1024}, {0, 1}});
+
+// Benchmark many graph workers adding deltas to the supernode of one hot vertex, as for
+// the highest degree vertices of a skewed stream. The argument is the number of updates
+// of each delta, which are built before timing. Compare builds with and without
+// SUPERNODE_ATOMIC_XOR.
+static void BM_Supernode_Contention(benchmark::State &state) {
+  constexpr node_id_t num_nodes = KB << 6;
+  static Supernode *hot;
+  size_t num_updates = state.range(0);
+  if (state.thread_index() == 0) {
+    Supernode::configure(num_nodes);
+    hot = Supernode::makeSupernode(num_nodes, seed);
+  }
+  void *loc = malloc(Supernode::get_size());
+  std::vector<char> bundles(num_updates * Supernode::get_bundle_size());
+  std::vector<vec_t> updates(num_updates);
+  for (size_t i = 0; i < num_updates; i++)
+    updates[i] = nondirectional_non_self_edge_pairing_fn(0, (i * state.threads() +
+                                                         state.thread_index()) % (num_nodes - 1) + 1);
+
+  Supernode::hash_updates(num_nodes, seed, updates.data(), num_updates, bundles.data());
+  Supernode::delta_supernode(num_nodes, seed, updates, bundles.data(), loc);
+
+  for (auto _ : state) {
+    hot->apply_delta_update((Supernode *) loc);
+  }
+  state.counters["Delta_Rate"] = benchmark::Counter(state.iterations(),
+                                                    benchmark::Counter::kIsRate);
+  free(loc);
+  if (state.thread_index() == 0) free(hot);
+}
+BENCHMARK(BM_Supernode_Contention)->RangeMultiplier(16)->Range(16, 4096)->ThreadRange(1, 16)
+                                  ->UseRealTime();
+
+// Benchmark merging supernodes using the XOR kernel of a specific instruction set
+// The first argument is the number of supernodes merged into one, which determines whether
+// they fit in cache. The second is the SketchKernels::KernelISA (0 = Scalar, 1 = AVX2, 2 = AVX512)
+static void BM_Supernode_Merge(benchmark::State &state) {
+  constexpr node_id_t num_nodes = MB;
+  size_t num_merged = state.range(0);
+  auto isa = (SketchKernels::KernelISA) state.range(1);
+  if (!SketchKernels::set_isa(isa)) {
+    state.SkipWithError("Instruction set not supported by this CPU");
+    return;
+  }
+  state.SetLabel(SketchKernels::isa_name(isa));
+  Supernode::configure(num_nodes);
+  Supernode *node = Supernode::makeSupernode(num_nodes, seed);
+  std::vector<Supernode *> others(num_merged);
+  for (size_t i = 0; i < num_merged; i++) {
+    others[i] = Supernode::makeSupernode(num_nodes, seed);
+    others[i]->update(nondirectional_non_self_edge_pairing_fn(0, i + 1));
+  }
+
+  for (auto _ : state) {
+    for (size_t i = 0; i < num_merged; i++)
+      node->merge(*others[i]);
+  }
+  state.counters["Merge_Rate"] = benchmark::Counter(state.iterations() * num_merged,
+                                                    benchmark::Counter::kIsRate);
+  state.counters["Bytes_Rate"] = benchmark::Counter(state.iterations() * num_merged *
+                                                    Supernode::get_size(),
+                                                    benchmark::Counter::kIsRate,
+                                                    benchmark::Counter::kIs1024);
+  for (auto other : others) free(other);
+  free(node);
+  SketchKernels::set_isa(SketchKernels::detect_isa());
+}
+BENCHMARK(BM_Supernode_Merge)->ArgsProduct({{16, KB << 4}, {0, 1, 2}});
+
 // Benchmark the speed of querying sketches
 static void BM_Sketch_Query(benchmark::State &state) {
   constexpr size_t vec_size     = KB << 5;
@@ -217,4 +600,133 @@ static void BM_Sketch_Query(benchmark::State &state) {
 }
 BENCHMARK(BM_Sketch_Query)->DenseRange(0, 90, 10);
 
+// Benchmark querying sketches that share a seed (as in a round of Boruvka) one at a time
+// and together with Sketch::query_batch.
+// The first argument is the density as in BM_Sketch_Query, the second selects the
+// method (0 = query, 1 = query_batch)
+static void BM_Sketch_Query_Batch(benchmark::State &state) {
+  constexpr size_t vec_size     = KB << 5;
+  constexpr size_t num_sketches = 100;
+  double density = ((double)state.range(0)) / 100;
+  bool batch = state.range(1);
+  state.SetLabel(batch ? "query_batch" : "query");
+
+  Sketch::configure(vec_size, 100);
+  SketchUniquePtr sketches[num_sketches];
+  Sketch *sketch_ptrs[num_sketches];
+  for (size_t i = 0; i < num_sketches; i++) {
+    sketches[i] = makeSketch(seed);
+    sketch_ptrs[i] = sketches[i].get();
+    // perform updates (do at least 1), offset so the sketches differ
+    for (size_t j = 0; j < vec_size * density + 1; j++) {
+      sketches[i]->update((i + j) % vec_size + 1);
+    }
+  }
+  std::pair<vec_t, SampleSketchRet> q_ret[num_sketches];
+
+  for (auto _ : state) {
+    if (batch) {
+      Sketch::query_batch(sketch_ptrs, num_sketches, q_ret);
+    } else {
+      for (size_t j = 0; j < num_sketches; j++)
+        q_ret[j] = sketches[j]->query();
+    }
+    benchmark::DoNotOptimize(q_ret);
+    for (size_t j = 0; j < num_sketches; j++)
+      sketches[j]->reset_queried();
+  }
+  state.counters["Query_Rate"] = benchmark::Counter(state.iterations() * num_sketches, benchmark::Counter::kIsRate);
+}
+BENCHMARK(BM_Sketch_Query_Batch)->ArgsProduct({{0, 10, 50, 90}, {0, 1}});
+
+// Benchmark the time from constructing a Graph to its first accepted update
+// The argument is log2 of the number of nodes. Uses the streaming.conf of the working directory.
+static void BM_Graph_Startup(benchmark::State &state) {
+  node_id_t num_nodes = (node_id_t) 1 << state.range(0);
+  for (auto _ : state) {
+    auto start = std::chrono::steady_clock::now();
+    Graph *g = new Graph(num_nodes);
+    g->update({{0, 1}, INSERT});
+    auto end = std::chrono::steady_clock::now();
+    state.SetIterationTime(std::chrono::duration<double>(end - start).count());
+    delete g;
+  }
+}
+BENCHMARK(BM_Graph_Startup)->DenseRange(12, 20, 4)->UseManualTime();
+
+// Benchmark the rate at which a graph worker applies batches of random edges to the
+// supernodes of a graph on 2^14 nodes. The first argument is the size of each batch,
+// the second the number of batches applied together (see GraphT::batch_updates), 1
+// to apply each with batch_update. Uses the streaming.conf of the working directory.
+static void BM_Graph_Batch_Packing(benchmark::State &state) {
+  constexpr node_id_t num_nodes = 1 << 14;
+  constexpr size_t num_batches = 1 << 14;
+  size_t batch_size = state.range(0);
+  size_t pack_size = state.range(1);
+  Graph g{num_nodes};
+  void *delta_loc = malloc(Supernode::get_size());
+
+  std::mt19937_64 gen(seed);
+  std::vector<std::pair<node_id_t, std::vector<node_id_t>>> batches(num_batches);
+  for (auto &batch : batches) {
+    batch.first = gen() % num_nodes;
+    while (batch.second.size() < batch_size) {
+      node_id_t dst = gen() % num_nodes;
+      if (dst != batch.first) batch.second.push_back(dst);
+    }
+  }
+  auto apply_all = [&]() {
+    for (size_t b = 0; b < num_batches; b += pack_size) {
+      if (pack_size == 1)
+        g.batch_update(batches[b].first, batches[b].second, delta_loc);
+      else
+        g.batch_updates(&batches[b], std::min(pack_size, num_batches - b), delta_loc);
+    }
+  };
+  apply_all(); // construct the supernodes outside of the timing
+
+  for (auto _ : state) {
+    apply_all();
+  }
+  state.counters["Update_Rate"] = benchmark::Counter(state.iterations() * num_batches * batch_size,
+                                                     benchmark::Counter::kIsRate);
+  state.counters["Supernode_Bytes"] = g.get_supernode_bytes();
+  free(delta_loc);
+}
+BENCHMARK(BM_Graph_Batch_Packing)->ArgsProduct({{1, 4, 16, 64}, {1, 16, 64}});
+
+// Benchmark the time to answer connected components of the kron16 graph stream, from
+// constructing the Graph. The argument is whether the stream is prescanned for the
+// update counts of each node (see Graph::reserve_updates), whose time is included.
+// Uses the streaming.conf of the working directory.
+static void BM_Degree_Prescan(benchmark::State &state) {
+  for (auto _ : state) {
+    flush_filesystem_cache();
+    auto start = std::chrono::steady_clock::now();
+    BinaryGraphStream_MT stream("/mnt/ssd2/binary_streams/kron_16_stream_binary", 32 * 1024);
+    Graph g{stream.nodes()};
+    if (state.range(0)) {
+      auto prescan_start = std::chrono::steady_clock::now();
+      std::vector<node_id_t> counts = stream.update_counts(std::thread::hardware_concurrency());
+      state.counters["Prescan_Seconds"] = std::chrono::duration<double>(
+          std::chrono::steady_clock::now() - prescan_start).count();
+      g.reserve_updates(counts);
+    }
+    MT_StreamReader reader(stream);
+    GraphUpdate upd;
+    while ((upd = reader.get_edge()).second != END_OF_FILE)
+      g.update(upd);
+    benchmark::DoNotOptimize(g.connected_components());
+    auto end = std::chrono::steady_clock::now();
+    state.SetIterationTime(std::chrono::duration<double>(end - start).count());
+    state.counters["Cancelled_Updates"] = g.get_num_cancelled();
+    state.counters["Boruvka_Rounds"] = g.get_num_rounds();
+    if (g.get_edge_cache() != nullptr) {
+      state.counters["Edge_Cache_Hits"] = g.get_edge_cache()->get_hits();
+      state.counters["Edge_Cache_Misses"] = g.get_edge_cache()->get_misses();
+    }
+  }
+}
+BENCHMARK(BM_Degree_Prescan)->Arg(0)->Arg(1)->UseManualTime();
+
 BENCHMARK_MAIN();
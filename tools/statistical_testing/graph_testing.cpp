@@ -51,12 +51,19 @@ int main() {
     std::ofstream out;
 
     // run both with GutterTree and StandAloneGutters
-    for(int i = 0; i < 2; i++) { 
-        bool use_tree = (bool) i;
+    // and then again with wide hashing, which must not change the failure rate
+    for(int i = 0; i < 4; i++) { 
+        bool use_tree = (bool) (i % 2);
+        bool wide_hashing = i >= 2;
 
         // setup configuration file per buffering
-        write_configuration(use_tree, 4);
+        TestConfiguration config;
+        config.use_tree = use_tree;
+        config.backup_in_mem = true;
+        config.wide_hashing = wide_hashing;
+        write_configuration(config);
         std::string prefix = use_tree? "tree" : "gutters";
+        if (wide_hashing) prefix = "wide_" + prefix;
         std::string test_name;
 
         /************* small graph test *************/
@@ -101,23 +101,27 @@ if __name__ == "__main__":
 	# Run the tests
 	run_test(build_path)
 
-	for pre in ["tree", "gutters"]:
-		if pre == "tree":
-			log += "GutterTree\n"
+	err_found = False
+	for pre in ["tree", "gutters", "wide_tree", "wide_gutters"]:
+		if pre.endswith("tree"):
+			log += "GutterTree"
 		else:
-			log += "StandAloneGutters\n"
+			log += "StandAloneGutters"
+		if pre.startswith("wide"):
+			log += " (wide hashing)"
+		log += "\n"
 
 		# Collect statistical results
 		# test_name, test_result_file, expected_result_file
 		try:
 			print("small test")
-			small_err, small_dsc   = check_error('small test', pre + 'small_graph_test', stat_path + '/small_test_expected.txt')
+			small_err, small_dsc   = check_error('small test', pre + '_small_graph_test', stat_path + '/small_test_expected.txt')
 		except Exception as err:
 			small_err = True
 			small_dsc = "test threw expection: {0}".format(err)
 		try:
 			print("medium test")
-			medium_err, medium_dsc = check_error('medium test', pre + 'medium_graph_test', stat_path + '/medium_test_expected.txt')
+			medium_err, medium_dsc = check_error('medium test', pre + '_medium_graph_test', stat_path + '/medium_test_expected.txt')
 		except Exception as err:
 			medium_err = True
 			medium_dsc = "test threw expection: {0}".format(err)
@@ -125,6 +129,7 @@ if __name__ == "__main__":
 		# Create a log, and send email
 		log += log_result('small test', small_err, small_dsc) + "\n"
 		log += log_result('medium test', medium_err, medium_dsc) + "\n"
+		err_found = err_found or small_err or medium_err
 
 	print("Sending email!")
-	send_email(small_err or medium_err, log, usr, pwd)
+	send_email(err_found, log, usr, pwd)